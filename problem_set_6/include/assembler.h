@@ -0,0 +1,85 @@
+#ifndef ASSEMBLER_H
+#define ASSEMBLER_H
+#include "emit.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// The built-in assembler encodes the instruction list from emit.h into x86-64 machine code,
+// without going through textual assembly.
+// References between sections, and to labels that are never defined (library functions),
+// are left as relocations, to be resolved by the ELF writer or the JIT.
+
+typedef struct
+{
+    section_t section; // The section containing the field to patch
+    size_t offset;     // The position of the field within its section
+    uint8_t size;      // The size of the field in bytes, 4 or 1
+    label_t label;     // The label whose address is referenced
+    int64_t addend;    // The field is patched with: address(label) + addend - address(field)
+    bool is_call;      // The reference is the target of a call, and may go through a PLT
+} relocation_t;
+
+typedef struct
+{
+    uint8_t *bytes;    // The contents of the section. Always NULL for SECTION_BSS
+    size_t size;
+    size_t capacity;
+    size_t alignment;  // The largest alignment requested in the section
+} section_data_t;
+
+typedef struct
+{
+    bool defined;
+    bool global;
+    section_t section;
+    size_t offset;
+    size_t size; // The size of the function starting at the label, if given by OP_FUNCTION_END, or 0
+} label_definition_t;
+
+typedef struct
+{
+    section_data_t sections[_SECTION_COUNT];
+
+    // Indexed by label id
+    label_definition_t *labels;
+    size_t n_labels;
+
+    // Only references that could not be resolved within a section
+    relocation_t *relocations;
+    size_t n_relocations;
+    size_t relocations_capacity;
+} assembly_t;
+
+// Encodes the entire instruction list into machine code
+assembly_t* assemble_program ( void );
+void destroy_assembly ( assembly_t *assembly );
+
+// Writes the assembled program to output as an ELF64 relocatable object file. Implemented in elf.c
+void write_elf_object ( assembly_t *assembly, FILE *output );
+
+// Resolves a label that the assembled code references, but does not define, to an absolute address
+typedef void* (*label_resolver_t) ( const char *name );
+
+// Returns the number of bytes needed to load the assembled code, a multiple of the page size
+size_t loaded_size ( assembly_t *assembly );
+// Loads the assembled code into memory, which must be page aligned, writable and loaded_size bytes long.
+// Calls to undefined labels go through stubs, and can reach any address. Other references to undefined
+// labels must be within 2GiB of the code. Afterwards, the code is executable, but no longer writable.
+void load_assembly ( assembly_t *assembly, uint8_t *memory, label_resolver_t resolve );
+// Returns the address of the named label in code loaded at memory, or NULL if it is not defined
+void* loaded_label_address ( assembly_t *assembly, uint8_t *memory, const char *name );
+// Resolves the library functions the generated code calls, to the ones linked into vslc
+void* find_host_function ( const char *name );
+
+// The signature of the main function of the generated program
+typedef int (*jit_entry_t) ( int argc, char **argv );
+
+// Loads the assembled program into new executable memory, with calls to library functions going to
+// the ones linked into vslc. Returns the generated main function.
+// Everything above is implemented in jit.c
+jit_entry_t load_program ( assembly_t *assembly );
+
+#endif // ASSEMBLER_H
@@ -0,0 +1,124 @@
+#ifndef BYTECODE_H
+#define BYTECODE_H
+#include "vslc.h"
+
+#include <stdatomic.h>
+
+// The bytecode is a compact, register based form of the bound syntax tree, which is run by the
+// interpreter in interpreter.c, without needing an assembler or linker.
+//
+// Every function call gets its own window of registers. The parameters come first, then the local
+// variables, both numbered by their sequence number, and then temporaries for evaluating expressions.
+// Global variables and arrays live in one flat block of memory, addressed in 8-byte words.
+//
+// Relations are never evaluated on their own, so comparing and branching is always a single instruction.
+// A few superinstructions fuse an add with the load of one of its operands.
+
+typedef enum
+{
+    BC_MOVE,    // R[a] = R[b]
+    BC_LOADI,   // R[a] = b, a 32-bit immediate
+    BC_LOADK,   // R[a] = constants[b]
+    BC_LOADG,   // R[a] = memory[b]
+    BC_STOREG,  // memory[b] = R[a]
+    BC_LOADA,   // R[a] = memory[b + R[c]]
+    BC_STOREA,  // memory[b + R[c]] = R[a]
+
+    BC_ADD,     // R[a] = R[b] + R[c]
+    BC_SUB,     // R[a] = R[b] - R[c]
+    BC_MUL,     // R[a] = R[b] * R[c]
+    BC_DIV,     // R[a] = R[b] / R[c]
+    BC_SHL,     // R[a] = R[b] << R[c]
+    BC_SHR,     // R[a] = R[b] >> R[c]
+    BC_NEG,     // R[a] = -R[b]
+    BC_ADDI,    // R[a] = R[b] + c
+    BC_ADDG,    // R[a] = R[b] + memory[c]
+
+    BC_JMP,     // Jump to c
+    // Jump to c if R[a] compared to R[b] holds
+    BC_JEQ, BC_JNE, BC_JLT, BC_JLE, BC_JGT, BC_JGE,
+    // Jump to c if R[a] compared to the immediate b holds
+    BC_JEQI, BC_JNEI, BC_JLTI, BC_JLEI, BC_JGTI, BC_JGEI,
+
+    BC_CALL,    // R[a] = functions[b] ( R[c], R[c+1], ... )
+    BC_RET,     // Return R[a]
+
+    BC_PRINTI,  // Print R[a] as a number
+    BC_PRINTS,  // Print strings[b]
+    BC_NEWLINE, // Print a newline
+
+    _BC_COUNT
+} bytecode_opcode_t;
+
+typedef struct
+{
+    uint16_t opcode;
+    uint16_t a;       // The destination register, or the register being stored or compared
+    int32_t b, c;
+} bytecode_t;
+
+typedef struct
+{
+    symbol_t *symbol;     // The function's symbol, not owned
+    size_t entry;         // The index of the function's first instruction
+    size_t n_parameters;
+    size_t n_variables;   // Parameters and local variables, which start out as the arguments and 0
+    size_t n_registers;   // The size of the register window, including temporaries
+} bytecode_function_t;
+
+typedef struct
+{
+    bytecode_t *code;
+    size_t n_code;
+
+    // Indexed by the order functions are declared in. The first one is where the program starts
+    bytecode_function_t *functions;
+    size_t n_functions;
+
+    int64_t *constants;   // Numbers that don't fit in a 32-bit immediate
+    size_t n_constants;
+
+    char **strings;       // The decoded contents of the string list
+    size_t n_strings;
+
+    size_t memory_size;   // The number of 8-byte words needed for global variables and arrays
+
+    // For every global symbol, by sequence number: its index in functions, or its first word in memory
+    size_t *global_positions;
+} bytecode_program_t;
+
+// Lowers the bound syntax tree into bytecode. Implemented in bytecode.c
+bytecode_program_t* compile_bytecode ( void );
+void destroy_bytecode ( bytecode_program_t *program );
+
+// Runs the first function of the program with the given arguments, like a main function would,
+// and exits with its return value. memory is the block for global variables and arrays, which must be
+// zero filled, or NULL to allocate one. Implemented in interpreter.c
+void run_bytecode ( bytecode_program_t *program, int64_t *memory, int argc, char **argv );
+
+// Interprets a call made from native code, while run_bytecode is running. Implemented in interpreter.c
+int64_t interpret_function ( size_t function_index, const int64_t *arguments );
+
+/* Tiered execution, implemented in tiered.c */
+
+// A function is compiled to native code after this many calls, or this many iterations of one of its loops
+#define HOT_CALL_COUNT 1000
+#define HOT_BACKEDGE_COUNT 10000
+
+// The interpreter calls native code with a fixed number of arguments,
+// so functions with more parameters than this always stay in the interpreter
+#define MAX_NATIVE_PARAMETERS 16
+
+// Native code for every function, indexed like program->functions, and NULL until it is compiled.
+// In the plain interpreter, the table itself is NULL, and calls and loop iterations are not counted.
+extern _Atomic(void*) *native_functions;
+
+// Called by the interpreter when a function gets hot, possibly several times
+void function_is_hot ( size_t function_index );
+
+// Runs the program in the interpreter, like run_bytecode, while hot functions are compiled to native code
+// on a background thread. Native code calls other functions through a dispatch table, whose entries are
+// patched when the callee is compiled. Needs the syntax tree and symbol tables, to generate native code.
+void run_tiered ( bytecode_program_t *program, int argc, char **argv );
+
+#endif // BYTECODE_H
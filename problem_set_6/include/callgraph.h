@@ -0,0 +1,46 @@
+#ifndef CALLGRAPH_H
+#define CALLGRAPH_H
+#include "vslc.h"
+#include "emit.h"
+
+// The call graph connects every function to the functions it calls, as found in the FUNCTION_CALL nodes
+// of the bound syntax tree. Functions are identified by their sequence number in the global symbol table.
+//
+// Calls are weighted by how often they are made. With a profile, that is what the profile counted.
+// Without one, it is estimated from the loops around each call, assuming the caller runs once.
+
+typedef struct
+{
+    size_t caller, callee; // Sequence numbers of the functions
+    size_t n_calls;        // How many places in the caller call the callee
+    uint64_t weight;       // How many calls those places make together
+} call_edge_t;
+
+typedef struct
+{
+    // Grouped by caller, in declaration order. The calls made by the function with sequence number i
+    // are edges[first_edge[i]] up to, but not including, edges[first_edge[i+1]]
+    call_edge_t *edges;
+    size_t n_edges;
+    size_t edges_capacity;
+    size_t *first_edge;
+
+    // Indexed by sequence number. Only functions reachable from the first function can ever run
+    bool *reachable;
+    uint64_t *calls; // How often each function is called, by the weights of the calls to it
+    size_t *size;    // The number of syntax tree nodes in each function, as an estimate of its code size
+    symbol_t *entry; // The first function, where the program starts. NULL if there are no functions
+} call_graph_t;
+
+// Builds the call graph of the whole program. Must be called after create_tables, and read_profile if used
+call_graph_t* create_call_graph ( void );
+void destroy_call_graph ( call_graph_t *graph );
+
+// Returns the reachable functions in the order they should be placed in, in a new array.
+// Callers are followed by the callees they call most, and hot parts of the text section come first
+symbol_t** order_functions ( call_graph_t *graph, size_t *n_functions );
+
+// Returns the part of the text section the function belongs in. Only a profile makes functions hot or unlikely
+text_part_t function_text_part ( size_t function );
+
+#endif // CALLGRAPH_H
@@ -1,77 +1,270 @@
 #ifndef EMIT_H_
 #define EMIT_H_
 
-#define RAX "%rax"
-#define RBX "%rbx" // callee saved
-#define RCX "%rcx"
-#define CL "%cl" // lowest 8 bits of %rcx
-#define RDX "%rdx"
-#define RSP "%rsp" // callee saved
-#define RBP "%rbp" // callee saved
-#define RSI "%rsi"
-#define RDI "%rdi"
-#define R8 "%r8"
-#define R9 "%r9"
-#define R10 "%r10"
-#define R11 "%r11"
-#define R12 "%r12" // callee saved
-#define R13 "%r13" // callee saved
-#define R14 "%r14" // callee saved
-#define R15 "%r15" // callee saved
-#define RIP "%rip"
-
-#define MEM(reg) "("reg")"
-#define ARRAY_MEM(array,index,stride) "("array","index","stride")"
-
-#define DIRECTIVE(fmt, ...) printf(fmt "\n" __VA_OPT__(,) __VA_ARGS__)
-#define LABEL(name, ...) printf(name":\n" __VA_OPT__(,) __VA_ARGS__)
-#define EMIT(fmt, ...) printf("\t" fmt "\n" __VA_OPT__(,) __VA_ARGS__)
-
-#define MOVQ(src,dst)     EMIT("movq %s, %s", (src), (dst))
-#define PUSHQ(src)        EMIT("pushq %s", (src))
-#define POPQ(src)         EMIT("popq %s", (src))
-
-#define ADDQ(src,dst)     EMIT("addq %s, %s", (src), (dst))
-#define SUBQ(src,dst)     EMIT("subq %s, %s", (src), (dst))
-#define NEGQ(reg)         EMIT("negq %s", (reg))
-
-#define IMULQ(src,dst)    EMIT("imulq %s, %s", (src), (dst))
-#define CQO               EMIT("cqo"); // Sign extend RAX -> RDX:RAX
-#define IDIVQ(by)         EMIT("idivq %s", (by)) // Divide RDX:RAX by "by", store result in RAX
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// The code generator does not print assembly directly.
+// Instead, every macro in this file appends an instruction to an in-memory instruction list,
+// which is rendered as AT&T assembly by write_instructions() once the whole program is generated.
+// Keeping the program in memory allows later passes to inspect and rewrite it before output.
+
+// Registers are numbered the way x86-64 encodes them in ModRM and REX bytes
+typedef enum
+{
+    REG_RAX, REG_RCX, REG_RDX, REG_RBX, REG_RSP, REG_RBP, REG_RSI, REG_RDI,
+    REG_R8, REG_R9, REG_R10, REG_R11, REG_R12, REG_R13, REG_R14, REG_R15,
+    REG_RIP
+} reg_t;
+
+// Labels are plain integers. Anonymous labels are printed as .L<id>, named labels by their name
+typedef size_t label_t;
+
+typedef enum
+{
+    OPERAND_NONE,
+    OPERAND_REGISTER,  // base, using the low size bytes of the register
+    OPERAND_IMMEDIATE, // value
+    OPERAND_MEMORY,    // value(base, index, scale), or label(%rip) when base is REG_RIP
+    OPERAND_LABEL      // The address of label, used as the target of jumps and calls
+} operand_type_t;
+
+typedef struct
+{
+    operand_type_t type;
+    uint8_t size;   // Size of a register operand in bytes: 8 or 1, 16 for %xmm0-%xmm15, or 32 for %ymm0-%ymm15
+    reg_t base;
+    reg_t index;    // Only used when scale is not 0
+    uint8_t scale;
+    int64_t value;  // The immediate value, or the displacement of a memory operand
+    label_t label;
+} operand_t;
+
+// Conditions use the same numbering as the condition codes of x86 jcc instructions,
+// so a condition is negated by flipping its lowest bit
+typedef enum
+{
+    COND_O = 0x0, COND_NO = 0x1, // Signed overflow
+    COND_E = 0x4, COND_NE = 0x5,
+    COND_L = 0xC, COND_GE = 0xD, COND_LE = 0xE, COND_G = 0xF
+} condition_t;
+
+#define NEGATE_CONDITION(cond) ((condition_t)((cond) ^ 1))
+
+typedef enum
+{
+    // Instructions
+    OP_MOVQ, OP_MOVB, OP_MOVZBQ, OP_LEAQ, OP_PUSHQ, OP_POPQ,
+    OP_ADDQ, OP_SUBQ, OP_NEGQ, OP_IMULQ, OP_MULQ, OP_CQO, OP_IDIVQ, OP_ANDQ, OP_SALQ, OP_SARQ, OP_SHRQ,
+    OP_CMPQ, OP_CMOVQ, OP_JMP, OP_JCC, OP_LOOP, OP_CALL, OP_RET, OP_SYSCALL, OP_RDTSC, OP_REP_STOSQ, OP_REP_MOVSQ,
+    OP_PXOR, OP_MOVDQU, OP_MOVDQA, OP_PADDQ, OP_PSUBQ, OP_PUNPCKLQDQ, OP_PUNPCKHQDQ,
+    OP_VPBROADCASTQ, OP_VEXTRACTI128, OP_VZEROUPPER,
+
+    // Pseudo instructions and assembler directives
+    OP_LABEL,     // Defines operands[0].label at this position
+    OP_SECTION,   // Switches to the section in operands[0].value, and for text, the part in operands[1].value
+    OP_GLOBAL,    // Exports operands[0].label
+    OP_FUNCTION_END, // Ends the function starting at operands[0].label, giving its symbol a type and a size
+    OP_ALIGN,     // Aligns the current section to operands[0].value bytes
+    OP_ZERO,      // Reserves operands[0].value zeroed bytes
+    OP_ASCIZ,     // Places text, a quoted string literal, in the current section
+    OP_DIRECTIVE  // Prints text verbatim. Only used for platform specific output
+} opcode_t;
+
+typedef struct
+{
+    opcode_t opcode;
+    condition_t condition; // Only used by OP_JCC and OP_CMOVQ
+    operand_t operands[2]; // Using AT&T order: source first, then destination
+    char *text;            // Owned, only used by OP_ASCIZ and OP_DIRECTIVE
+    int line, column;      // The source location the instruction was generated for, or 0
+} instruction_t;
+
+typedef enum
+{
+    SECTION_TEXT, SECTION_RODATA, SECTION_BSS, _SECTION_COUNT
+} section_t;
+
+// Functions are grouped by how often they run, into parts of the text section that linkers place together.
+// The built-in assembler puts every part in the one text section, where the generator already keeps them apart
+typedef enum
+{
+    TEXT_PART_NORMAL, TEXT_PART_HOT, TEXT_PART_UNLIKELY
+} text_part_t;
+
+/* The list of instructions generated so far, in program order */
+extern instruction_t *instructions;
+extern size_t n_instructions;
+
+// The source location given to new instructions. With debug_info, write_instructions marks every change
+extern int source_line, source_column;
+
+// Appends a new instruction to the instruction list, and returns a pointer to it.
+// The pointer is only valid until the next instruction is added
+instruction_t* emit_instruction ( opcode_t opcode, operand_t source, operand_t destination );
+// Appends an OP_DIRECTIVE or OP_ASCIZ instruction, with printf-style formatted text
+void emit_text ( opcode_t opcode, const char *format, ... );
+// Removes the instructions from instructions[length] onwards. Labels they created stay around, unused
+void truncate_instructions ( size_t length );
+
+// Creates a new anonymous label
+label_t new_label ( void );
+// Creates a new label with the given printf-style formatted name
+label_t named_label ( const char *format, ... );
+// Returns the name of a named label, or NULL for anonymous labels
+const char* label_name ( label_t label );
+// Returns the number of labels created so far. Label ids are always below this number
+size_t label_count ( void );
+
+// Applies peephole optimizations to instructions[start..], which must be one complete function.
+// Returns the number of instructions removed. Implemented in peephole.c
+size_t peephole_optimize ( size_t start );
+
+// Renders the instruction list as AT&T assembly, through a single large output buffer
+void write_instructions ( FILE *output );
+// Frees the instruction list and all labels
+void destroy_instructions ( void );
+
+// Decodes a quoted string literal, as used by OP_ASCIZ, into the bytes it stands for.
+// Returns an owned, NUL-terminated string, and stores its length (without the NUL) in length
+char* decode_string_literal ( const char *literal, size_t *length );
+
+// Operands
+#define REGISTER(reg)     ((operand_t){ .type = OPERAND_REGISTER, .size = 8, .base = (reg) })
+#define BYTE_REGISTER(reg) ((operand_t){ .type = OPERAND_REGISTER, .size = 1, .base = (reg) }) // lowest 8 bits
+#define IMMEDIATE(val)    ((operand_t){ .type = OPERAND_IMMEDIATE, .value = (val) })
+#define LABEL_ADDRESS(l)  ((operand_t){ .type = OPERAND_LABEL, .label = (l) })
+#define NO_OPERAND        ((operand_t){ .type = OPERAND_NONE })
+
+#define RAX REGISTER(REG_RAX)
+#define RBX REGISTER(REG_RBX) // callee saved
+#define RCX REGISTER(REG_RCX)
+#define XMM(n) ((operand_t){ .type = OPERAND_REGISTER, .size = 16, .base = (n) }) // SSE register number n
+#define YMM(n) ((operand_t){ .type = OPERAND_REGISTER, .size = 32, .base = (n) }) // AVX register number n
+#define XMM0 XMM(0)
+#define AL BYTE_REGISTER(REG_RAX) // lowest 8 bits of %rax
+#define CL BYTE_REGISTER(REG_RCX) // lowest 8 bits of %rcx
+#define RDX REGISTER(REG_RDX)
+#define RSP REGISTER(REG_RSP) // callee saved
+#define RBP REGISTER(REG_RBP) // callee saved
+#define RSI REGISTER(REG_RSI)
+#define RDI REGISTER(REG_RDI)
+#define R8 REGISTER(REG_R8)
+#define R9 REGISTER(REG_R9)
+#define R10 REGISTER(REG_R10)
+#define R11 REGISTER(REG_R11)
+#define R12 REGISTER(REG_R12) // callee saved
+#define R13 REGISTER(REG_R13) // callee saved
+#define R14 REGISTER(REG_R14) // callee saved
+#define R15 REGISTER(REG_R15) // callee saved
+
+// Memory operands, taking register operands as arguments
+#define MEM(reg) MEM_OFFSET(0, reg)
+#define MEM_OFFSET(offset,reg) ((operand_t){ .type = OPERAND_MEMORY, .base = (reg).base, .value = (offset) })
+#define ARRAY_MEM(array,idx,stride) \
+    ((operand_t){ .type = OPERAND_MEMORY, .base = (array).base, .index = (idx).base, .scale = (stride) })
+// The memory at the given label, addressed relative to %rip
+#define RIP_LABEL(l) ((operand_t){ .type = OPERAND_MEMORY, .base = REG_RIP, .label = (l) })
+
+#define EMIT0(op)         emit_instruction ( (op), NO_OPERAND, NO_OPERAND )
+#define EMIT1(op,a)       emit_instruction ( (op), (a), NO_OPERAND )
+#define EMIT2(op,src,dst) emit_instruction ( (op), (src), (dst) )
+
+#define DIRECTIVE(fmt, ...) emit_text ( OP_DIRECTIVE, fmt __VA_OPT__(,) __VA_ARGS__ )
+#define LABEL(label)      EMIT1 ( OP_LABEL, LABEL_ADDRESS(label) )
+#define SECTION(section)  EMIT1 ( OP_SECTION, IMMEDIATE(section) )
+#define TEXT_SECTION(part) EMIT2 ( OP_SECTION, IMMEDIATE(SECTION_TEXT), IMMEDIATE(part) )
+#define GLOBAL(label)     EMIT1 ( OP_GLOBAL, LABEL_ADDRESS(label) )
+#define FUNCTION_END(label) EMIT1 ( OP_FUNCTION_END, LABEL_ADDRESS(label) )
+#define ALIGN(bytes)      EMIT1 ( OP_ALIGN, IMMEDIATE(bytes) )
+#define ZERO(bytes)       EMIT1 ( OP_ZERO, IMMEDIATE(bytes) )
+#define ASCIZ(fmt, ...)   emit_text ( OP_ASCIZ, fmt __VA_OPT__(,) __VA_ARGS__ )
+
+#define MOVQ(src,dst)     EMIT2 ( OP_MOVQ, (src), (dst) )
+#define MOVB(src,dst)     EMIT2 ( OP_MOVB, (src), (dst) ) // Stores a byte register or immediate to memory
+#define MOVZBQ(src,dst)   EMIT2 ( OP_MOVZBQ, (src), (dst) ) // Loads a byte from memory, zero extended
+#define LEAQ(src,dst)     EMIT2 ( OP_LEAQ, (src), (dst) )
+#define PUSHQ(src)        EMIT1 ( OP_PUSHQ, (src) )
+#define POPQ(src)         EMIT1 ( OP_POPQ, (src) )
+
+#define ADDQ(src,dst)     EMIT2 ( OP_ADDQ, (src), (dst) )
+#define SUBQ(src,dst)     EMIT2 ( OP_SUBQ, (src), (dst) )
+#define NEGQ(reg)         EMIT1 ( OP_NEGQ, (reg) )
+
+#define IMULQ(src,dst)    EMIT2 ( OP_IMULQ, (src), (dst) )
+#define MULQ(by)          EMIT1 ( OP_MULQ, (by) ) // Unsigned RAX * "by" -> RDX:RAX
+#define CQO               EMIT0 ( OP_CQO ) // Sign extend RAX -> RDX:RAX
+#define IDIVQ(by)         EMIT1 ( OP_IDIVQ, (by) ) // Divide RDX:RAX by "by", store result in RAX
 
 // Bitwise and
-#define ANDQ(src,dst)     EMIT("andq %s, %s", (src), (dst))
+#define ANDQ(src,dst)     EMIT2 ( OP_ANDQ, (src), (dst) )
 // Arithmetic shift left and shift right by cnt bits.
 // if cnt is a register, it must be one of the original 1-byte IA32 registers,
 // such as %cl, which are the lowest 8 bits of %rcx
-#define SAL(cnt,dst)      EMIT("salq %s, %s", (cnt), (dst))
-#define SAR(cnt,dst)      EMIT("sarq %s, %s", (cnt), (dst))
+#define SAL(cnt,dst)      EMIT2 ( OP_SALQ, (cnt), (dst) )
+#define SAR(cnt,dst)      EMIT2 ( OP_SARQ, (cnt), (dst) )
+// Logical shift right, filling in zeros
+#define SHR(cnt,dst)      EMIT2 ( OP_SHRQ, (cnt), (dst) )
+
+#define CALL(label)       EMIT1 ( OP_CALL, LABEL_ADDRESS(label) )
+#define CALL_INDIRECT(mem) EMIT1 ( OP_CALL, (mem) ) // Calls the address stored in memory
+#define RET               EMIT0 ( OP_RET )
+// 128-bit SSE2 instructions. Given %ymm registers, PXOR, MOVDQU, MOVDQA, PADDQ and PSUBQ become
+// their 256-bit AVX2 forms, such as vpaddq, with the destination also used as the first source.
+// MOVQ also moves quadwords between general purpose registers and the low half of %xmm registers
+#define PXOR(src,dst)     EMIT2 ( OP_PXOR, (src), (dst) ) // Bitwise xor of XMM registers
+#define MOVDQU(src,dst)   EMIT2 ( OP_MOVDQU, (src), (dst) ) // Loads or stores 16 bytes, without alignment
+#define MOVDQA(src,dst)   EMIT2 ( OP_MOVDQA, (src), (dst) ) // Loads or stores 16 aligned bytes, or copies a register
+#define PADDQ(src,dst)    EMIT2 ( OP_PADDQ, (src), (dst) ) // Adds each quadword of src to the one in dst
+#define PSUBQ(src,dst)    EMIT2 ( OP_PSUBQ, (src), (dst) ) // Subtracts each quadword of src from the one in dst
+#define PUNPCKLQDQ(src,dst) EMIT2 ( OP_PUNPCKLQDQ, (src), (dst) ) // dst = { low half of dst, low half of src }
+#define PUNPCKHQDQ(src,dst) EMIT2 ( OP_PUNPCKHQDQ, (src), (dst) ) // dst = { high half of dst, high half of src }
+// 256-bit AVX2 instructions
+#define VPBROADCASTQ(src,dst) EMIT2 ( OP_VPBROADCASTQ, (src), (dst) ) // Fills a YMM register with the low quadword of src
+#define VEXTRACTI128(src,dst) EMIT2 ( OP_VEXTRACTI128, (src), (dst) ) // Copies the high half of a YMM register
+#define VZEROUPPER        EMIT0 ( OP_VZEROUPPER ) // Clears the high halves of all YMM registers, before SSE code runs
 
-#define RET               EMIT("ret")
+#define SYSCALL           EMIT0 ( OP_SYSCALL ) // Number in RAX, arguments in RDI, RSI, RDX. Clobbers RCX and R11
+#define RDTSC             EMIT0 ( OP_RDTSC ) // Reads the time stamp counter into EDX:EAX, clearing the upper halves
+// Stores RAX to RCX quadwords from the address in RDI upwards, advancing RDI and counting RCX down to 0
+#define REP_STOSQ         EMIT0 ( OP_REP_STOSQ )
+// Copies RCX quadwords from the address in RSI to the one in RDI, one at a time upwards, advancing both
+#define REP_MOVSQ         EMIT0 ( OP_REP_MOVSQ )
 
-#define CMPQ(op1,op2)     EMIT("cmpq %s, %s", (op1), (op2))
-#define JNE(label)        EMIT("jne %s", (label)) // Conditional jump (not equal)
-#define JMP(label)        EMIT("jmp %s", (label)) // Unconditional jump
+#define CMPQ(op1,op2)     EMIT2 ( OP_CMPQ, (op1), (op2) )
+// Moves src into the register dst only if the condition holds, without jumping
+#define CMOVQ(cond,src,dst) (emit_instruction ( OP_CMOVQ, (src), (dst) )->condition = (cond))
+#define JCC(cond,label)   (emit_instruction ( OP_JCC, LABEL_ADDRESS(label), NO_OPERAND )->condition = (cond))
+#define JNE(label)        JCC ( COND_NE, (label) ) // Conditional jump (not equal)
+#define JMP(label)        EMIT1 ( OP_JMP, LABEL_ADDRESS(label) ) // Unconditional jump
+#define LOOP(label)       EMIT1 ( OP_LOOP, LABEL_ADDRESS(label) ) // Decrement RCX, jump if not zero
 
 // These directives are set based on platform,
 // allowing the compiler to work on macOS as well
 // Section names are different,
 // and exported and imported function labels start with _
 #ifdef __APPLE__
+#define ASM_TEXT_SECTION "__TEXT, __text"
 #define ASM_BSS_SECTION "__DATA, __bss"
 #define ASM_STRING_SECTION "__TEXT, __cstring"
+// Mach-O has no sections for hot and unlikely code
+#define ASM_HOT_TEXT_SECTION ASM_TEXT_SECTION
+#define ASM_UNLIKELY_TEXT_SECTION ASM_TEXT_SECTION
 #define ASM_DECLARE_SYMBOLS                     \
-    ".set printf, _printf"                 "\n" \
-    ".set putchar, _putchar"               "\n" \
     ".set puts, _puts"                     "\n" \
     ".set strtol, _strtol"                 "\n" \
     ".set exit, _exit"                     "\n" \
+    ".set write, _write"                   "\n" \
     ".set _main, main"                     "\n" \
     ".global _main"
 #else
+#define ASM_TEXT_SECTION ".text"
 #define ASM_BSS_SECTION ".bss"
 #define ASM_STRING_SECTION ".rodata"
-#define ASM_DECLARE_SYMBOLS ".global main"
+#define ASM_HOT_TEXT_SECTION ".text.hot,\"ax\",@progbits"
+#define ASM_UNLIKELY_TEXT_SECTION ".text.unlikely,\"ax\",@progbits"
 #endif
 
 #endif // EMIT_H_
@@ -0,0 +1,75 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+#include "vslc.h"
+
+// A profile records how often each function ran, and how often each of its blocks ran and call sites made
+// a call. Programs compiled with -fprofile-generate write one when they exit. It is a text file, with one line
+// per function, followed by a line for every block and call site:
+//
+//     function <name> <hash> <calls>
+//     block <block> <count>
+//     call <site> <count>
+//
+// The hash is the structural hash of the function, so profiles of functions that have changed since are
+// detected and ignored. Lines starting with # are comments.
+//
+// Blocks and call sites are numbered from 0, in the order they appear in the function, see find_profile_points.
+
+typedef struct
+{
+    bool present;         // False when the profile has nothing on the function
+    uint64_t calls;       // How many times the function was called
+    uint64_t *blocks;     // How many times each block ran, indexed by block number
+    size_t n_blocks;
+    uint64_t *call_sites; // How many calls each call site made, indexed by site number
+    size_t n_call_sites;
+} function_profile_t;
+
+typedef struct
+{
+    // Indexed by the sequence number of the function in the global symbol table
+    function_profile_t *functions;
+    uint64_t max_calls; // The most calls any one function got
+} profile_t;
+
+// The profile given by -fprofile-use, or NULL
+extern profile_t *profile;
+
+// Reads the profile in the file into profile. Must be called after create_tables.
+// Functions the program does not have are ignored, and so are functions that have changed, with a warning
+void read_profile ( const char *filename );
+void destroy_profile ( void );
+
+// Returns how many calls the call site made, or 0 if the profile has nothing on it
+uint64_t call_site_count ( const function_profile_t *function, size_t site );
+
+// Returns a hash of the function's syntax tree, which changes whenever the function does
+uint64_t structural_hash ( symbol_t *function );
+
+// The places in a function that are counted. The blocks are
+//   - the then and else statements of if statements, or for an if statement without an else statement,
+//     its relation, which stands for skipping the then statement
+//   - the relations of while statements, which stand for entering the loop, and their bodies
+// The call sites are the FUNCTION_CALL nodes.
+typedef struct
+{
+    node_t *node;
+    size_t number; // The number of the block or call site
+} profile_point_t;
+
+typedef struct
+{
+    // Sorted by node, for find_profile_point
+    profile_point_t *blocks;
+    size_t n_blocks;
+    profile_point_t *call_sites;
+    size_t n_call_sites;
+} profile_points_t;
+
+// Numbers the blocks and call sites of the function, in the order they appear in it
+void find_profile_points ( symbol_t *function, profile_points_t *points );
+void destroy_profile_points ( profile_points_t *points );
+// Returns the number of the block or call site at node, or SIZE_MAX if it is not one
+size_t find_profile_point ( const profile_point_t *points, size_t n_points, node_t *node );
+
+#endif // PROFILE_H
@@ -13,11 +13,16 @@ typedef struct node
 
     void* data; // Extra data, only owned if type ends in _DATA
     struct symbol* symbol;
+
+    int line, column; // Where the node's text starts in the source, counted from 1, or 0 if unknown
 } node_t;
 
 /* Global root for parse tree and abstract syntax tree */
 extern node_t *root;
 
+// Where the text of the nodes created next starts. The parser sets it before every reduction
+extern int node_line, node_column;
+
 // The node creation function, needed by the parser
 node_t* node_create ( node_type_t type, void *data, size_t n_children, ... );
 // Append an element to the given LIST node, returns the list node
@@ -13,9 +13,32 @@
 #include <stdlib.h>
 #include <string.h>
 
-/* Function for generating machine code, in generator.c */
+/* Function for generating machine code, in generator.c
+ * The generated program is placed in the instruction list, see emit.h */
 void generate_program ( void );
 
+/* Also in generator.c, for tiered execution in tiered.c:
+ * generates a single function, whose calls go through the dispatch table entries at the labels dispatch.<name>,
+ * and entry points named interpret.<name>, for native code to call functions that are still interpreted */
+void generate_tiered_function ( symbol_t *function );
+void generate_interpreter_entries ( void );
+
+/* Code generation options, set from the command line in vslc.c */
+extern bool print_peephole_statistics;
+// Generate a program that starts at _start and uses system calls directly, instead of linking with libc
+extern bool freestanding;
+// Turn simple loops over global arrays into vector code, using AVX2 instead of SSE2 when avx2 is set
+extern bool vectorize, avx2;
+// Make the program count how often its functions, blocks and call sites run, and write the counts to this
+// profile when it exits, or NULL. See profile.h
+extern const char *profile_output;
+// Make the program time its functions, and print how many cycles each one took to stderr when it exits
+extern bool instrument_functions;
+// Mark the source line of every statement in the assembly output, as coming from source_name,
+// and describe every function's call frame, for debuggers and profilers
+extern bool debug_info;
+extern const char *source_name;
+
 /* The main driver function of the parser generated by bison */
 int yyparse ();
 
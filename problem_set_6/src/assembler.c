@@ -0,0 +1,682 @@
+#include "vslc.h"
+#include "assembler.h"
+
+static void encode_instruction ( assembly_t *assembly, instruction_t *instruction );
+static void resolve_local_relocations ( assembly_t *assembly );
+
+/* The section currently being assembled into */
+static section_t current_section;
+
+/* External interface */
+
+/* Encodes every instruction in the instruction list into the sections of a new assembly.
+ * Labels referenced from the same section they are defined in are resolved immediately.
+ */
+assembly_t* assemble_program ( void )
+{
+    assembly_t *assembly = calloc ( 1, sizeof(assembly_t) );
+    assembly->n_labels = label_count ( );
+    assembly->labels = calloc ( assembly->n_labels, sizeof(label_definition_t) );
+    for ( int i = 0; i < _SECTION_COUNT; i++ )
+        assembly->sections[i].alignment = 1;
+
+    current_section = SECTION_TEXT;
+    for ( size_t i = 0; i < n_instructions; i++ )
+        encode_instruction ( assembly, &instructions[i] );
+
+    resolve_local_relocations ( assembly );
+    return assembly;
+}
+
+void destroy_assembly ( assembly_t *assembly )
+{
+    for ( int i = 0; i < _SECTION_COUNT; i++ )
+        free ( assembly->sections[i].bytes );
+    free ( assembly->labels );
+    free ( assembly->relocations );
+    free ( assembly );
+}
+
+/* Internal matters */
+
+static void put_byte ( assembly_t *assembly, uint8_t byte )
+{
+    section_data_t *section = &assembly->sections[current_section];
+    // The .bss section only keeps track of its size
+    if ( current_section != SECTION_BSS )
+    {
+        if ( section->size >= section->capacity )
+        {
+            section->capacity = section->capacity * 2 + 4096;
+            section->bytes = realloc ( section->bytes, section->capacity );
+        }
+        section->bytes[section->size] = byte;
+    }
+    section->size++;
+}
+
+/* Places value in little endian, using the given number of bytes */
+static void put_value ( assembly_t *assembly, int64_t value, int bytes )
+{
+    for ( int i = 0; i < bytes; i++ )
+        put_byte ( assembly, (uint8_t) ( (uint64_t) value >> (8*i) ) );
+}
+
+static size_t current_offset ( assembly_t *assembly )
+{
+    return assembly->sections[current_section].size;
+}
+
+/* Records a reference to label in a field of the given size, placed at the current position.
+ * trailing is the number of bytes of the instruction following the field.
+ * References are relative to the end of the instruction, like all x86-64 rel32 and disp32 fields.
+ */
+static void put_label_reference ( assembly_t *assembly, label_t label, int64_t displacement,
+                                  uint8_t size, int trailing, bool is_call )
+{
+    if ( assembly->n_relocations >= assembly->relocations_capacity )
+    {
+        assembly->relocations_capacity = assembly->relocations_capacity * 2 + 64;
+        assembly->relocations = realloc ( assembly->relocations,
+                                          assembly->relocations_capacity * sizeof(relocation_t) );
+    }
+    assembly->relocations[assembly->n_relocations++] = (relocation_t) {
+        .section = current_section,
+        .offset = current_offset ( assembly ),
+        .size = size,
+        .label = label,
+        .addend = displacement - size - trailing,
+        .is_call = is_call
+    };
+    put_value ( assembly, 0, size );
+}
+
+static bool fits_int8 ( int64_t value )
+{
+    return value >= INT8_MIN && value <= INT8_MAX;
+}
+
+static bool fits_int32 ( int64_t value )
+{
+    return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+/* Byte registers 4-7 mean %ah-%bh without a REX prefix, and %spl-%dil with one */
+static bool needs_rex_for_byte_register ( operand_t *operand )
+{
+    return operand->type == OPERAND_REGISTER && operand->size == 1
+        && operand->base >= REG_RSP && operand->base <= REG_RDI;
+}
+
+/* Emits the ModRM byte, and the SIB byte and displacement rm needs, for an instruction whose prefixes and opcode
+ * are already placed. Only the low 3 bits of reg and of the registers in rm are used here.
+ * trailing is the number of immediate bytes the caller will place after this.
+ */
+static void put_modrm ( assembly_t *assembly, int reg, operand_t *rm, int trailing )
+{
+    uint8_t reg_bits = ( reg & 7 ) << 3;
+    if ( rm->type == OPERAND_REGISTER )
+    {
+        put_byte ( assembly, 0xC0 | reg_bits | ( rm->base & 7 ) );
+        return;
+    }
+
+    if ( rm->base == REG_RIP )
+    {
+        // mod = 00, r/m = 101 means a 32-bit displacement relative to the next instruction
+        put_byte ( assembly, 0x05 | reg_bits );
+        put_label_reference ( assembly, rm->label, rm->value, 4, trailing, false );
+        return;
+    }
+
+    // Base registers %rbp and %r13 have no encoding without a displacement
+    int mod;
+    if ( rm->value == 0 && ( rm->base & 7 ) != REG_RBP )
+        mod = 0;
+    else if ( fits_int8 ( rm->value ) )
+        mod = 1;
+    else
+    {
+        assert ( fits_int32 ( rm->value ) );
+        mod = 2;
+    }
+
+    // A SIB byte is needed for indexing, and when the base is %rsp or %r12
+    if ( rm->scale != 0 || ( rm->base & 7 ) == REG_RSP )
+    {
+        int scale_bits = rm->scale == 8 ? 3 : rm->scale == 4 ? 2 : rm->scale == 2 ? 1 : 0;
+        int index_bits = rm->scale != 0 ? ( rm->index & 7 ) : 4; // 100 means no index
+        put_byte ( assembly, ( mod << 6 ) | reg_bits | 4 );
+        put_byte ( assembly, ( scale_bits << 6 ) | ( index_bits << 3 ) | ( rm->base & 7 ) );
+    }
+    else
+        put_byte ( assembly, ( mod << 6 ) | reg_bits | ( rm->base & 7 ) );
+
+    if ( mod == 1 )
+        put_value ( assembly, rm->value, 1 );
+    else if ( mod == 2 )
+        put_value ( assembly, rm->value, 4 );
+}
+
+/* The high bits of the registers rm uses, as the X and B bits of REX and VEX prefixes */
+static uint8_t rm_extension_bits ( operand_t *rm )
+{
+    if ( rm->type == OPERAND_REGISTER )
+        return rm->base & 8 ? 0x01 : 0;
+    assert ( rm->type == OPERAND_MEMORY );
+    uint8_t bits = 0;
+    if ( rm->base != REG_RIP && ( rm->base & 8 ) )
+        bits |= 0x01;
+    if ( rm->scale != 0 && ( rm->index & 8 ) )
+        bits |= 0x02;
+    return bits;
+}
+
+/* Emits an instruction using a ModRM byte: [REX] opcode ModRM [SIB] [displacement]
+ * reg is either a register number, or the opcode extension of /digit style instructions.
+ * rm is a register or memory operand.
+ * trailing is the number of immediate bytes the caller will place after this.
+ */
+static void put_modrm_instruction ( assembly_t *assembly, bool rex_w, const uint8_t *opcode, size_t opcode_length,
+                                    int reg, bool force_rex, operand_t *rm, int trailing )
+{
+    uint8_t rex = 0x40 | ( rex_w ? 0x08 : 0 ) | ( reg & 8 ? 0x04 : 0 ) | rm_extension_bits ( rm );
+    force_rex = force_rex || needs_rex_for_byte_register ( rm );
+    if ( rex != 0x40 || force_rex )
+        put_byte ( assembly, rex );
+
+    for ( size_t i = 0; i < opcode_length; i++ )
+        put_byte ( assembly, opcode[i] );
+
+    put_modrm ( assembly, reg, rm, trailing );
+}
+
+// The implied prefix and opcode map fields of VEX prefixes
+#define VEX_66 1
+#define VEX_F3 2
+#define VEX_0F 1
+#define VEX_0F38 2
+#define VEX_0F3A 3
+
+/* Emits an AVX instruction: VEX opcode ModRM [SIB] [displacement]
+ * source is the extra register operand VEX adds, or -1 for none. wide selects 256-bit operation.
+ */
+static void put_vex_instruction ( assembly_t *assembly, int prefix, int map, bool wide, uint8_t opcode,
+                                  int reg, int source, operand_t *rm, int trailing )
+{
+    // All register numbers in the prefix are stored inverted
+    uint8_t extension = rm_extension_bits ( rm );
+    uint8_t vvvv_l_pp = ( ~( source < 0 ? 0 : source ) & 0xF ) << 3 | ( wide ? 0x04 : 0 ) | prefix;
+    if ( map == VEX_0F && ( extension & 0x03 ) == 0 )
+    {
+        // The shorter form can only extend reg
+        put_byte ( assembly, 0xC5 );
+        put_byte ( assembly, ( reg & 8 ? 0 : 0x80 ) | vvvv_l_pp );
+    }
+    else
+    {
+        put_byte ( assembly, 0xC4 );
+        put_byte ( assembly, ( reg & 8 ? 0 : 0x80 ) | ( ~extension & 0x03 ) << 5 | map );
+        put_byte ( assembly, vvvv_l_pp );
+    }
+    put_byte ( assembly, opcode );
+    put_modrm ( assembly, reg, rm, trailing );
+}
+
+/* Shorthand for the common case of a single opcode byte and a 64-bit operation */
+static void put_modrm_quad ( assembly_t *assembly, uint8_t opcode, int reg, operand_t *rm, int trailing )
+{
+    put_modrm_instruction ( assembly, true, &opcode, 1, reg, false, rm, trailing );
+}
+
+/* Emits a REX prefix if needed, for instructions encoding a register in the low bits of the opcode */
+static void put_opcode_register ( assembly_t *assembly, bool rex_w, uint8_t opcode, reg_t reg )
+{
+    if ( rex_w || ( reg & 8 ) )
+        put_byte ( assembly, 0x40 | ( rex_w ? 0x08 : 0 ) | ( reg & 8 ? 0x01 : 0 ) );
+    put_byte ( assembly, opcode + ( reg & 7 ) );
+}
+
+/* The encodings of the two-operand arithmetic instructions */
+typedef struct
+{
+    uint8_t store_opcode; // op r/m64, r64
+    uint8_t load_opcode;  // op r64, r/m64
+    uint8_t extension;    // op r/m64, imm, using opcode 0x81 or 0x83
+} alu_encoding_t;
+
+static const alu_encoding_t ALU_ENCODINGS[] = {
+    [OP_ADDQ] = { 0x01, 0x03, 0 },
+    [OP_ANDQ] = { 0x21, 0x23, 4 },
+    [OP_SUBQ] = { 0x29, 0x2B, 5 },
+    [OP_CMPQ] = { 0x39, 0x3B, 7 },
+};
+
+static void encode_alu ( assembly_t *assembly, alu_encoding_t encoding, operand_t *source, operand_t *destination )
+{
+    if ( source->type == OPERAND_IMMEDIATE )
+    {
+        assert ( fits_int32 ( source->value ) );
+        if ( fits_int8 ( source->value ) )
+        {
+            put_modrm_quad ( assembly, 0x83, encoding.extension, destination, 1 );
+            put_value ( assembly, source->value, 1 );
+        }
+        else
+        {
+            put_modrm_quad ( assembly, 0x81, encoding.extension, destination, 4 );
+            put_value ( assembly, source->value, 4 );
+        }
+    }
+    else if ( source->type == OPERAND_REGISTER )
+        put_modrm_quad ( assembly, encoding.store_opcode, source->base, destination, 0 );
+    else
+    {
+        assert ( destination->type == OPERAND_REGISTER );
+        put_modrm_quad ( assembly, encoding.load_opcode, destination->base, source, 0 );
+    }
+}
+
+static void encode_movq ( assembly_t *assembly, operand_t *source, operand_t *destination )
+{
+    // Moves to and from %xmm registers, with the 0x66 prefix before REX
+    if ( destination->type == OPERAND_REGISTER && destination->size == 16 )
+    {
+        const uint8_t opcode[] = { 0x0F, 0x6E };
+        put_byte ( assembly, 0x66 );
+        put_modrm_instruction ( assembly, true, opcode, 2, destination->base, false, source, 0 );
+        return;
+    }
+    if ( source->type == OPERAND_REGISTER && source->size == 16 )
+    {
+        assert ( destination->type == OPERAND_REGISTER );
+        const uint8_t opcode[] = { 0x0F, 0x7E };
+        put_byte ( assembly, 0x66 );
+        put_modrm_instruction ( assembly, true, opcode, 2, source->base, false, destination, 0 );
+        return;
+    }
+
+    if ( source->type == OPERAND_IMMEDIATE )
+    {
+        if ( !fits_int32 ( source->value ) )
+        {
+            // movabs, the only instruction taking a full 64-bit immediate
+            assert ( destination->type == OPERAND_REGISTER );
+            put_opcode_register ( assembly, true, 0xB8, destination->base );
+            put_value ( assembly, source->value, 8 );
+            return;
+        }
+        put_modrm_quad ( assembly, 0xC7, 0, destination, 4 );
+        put_value ( assembly, source->value, 4 );
+    }
+    else if ( source->type == OPERAND_REGISTER )
+        put_modrm_quad ( assembly, 0x89, source->base, destination, 0 );
+    else
+    {
+        assert ( destination->type == OPERAND_REGISTER );
+        put_modrm_quad ( assembly, 0x8B, destination->base, source, 0 );
+    }
+}
+
+static void encode_movb ( assembly_t *assembly, operand_t *source, operand_t *destination )
+{
+    assert ( destination->type == OPERAND_MEMORY );
+    if ( source->type == OPERAND_IMMEDIATE )
+    {
+        uint8_t opcode = 0xC6;
+        put_modrm_instruction ( assembly, false, &opcode, 1, 0, false, destination, 1 );
+        put_value ( assembly, source->value, 1 );
+    }
+    else
+    {
+        assert ( source->type == OPERAND_REGISTER && source->size == 1 );
+        uint8_t opcode = 0x88;
+        put_modrm_instruction ( assembly, false, &opcode, 1, source->base,
+                                needs_rex_for_byte_register ( source ), destination, 0 );
+    }
+}
+
+static void encode_pushq ( assembly_t *assembly, operand_t *source )
+{
+    switch ( source->type )
+    {
+        case OPERAND_REGISTER:
+            put_opcode_register ( assembly, false, 0x50, source->base );
+            break;
+        case OPERAND_IMMEDIATE:
+            if ( fits_int8 ( source->value ) )
+            {
+                put_byte ( assembly, 0x6A );
+                put_value ( assembly, source->value, 1 );
+            }
+            else
+            {
+                assert ( fits_int32 ( source->value ) );
+                put_byte ( assembly, 0x68 );
+                put_value ( assembly, source->value, 4 );
+            }
+            break;
+        case OPERAND_MEMORY: {
+            uint8_t opcode = 0xFF;
+            put_modrm_instruction ( assembly, false, &opcode, 1, 6, false, source, 0 );
+            break;
+        }
+        default: assert ( false && "Invalid pushq operand" );
+    }
+}
+
+static void encode_popq ( assembly_t *assembly, operand_t *destination )
+{
+    if ( destination->type == OPERAND_REGISTER )
+        put_opcode_register ( assembly, false, 0x58, destination->base );
+    else
+    {
+        uint8_t opcode = 0x8F;
+        put_modrm_instruction ( assembly, false, &opcode, 1, 0, false, destination, 0 );
+    }
+}
+
+static void encode_shift ( assembly_t *assembly, int extension, operand_t *count, operand_t *destination )
+{
+    if ( count->type == OPERAND_REGISTER )
+    {
+        assert ( count->base == REG_RCX && "Shifts by a register must use %cl" );
+        put_modrm_quad ( assembly, 0xD3, extension, destination, 0 );
+    }
+    else
+    {
+        put_modrm_quad ( assembly, 0xC1, extension, destination, 1 );
+        put_value ( assembly, count->value, 1 );
+    }
+}
+
+// The second opcode bytes of the SSE2 instructions taking the operand size prefix, 66 0F xx /r
+static const uint8_t SSE_OPCODES[] = {
+    [OP_PXOR] = 0xEF, [OP_PADDQ] = 0xD4, [OP_PSUBQ] = 0xFB, [OP_PUNPCKLQDQ] = 0x6C, [OP_PUNPCKHQDQ] = 0x6D
+};
+
+/* Encodes the SSE2 form, or for %ymm registers the AVX2 form, which also reads the destination as its first source */
+static void encode_sse_arithmetic ( assembly_t *assembly, uint8_t opcode, operand_t *source, operand_t *destination )
+{
+    assert ( destination->type == OPERAND_REGISTER );
+    if ( destination->size == 32 )
+    {
+        put_vex_instruction ( assembly, VEX_66, VEX_0F, true, opcode, destination->base, destination->base, source, 0 );
+        return;
+    }
+    // The 0x66 operand size prefix selects the SSE2 form, and must come before REX
+    const uint8_t opcodes[] = { 0x0F, opcode };
+    put_byte ( assembly, 0x66 );
+    put_modrm_instruction ( assembly, false, opcodes, 2, destination->base, false, source, 0 );
+}
+
+/* Encodes movdqu and movdqa, which only differ in their prefix */
+static void encode_sse_move ( assembly_t *assembly, uint8_t prefix, int vex_prefix,
+                              operand_t *source, operand_t *destination )
+{
+    // Loads and register copies use 6F, stores use 7F
+    bool store = destination->type == OPERAND_MEMORY;
+    operand_t *reg = store ? source : destination, *rm = store ? destination : source;
+    uint8_t opcode = store ? 0x7F : 0x6F;
+    if ( reg->size == 32 )
+    {
+        put_vex_instruction ( assembly, vex_prefix, VEX_0F, true, opcode, reg->base, -1, rm, 0 );
+        return;
+    }
+    const uint8_t opcodes[] = { 0x0F, opcode };
+    put_byte ( assembly, prefix );
+    put_modrm_instruction ( assembly, false, opcodes, 2, reg->base, false, rm, 0 );
+}
+
+/* Parses the escape sequences of a quoted string literal, and places the bytes and a terminating 0 */
+static void encode_asciz ( assembly_t *assembly, const char *text )
+{
+    size_t length;
+    char *bytes = decode_string_literal ( text, &length );
+    // Including the NUL terminator
+    for ( size_t i = 0; i <= length; i++ )
+        put_byte ( assembly, bytes[i] );
+    free ( bytes );
+}
+
+// The recommended nop instructions of every length up to 9 bytes, indexed by length
+#define MAX_NOP_LENGTH 9
+static const uint8_t NOPS[MAX_NOP_LENGTH+1][MAX_NOP_LENGTH] = {
+    {},
+    {0x90},
+    {0x66, 0x90},
+    {0x0F, 0x1F, 0x00},
+    {0x0F, 0x1F, 0x40, 0x00},
+    {0x0F, 0x1F, 0x44, 0x00, 0x00},
+    {0x66, 0x0F, 0x1F, 0x44, 0x00, 0x00},
+    {0x0F, 0x1F, 0x80, 0x00, 0x00, 0x00, 0x00},
+    {0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+    {0x66, 0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00}
+};
+
+static void encode_align ( assembly_t *assembly, size_t alignment )
+{
+    section_data_t *section = &assembly->sections[current_section];
+    if ( alignment > section->alignment )
+        section->alignment = alignment;
+    size_t padding = ( alignment - section->size % alignment ) % alignment;
+
+    // Data is padded with zeros
+    if ( current_section != SECTION_TEXT )
+    {
+        for ( size_t i = 0; i < padding; i++ )
+            put_byte ( assembly, 0x00 );
+        return;
+    }
+
+    // Code may run through its padding, such as the padding in front of a loop, so it takes as few nops as possible
+    while ( padding > 0 )
+    {
+        size_t length = padding < MAX_NOP_LENGTH ? padding : MAX_NOP_LENGTH;
+        for ( size_t i = 0; i < length; i++ )
+            put_byte ( assembly, NOPS[length][i] );
+        padding -= length;
+    }
+}
+
+static void encode_instruction ( assembly_t *assembly, instruction_t *instruction )
+{
+    operand_t *source = &instruction->operands[0];
+    operand_t *destination = &instruction->operands[1];
+
+    switch ( instruction->opcode )
+    {
+        case OP_MOVQ:
+            encode_movq ( assembly, source, destination );
+            break;
+        case OP_MOVB:
+            encode_movb ( assembly, source, destination );
+            break;
+        case OP_MOVZBQ: {
+            assert ( destination->type == OPERAND_REGISTER );
+            const uint8_t opcode[] = { 0x0F, 0xB6 };
+            put_modrm_instruction ( assembly, true, opcode, 2, destination->base, false, source, 0 );
+            break;
+        }
+        case OP_LEAQ:
+            put_modrm_quad ( assembly, 0x8D, destination->base, source, 0 );
+            break;
+        case OP_PUSHQ:
+            encode_pushq ( assembly, source );
+            break;
+        case OP_POPQ:
+            encode_popq ( assembly, source );
+            break;
+        case OP_ADDQ: case OP_SUBQ: case OP_ANDQ: case OP_CMPQ:
+            encode_alu ( assembly, ALU_ENCODINGS[instruction->opcode], source, destination );
+            break;
+        case OP_NEGQ:
+            put_modrm_quad ( assembly, 0xF7, 3, source, 0 );
+            break;
+        case OP_IMULQ: {
+            assert ( destination->type == OPERAND_REGISTER );
+            const uint8_t opcode[] = { 0x0F, 0xAF };
+            put_modrm_instruction ( assembly, true, opcode, 2, destination->base, false, source, 0 );
+            break;
+        }
+        case OP_CMOVQ: {
+            assert ( destination->type == OPERAND_REGISTER );
+            const uint8_t opcode[] = { 0x0F, 0x40 | instruction->condition };
+            put_modrm_instruction ( assembly, true, opcode, 2, destination->base, false, source, 0 );
+            break;
+        }
+        case OP_PXOR: case OP_PADDQ: case OP_PSUBQ: case OP_PUNPCKLQDQ: case OP_PUNPCKHQDQ:
+            encode_sse_arithmetic ( assembly, SSE_OPCODES[instruction->opcode], source, destination );
+            break;
+        case OP_MOVDQU:
+            encode_sse_move ( assembly, 0xF3, VEX_F3, source, destination );
+            break;
+        case OP_MOVDQA:
+            encode_sse_move ( assembly, 0x66, VEX_66, source, destination );
+            break;
+        case OP_VPBROADCASTQ:
+            put_vex_instruction ( assembly, VEX_66, VEX_0F38, true, 0x59, destination->base, -1, source, 0 );
+            break;
+        case OP_VEXTRACTI128:
+            // The immediate selects the high half
+            put_vex_instruction ( assembly, VEX_66, VEX_0F3A, true, 0x39, source->base, -1, destination, 1 );
+            put_byte ( assembly, 1 );
+            break;
+        case OP_VZEROUPPER:
+            put_byte ( assembly, 0xC5 );
+            put_byte ( assembly, 0xF8 );
+            put_byte ( assembly, 0x77 );
+            break;
+        case OP_SYSCALL:
+            put_byte ( assembly, 0x0F );
+            put_byte ( assembly, 0x05 );
+            break;
+        case OP_RDTSC:
+            put_byte ( assembly, 0x0F );
+            put_byte ( assembly, 0x31 );
+            break;
+        case OP_REP_STOSQ:
+            put_byte ( assembly, 0xF3 );
+            put_byte ( assembly, 0x48 );
+            put_byte ( assembly, 0xAB );
+            break;
+        case OP_REP_MOVSQ:
+            put_byte ( assembly, 0xF3 );
+            put_byte ( assembly, 0x48 );
+            put_byte ( assembly, 0xA5 );
+            break;
+        case OP_MULQ:
+            put_modrm_quad ( assembly, 0xF7, 4, source, 0 );
+            break;
+        case OP_CQO:
+            put_byte ( assembly, 0x48 );
+            put_byte ( assembly, 0x99 );
+            break;
+        case OP_IDIVQ:
+            put_modrm_quad ( assembly, 0xF7, 7, source, 0 );
+            break;
+        case OP_SALQ:
+            encode_shift ( assembly, 4, source, destination );
+            break;
+        case OP_SARQ:
+            encode_shift ( assembly, 7, source, destination );
+            break;
+        case OP_SHRQ:
+            encode_shift ( assembly, 5, source, destination );
+            break;
+        case OP_JMP:
+            put_byte ( assembly, 0xE9 );
+            put_label_reference ( assembly, source->label, 0, 4, 0, true );
+            break;
+        case OP_JCC:
+            put_byte ( assembly, 0x0F );
+            put_byte ( assembly, 0x80 | instruction->condition );
+            put_label_reference ( assembly, source->label, 0, 4, 0, false );
+            break;
+        case OP_LOOP:
+            put_byte ( assembly, 0xE2 );
+            put_label_reference ( assembly, source->label, 0, 1, 0, false );
+            break;
+        case OP_CALL:
+            if ( source->type == OPERAND_MEMORY )
+            {
+                // call *m64 is 64-bit without REX.W
+                const uint8_t opcode = 0xFF;
+                put_modrm_instruction ( assembly, false, &opcode, 1, 2, false, source, 0 );
+                break;
+            }
+            put_byte ( assembly, 0xE8 );
+            put_label_reference ( assembly, source->label, 0, 4, 0, true );
+            break;
+        case OP_RET:
+            put_byte ( assembly, 0xC3 );
+            break;
+
+        case OP_LABEL: {
+            label_definition_t *label = &assembly->labels[source->label];
+            assert ( !label->defined && "Label defined twice" );
+            label->defined = true;
+            label->section = current_section;
+            label->offset = current_offset ( assembly );
+            break;
+        }
+        case OP_SECTION:
+            current_section = source->value;
+            break;
+        case OP_GLOBAL:
+            assembly->labels[source->label].global = true;
+            break;
+        case OP_FUNCTION_END: {
+            label_definition_t *label = &assembly->labels[source->label];
+            assert ( label->defined && label->section == current_section );
+            label->size = current_offset ( assembly ) - label->offset;
+            break;
+        }
+        case OP_ALIGN:
+            encode_align ( assembly, source->value );
+            break;
+        case OP_ZERO:
+            for ( int64_t i = 0; i < source->value; i++ )
+                put_byte ( assembly, 0 );
+            break;
+        case OP_ASCIZ:
+            encode_asciz ( assembly, instruction->text );
+            break;
+        case OP_DIRECTIVE:
+            // Platform specific text, with no meaning to the built-in assembler
+            break;
+    }
+}
+
+/* Patches every reference to a label defined in the same section as the reference itself,
+ * since their distance is now known. All other references are kept as relocations.
+ */
+static void resolve_local_relocations ( assembly_t *assembly )
+{
+    size_t kept = 0;
+    for ( size_t i = 0; i < assembly->n_relocations; i++ )
+    {
+        relocation_t *relocation = &assembly->relocations[i];
+        label_definition_t *label = &assembly->labels[relocation->label];
+        if ( !label->defined || label->section != relocation->section )
+        {
+            assembly->relocations[kept++] = *relocation;
+            continue;
+        }
+
+        int64_t value = (int64_t) label->offset + relocation->addend - (int64_t) relocation->offset;
+        uint8_t *field = &assembly->sections[relocation->section].bytes[relocation->offset];
+        if ( relocation->size == 1 )
+        {
+            assert ( fits_int8 ( value ) && "Short jump out of range" );
+            field[0] = (uint8_t) value;
+        }
+        else
+        {
+            assert ( fits_int32 ( value ) );
+            for ( int b = 0; b < 4; b++ )
+                field[b] = (uint8_t) ( (uint64_t) value >> (8*b) );
+        }
+    }
+    assembly->n_relocations = kept;
+}
@@ -0,0 +1,594 @@
+#include "vslc.h"
+#include "bytecode.h"
+
+// Only needed to decode string literals
+#include "emit.h"
+
+// Takes in a symbol of type SYMBOL_FUNCTION, and returns how many parameters the function takes
+#define FUNC_PARAM_COUNT(func) ((func)->node->children[1]->n_children)
+
+static void lower_function ( symbol_t *symbol, bytecode_function_t *function );
+static void lower_statement ( node_t *node );
+static size_t lower_expression ( node_t *expression );
+static void lay_out_memory ( void );
+static void decode_strings ( void );
+
+/* The program being built, and the capacity of its growable arrays */
+static bytecode_program_t *program;
+static size_t code_capacity, constants_capacity;
+
+/* The program's global_positions, which are needed while lowering */
+static size_t *global_position;
+
+/* Entry point for lowering */
+bytecode_program_t* compile_bytecode ( void )
+{
+    program = calloc ( 1, sizeof(bytecode_program_t) );
+    code_capacity = constants_capacity = 0;
+    global_position = malloc ( global_symbols->n_symbols * sizeof(size_t) );
+
+    lay_out_memory ( );
+    decode_strings ( );
+
+    // Number the functions before lowering any of them, so calls can refer to functions declared later
+    for ( size_t i = 0; i < global_symbols->n_symbols; i++ )
+        if ( global_symbols->symbols[i]->type == SYMBOL_FUNCTION )
+            global_position[i] = program->n_functions++;
+
+    if ( program->n_functions == 0 )
+    {
+        fprintf ( stderr, "error: program contained no functions\n" );
+        exit ( EXIT_FAILURE );
+    }
+
+    program->functions = calloc ( program->n_functions, sizeof(bytecode_function_t) );
+    for ( size_t i = 0; i < global_symbols->n_symbols; i++ )
+    {
+        symbol_t *symbol = global_symbols->symbols[i];
+        if ( symbol->type == SYMBOL_FUNCTION )
+            lower_function ( symbol, &program->functions[global_position[i]] );
+    }
+
+    program->global_positions = global_position;
+    global_position = NULL;
+    bytecode_program_t *result = program;
+    program = NULL;
+    return result;
+}
+
+void destroy_bytecode ( bytecode_program_t *program )
+{
+    for ( size_t i = 0; i < program->n_strings; i++ )
+        free ( program->strings[i] );
+    free ( program->strings );
+    free ( program->constants );
+    free ( program->functions );
+    free ( program->code );
+    free ( program->global_positions );
+    free ( program );
+}
+
+/* Internal matters */
+
+/* Gives every global variable one word of the flat memory block, and every array one word per element */
+static void lay_out_memory ( void )
+{
+    for ( size_t i = 0; i < global_symbols->n_symbols; i++ )
+    {
+        symbol_t *symbol = global_symbols->symbols[i];
+        if ( symbol->type == SYMBOL_GLOBAL_VAR )
+        {
+            global_position[i] = program->memory_size;
+            program->memory_size += 1;
+        }
+        else if ( symbol->type == SYMBOL_GLOBAL_ARRAY )
+        {
+            if ( symbol->node->children[1]->type != NUMBER_DATA )
+            {
+                fprintf ( stderr, "error: length of array '%s' is not compile time known\n", symbol->name );
+                exit ( EXIT_FAILURE );
+            }
+            global_position[i] = program->memory_size;
+            program->memory_size += *(int64_t*) symbol->node->children[1]->data;
+        }
+    }
+}
+
+static void decode_strings ( void )
+{
+    program->n_strings = string_list_len;
+    program->strings = malloc ( string_list_len * sizeof(char*) );
+    for ( size_t i = 0; i < string_list_len; i++ )
+    {
+        size_t length;
+        program->strings[i] = decode_string_literal ( string_list[i], &length );
+    }
+}
+
+static size_t emit ( bytecode_opcode_t opcode, size_t a, int64_t b, int64_t c )
+{
+    if ( program->n_code >= code_capacity )
+    {
+        code_capacity = code_capacity * 2 + 1024;
+        program->code = realloc ( program->code, code_capacity * sizeof(bytecode_t) );
+    }
+    program->code[program->n_code] = (bytecode_t) { .opcode = opcode, .a = a, .b = b, .c = c };
+    return program->n_code++;
+}
+
+static bool fits_int32 ( int64_t value )
+{
+    return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+/* Returns true if the node is a number that fits in a 32-bit immediate */
+static bool is_small_number ( node_t *node )
+{
+    return node->type == NUMBER_DATA && fits_int32 ( *(int64_t*) node->data );
+}
+
+static int64_t number_value ( node_t *node )
+{
+    return *(int64_t*) node->data;
+}
+
+static void load_number ( size_t destination, int64_t value )
+{
+    if ( fits_int32 ( value ) )
+    {
+        emit ( BC_LOADI, destination, value, 0 );
+        return;
+    }
+    if ( program->n_constants >= constants_capacity )
+    {
+        constants_capacity = constants_capacity * 2 + 16;
+        program->constants = realloc ( program->constants, constants_capacity * sizeof(int64_t) );
+    }
+    program->constants[program->n_constants] = value;
+    emit ( BC_LOADK, destination, program->n_constants++, 0 );
+}
+
+/* The state of the function currently being lowered */
+static bytecode_function_t *current_bytecode_function;
+
+/* Registers below n_variables hold parameters and local variables.
+ * Temporaries are allocated upwards from there, and freed at the end of every statement. */
+static size_t next_temporary;
+
+static size_t new_temporary ( void )
+{
+    size_t temporary = next_temporary++;
+    if ( next_temporary > current_bytecode_function->n_registers )
+        current_bytecode_function->n_registers = next_temporary;
+    return temporary;
+}
+
+/* Jump targets are labels while a function is lowered, and become instruction indices at the end */
+static size_t *label_positions;
+static size_t n_labels, labels_capacity;
+
+static size_t new_jump_label ( void )
+{
+    if ( n_labels >= labels_capacity )
+    {
+        labels_capacity = labels_capacity * 2 + 64;
+        label_positions = realloc ( label_positions, labels_capacity * sizeof(size_t) );
+    }
+    label_positions[n_labels] = SIZE_MAX;
+    return n_labels++;
+}
+
+static void place_jump_label ( size_t label )
+{
+    label_positions[label] = program->n_code;
+}
+
+static bool is_jump ( uint16_t opcode )
+{
+    return opcode >= BC_JMP && opcode <= BC_JGEI;
+}
+
+static bool writes_register_a ( uint16_t opcode )
+{
+    return opcode == BC_MOVE || opcode == BC_LOADI || opcode == BC_LOADK || opcode == BC_LOADG
+        || opcode == BC_LOADA || ( opcode >= BC_ADD && opcode <= BC_ADDG ) || opcode == BC_CALL;
+}
+
+/* Makes the value in register source available in register destination.
+ * When source is a temporary that was just computed, the instruction computing it is retargeted instead.
+ */
+static void move_into ( size_t destination, size_t source )
+{
+    if ( destination == source )
+        return;
+    bytecode_t *last = &program->code[program->n_code - 1];
+    if ( source >= current_bytecode_function->n_variables && writes_register_a ( last->opcode ) && last->a == source )
+        last->a = destination;
+    else
+        emit ( BC_MOVE, destination, source, 0 );
+}
+
+static void lower_function ( symbol_t *symbol, bytecode_function_t *function )
+{
+    current_bytecode_function = function;
+
+    // Parameters and local variables are numbered together, so their sequence numbers are their registers
+    *function = (bytecode_function_t) {
+        .symbol = symbol,
+        .entry = program->n_code,
+        .n_parameters = FUNC_PARAM_COUNT(symbol),
+        .n_variables = symbol->function_symtable->n_symbols,
+        .n_registers = symbol->function_symtable->n_symbols
+    };
+    next_temporary = function->n_variables;
+    n_labels = 0;
+
+    lower_statement ( symbol->node->children[2] );
+
+    // In case the function didn't return, return 0 here
+    size_t zero = new_temporary ( );
+    emit ( BC_LOADI, zero, 0, 0 );
+    emit ( BC_RET, zero, 0, 0 );
+
+    if ( function->n_registers > UINT16_MAX )
+    {
+        fprintf ( stderr, "error: function '%s' needs more than %d registers\n", symbol->name, UINT16_MAX );
+        exit ( EXIT_FAILURE );
+    }
+
+    for ( size_t i = function->entry; i < program->n_code; i++ )
+        if ( is_jump ( program->code[i].opcode ) )
+            program->code[i].c = label_positions[program->code[i].c];
+
+    free ( label_positions );
+    label_positions = NULL;
+    n_labels = labels_capacity = 0;
+}
+
+static size_t lower_function_call ( node_t *call )
+{
+    symbol_t *symbol = call->children[0]->symbol;
+    if ( symbol->type != SYMBOL_FUNCTION ) {
+        fprintf ( stderr, "error: '%s' is not a function\n", symbol->name );
+        exit ( EXIT_FAILURE );
+    }
+
+    node_t *argument_list = call->children[1];
+    size_t parameter_count = FUNC_PARAM_COUNT( symbol );
+    if ( parameter_count != argument_list->n_children )
+    {
+        fprintf ( stderr, "error: function '%s' expects '%zu' arguments, but '%zu' were given\n",
+                  symbol->name, parameter_count, argument_list->n_children );
+        exit ( EXIT_FAILURE );
+    }
+
+    // The arguments are placed in consecutive registers, which the result then replaces
+    size_t first_argument = next_temporary;
+    for ( size_t i = 0; i < parameter_count; i++ )
+        new_temporary ( );
+    size_t result = parameter_count > 0 ? first_argument : new_temporary ( );
+
+    // Evaluated from right to left, like the native code does
+    for ( size_t i = parameter_count; i-- > 0; )
+        move_into ( first_argument + i, lower_expression ( argument_list->children[i] ) );
+
+    emit ( BC_CALL, result, global_position[symbol->sequence_number], first_argument );
+    return result;
+}
+
+/* Returns the register of a parameter or local variable, or SIZE_MAX for global variables */
+static size_t variable_register ( node_t *node )
+{
+    assert ( node->type == IDENTIFIER_DATA );
+
+    symbol_t *symbol = node->symbol;
+    switch ( symbol->type )
+    {
+        case SYMBOL_GLOBAL_VAR:
+            return SIZE_MAX;
+        case SYMBOL_LOCAL_VAR:
+        case SYMBOL_PARAMETER:
+            return symbol->sequence_number;
+        case SYMBOL_FUNCTION:
+            fprintf ( stderr, "error: symbol '%s' is a function, not a variable\n", symbol->name );
+            exit ( EXIT_FAILURE );
+        case SYMBOL_GLOBAL_ARRAY:
+            fprintf ( stderr, "error: symbol '%s' is an array, not a variable\n", symbol->name );
+            exit ( EXIT_FAILURE );
+        default: assert ( false && "Unknown variable symbol type" );
+    }
+}
+
+/* Returns the first word of the array referenced by an ARRAY_INDEXING node */
+static size_t array_base ( node_t *node )
+{
+    assert ( node->type == ARRAY_INDEXING );
+
+    symbol_t *symbol = node->children[0]->symbol;
+    if ( symbol->type != SYMBOL_GLOBAL_ARRAY ) {
+        fprintf ( stderr, "error: symbol '%s' is not an array\n", symbol->name );
+        exit ( EXIT_FAILURE );
+    }
+    return global_position[symbol->sequence_number];
+}
+
+static bool is_global_variable ( node_t *node )
+{
+    return node->type == IDENTIFIER_DATA && node->symbol->type == SYMBOL_GLOBAL_VAR;
+}
+
+/* Emits a binary operation, evaluating the operands in the given order */
+static size_t lower_binary ( bytecode_opcode_t opcode, node_t *expression, bool right_first )
+{
+    size_t left, right;
+    if ( right_first )
+    {
+        right = lower_expression ( expression->children[1] );
+        left = lower_expression ( expression->children[0] );
+    }
+    else
+    {
+        left = lower_expression ( expression->children[0] );
+        right = lower_expression ( expression->children[1] );
+    }
+    size_t result = new_temporary ( );
+    emit ( opcode, result, left, right );
+    return result;
+}
+
+/* Emits an addition, using a superinstruction when one operand is a constant or a global variable */
+static size_t lower_addition ( node_t *expression )
+{
+    node_t *left = expression->children[0], *right = expression->children[1];
+    if ( is_small_number ( right ) || is_small_number ( left ) )
+    {
+        node_t *constant = is_small_number ( right ) ? right : left;
+        size_t other = lower_expression ( constant == right ? left : right );
+        size_t result = new_temporary ( );
+        emit ( BC_ADDI, result, other, number_value ( constant ) );
+        return result;
+    }
+    if ( is_global_variable ( right ) )
+    {
+        // The global is read after the left side is evaluated, just like in the native code
+        size_t other = lower_expression ( left );
+        size_t result = new_temporary ( );
+        emit ( BC_ADDG, result, other, global_position[right->symbol->sequence_number] );
+        return result;
+    }
+    return lower_binary ( BC_ADD, expression, false );
+}
+
+/* Emits code to evaluate the expression, and returns the register holding the result.
+ * The operands are evaluated in the same order as in generator.c, so side effects happen in the same order.
+ */
+static size_t lower_expression ( node_t *expression )
+{
+    switch ( expression->type )
+    {
+        case NUMBER_DATA: {
+            size_t result = new_temporary ( );
+            load_number ( result, number_value ( expression ) );
+            return result;
+        }
+        case IDENTIFIER_DATA: {
+            size_t variable = variable_register ( expression );
+            if ( variable != SIZE_MAX )
+                return variable;
+            size_t result = new_temporary ( );
+            emit ( BC_LOADG, result, global_position[expression->symbol->sequence_number], 0 );
+            return result;
+        }
+        case ARRAY_INDEXING: {
+            size_t base = array_base ( expression );
+            size_t index = lower_expression ( expression->children[1] );
+            size_t result = new_temporary ( );
+            emit ( BC_LOADA, result, base, index );
+            return result;
+        }
+        case EXPRESSION: {
+            char* data = expression->data;
+            if ( strcmp ( data, "+" ) == 0 )
+                return lower_addition ( expression );
+            if ( strcmp ( data, "-" ) == 0 )
+            {
+                if ( expression->n_children == 1 )
+                {
+                    size_t operand = lower_expression ( expression->children[0] );
+                    size_t result = new_temporary ( );
+                    emit ( BC_NEG, result, operand, 0 );
+                    return result;
+                }
+                node_t *right = expression->children[1];
+                if ( is_small_number ( right ) && number_value ( right ) != INT32_MIN )
+                {
+                    size_t left = lower_expression ( expression->children[0] );
+                    size_t result = new_temporary ( );
+                    emit ( BC_ADDI, result, left, -number_value ( right ) );
+                    return result;
+                }
+                return lower_binary ( BC_SUB, expression, true );
+            }
+            if ( strcmp ( data, "*" ) == 0 )
+                return lower_binary ( BC_MUL, expression, false );
+            if ( strcmp ( data, "/" ) == 0 )
+                return lower_binary ( BC_DIV, expression, true );
+            if ( strcmp ( data, "<<" ) == 0 )
+                return lower_binary ( BC_SHL, expression, true );
+            if ( strcmp ( data, ">>" ) == 0 )
+                return lower_binary ( BC_SHR, expression, true );
+            assert ( false && "Unknown expression operation" );
+        }
+        case FUNCTION_CALL:
+            return lower_function_call ( expression );
+        default: assert ( false && "Unknown expression type" );
+    }
+}
+
+static void lower_assignment_statement ( node_t *statement )
+{
+    node_t *dest = statement->children[0];
+
+    // First the right hand side of the assignment is evaluated
+    size_t value = lower_expression ( statement->children[1] );
+
+    if ( dest->type == IDENTIFIER_DATA )
+    {
+        size_t variable = variable_register ( dest );
+        if ( variable != SIZE_MAX )
+            move_into ( variable, value );
+        else
+            emit ( BC_STOREG, value, global_position[dest->symbol->sequence_number], 0 );
+    }
+    else
+    {
+        size_t base = array_base ( dest );
+        size_t index = lower_expression ( dest->children[1] );
+        emit ( BC_STOREA, value, base, index );
+    }
+}
+
+static void lower_print_statement ( node_t *statement )
+{
+    node_t *print_items = statement->children[0];
+    for ( size_t i = 0; i < print_items->n_children; i++ )
+    {
+        node_t *item = print_items->children[i];
+        if ( item->type == STRING_LIST_REFERENCE )
+            emit ( BC_PRINTS, 0, (size_t) item->data, 0 );
+        else
+            emit ( BC_PRINTI, lower_expression ( item ), 0, 0 );
+    }
+    emit ( BC_NEWLINE, 0, 0, 0 );
+}
+
+/* Relations, as offsets from BC_JEQ and BC_JEQI */
+typedef enum { REL_EQ, REL_NE, REL_LT, REL_LE, REL_GT, REL_GE } relation_t;
+
+static const relation_t NEGATED_RELATION[] = {
+    [REL_EQ] = REL_NE, [REL_NE] = REL_EQ, [REL_LT] = REL_GE, [REL_LE] = REL_GT, [REL_GT] = REL_LE, [REL_GE] = REL_LT
+};
+// The relation that holds with the operands swapped
+static const relation_t MIRRORED_RELATION[] = {
+    [REL_EQ] = REL_EQ, [REL_NE] = REL_NE, [REL_LT] = REL_GT, [REL_LE] = REL_GE, [REL_GT] = REL_LT, [REL_GE] = REL_LE
+};
+
+static relation_t relation_type ( node_t *relation )
+{
+    const char *type = relation->data;
+    if ( strcmp ( type, "=" ) == 0 )
+        return REL_EQ;
+    if ( strcmp ( type, "!=" ) == 0 )
+        return REL_NE;
+    if ( strcmp ( type, "<" ) == 0 )
+        return REL_LT;
+    if ( strcmp ( type, "<=" ) == 0 )
+        return REL_LE;
+    if ( strcmp ( type, ">" ) == 0 )
+        return REL_GT;
+    if ( strcmp ( type, ">=" ) == 0 )
+        return REL_GE;
+    assert ( false && "Unknown relation type" );
+}
+
+/* Emits a single compare-and-branch, jumping to label when the relation evaluates to jump_if */
+static void lower_conditional_jump ( node_t *relation, bool jump_if, size_t label )
+{
+    relation_t type = relation_type ( relation );
+    if ( !jump_if )
+        type = NEGATED_RELATION[type];
+
+    node_t *left = relation->children[0], *right = relation->children[1];
+    if ( is_small_number ( right ) )
+        emit ( BC_JEQI + type, lower_expression ( left ), number_value ( right ), label );
+    else if ( is_small_number ( left ) )
+        emit ( BC_JEQI + MIRRORED_RELATION[type], lower_expression ( right ), number_value ( left ), label );
+    else
+    {
+        size_t left_register = lower_expression ( left );
+        size_t right_register = lower_expression ( right );
+        emit ( BC_JEQ + type, left_register, right_register, label );
+    }
+}
+
+static void lower_if_statement ( node_t *statement )
+{
+    size_t else_label = new_jump_label ( );
+    lower_conditional_jump ( statement->children[0], false, else_label );
+
+    lower_statement ( statement->children[1] );
+
+    if ( statement->n_children > 2 )
+    {
+        size_t endif_label = new_jump_label ( );
+        emit ( BC_JMP, 0, 0, endif_label );
+        place_jump_label ( else_label );
+        lower_statement ( statement->children[2] );
+        place_jump_label ( endif_label );
+    }
+    else
+        place_jump_label ( else_label );
+}
+
+/* The end label of the innermost while loop being lowered, which is where break statements jump */
+static size_t innermost_while_end_label;
+
+/* The condition is tested once before the loop, and then at the bottom of every iteration,
+ * so each iteration only dispatches one branch */
+static void lower_while_statement ( node_t *statement )
+{
+    size_t body_label = new_jump_label ( );
+    size_t end_label = new_jump_label ( );
+
+    size_t previous_innermost_while_end_label = innermost_while_end_label;
+    innermost_while_end_label = end_label;
+
+    lower_conditional_jump ( statement->children[0], false, end_label );
+    place_jump_label ( body_label );
+    lower_statement ( statement->children[1] );
+    lower_conditional_jump ( statement->children[0], true, body_label );
+    place_jump_label ( end_label );
+
+    innermost_while_end_label = previous_innermost_while_end_label;
+}
+
+/* Recursively lower the given statement node, and all sub-statements. */
+static void lower_statement ( node_t *node )
+{
+    // Temporaries only live within a single statement
+    size_t first_temporary = next_temporary;
+
+    switch ( node->type )
+    {
+        case BLOCK: {
+            node_t *statement_list = node->children[node->n_children-1];
+            for ( size_t i = 0; i < statement_list->n_children; i++ )
+                lower_statement ( statement_list->children[i] );
+            break;
+        }
+        case ASSIGNMENT_STATEMENT:
+            lower_assignment_statement ( node );
+            break;
+        case PRINT_STATEMENT:
+            lower_print_statement ( node );
+            break;
+        case RETURN_STATEMENT:
+            emit ( BC_RET, lower_expression ( node->children[0] ), 0, 0 );
+            break;
+        case IF_STATEMENT:
+            lower_if_statement ( node );
+            break;
+        case WHILE_STATEMENT:
+            lower_while_statement ( node );
+            break;
+        case BREAK_STATEMENT:
+            emit ( BC_JMP, 0, 0, innermost_while_end_label );
+            break;
+        case FUNCTION_CALL:
+            lower_function_call ( node );
+            break;
+        default: assert ( false && "Unknown statement type" );
+    }
+
+    next_temporary = first_temporary;
+}
@@ -0,0 +1,291 @@
+#include "vslc.h"
+#include "callgraph.h"
+#include "profile.h"
+
+// Without a profile, each loop around a call is assumed to make it this many times more often,
+// until the weight reaches MAX_ESTIMATED_WEIGHT
+#define LOOP_WEIGHT 10
+#define MAX_ESTIMATED_WEIGHT 1000000
+
+// Functions placed next to each other are kept in clusters of about a page of code.
+// Sizes are counted in syntax tree nodes, which take a few bytes of code each
+#define CLUSTER_SIZE_LIMIT 1024
+
+// With a profile, a function is hot when it gets at least 1/HOT_FRACTION of the calls the most called one gets
+#define HOT_FRACTION 100
+
+#define NO_FUNCTION SIZE_MAX
+
+static size_t count_nodes ( node_t *node );
+static void find_calls ( call_graph_t *graph, size_t caller, node_t *node, uint64_t weight, size_t *site );
+static void add_call ( call_graph_t *graph, size_t caller, size_t callee, uint64_t weight );
+static void mark_reachable ( call_graph_t *graph, size_t function );
+static void sort_descending ( size_t *items, size_t n_items, const double *key );
+
+/* External interface */
+
+call_graph_t* create_call_graph ( void )
+{
+    size_t n_symbols = global_symbols->n_symbols;
+    call_graph_t *graph = calloc ( 1, sizeof(call_graph_t) );
+    graph->first_edge = malloc ( ( n_symbols + 1 ) * sizeof(size_t) );
+    graph->reachable = calloc ( n_symbols, sizeof(bool) );
+    graph->calls = calloc ( n_symbols, sizeof(uint64_t) );
+    graph->size = calloc ( n_symbols, sizeof(size_t) );
+
+    for ( size_t i = 0; i < n_symbols; i++ )
+    {
+        symbol_t *symbol = global_symbols->symbols[i];
+        graph->first_edge[i] = graph->n_edges;
+        if ( symbol->type != SYMBOL_FUNCTION )
+            continue;
+        if ( graph->entry == NULL )
+            graph->entry = symbol;
+        graph->size[i] = count_nodes ( symbol->node->children[2] );
+        size_t site = 0;
+        find_calls ( graph, i, symbol->node->children[2], 1, &site );
+    }
+    graph->first_edge[n_symbols] = graph->n_edges;
+
+    if ( graph->entry == NULL )
+        return graph;
+    mark_reachable ( graph, graph->entry->sequence_number );
+
+    if ( profile != NULL )
+    {
+        for ( size_t i = 0; i < n_symbols; i++ )
+            graph->calls[i] = profile->functions[i].calls;
+    }
+    else
+    {
+        graph->calls[graph->entry->sequence_number] = 1;
+        for ( size_t i = 0; i < graph->n_edges; i++ )
+            if ( graph->reachable[graph->edges[i].caller] )
+                graph->calls[graph->edges[i].callee] += graph->edges[i].weight;
+    }
+    return graph;
+}
+
+void destroy_call_graph ( call_graph_t *graph )
+{
+    free ( graph->edges );
+    free ( graph->first_edge );
+    free ( graph->reachable );
+    free ( graph->calls );
+    free ( graph->size );
+    free ( graph );
+}
+
+/* Places functions by call-chain clustering. Going from the most called function to the least called,
+ * each function's cluster is appended to the cluster of the caller that calls it most, unless that makes
+ * the cluster larger than CLUSTER_SIZE_LIMIT. Leaf functions that no single caller makes most of the calls to
+ * are clustered with each other instead. The clusters are then placed by how many calls they get per node.
+ */
+symbol_t** order_functions ( call_graph_t *graph, size_t *n_functions )
+{
+    size_t n_symbols = global_symbols->n_symbols;
+
+    // Every cluster is a list of functions, identified by its first function
+    size_t *leader = malloc ( n_symbols * sizeof(size_t) );
+    size_t *next = malloc ( n_symbols * sizeof(size_t) );
+    size_t *last = malloc ( n_symbols * sizeof(size_t) );
+    size_t *cluster_size = malloc ( n_symbols * sizeof(size_t) );
+    double *cluster_calls = malloc ( n_symbols * sizeof(double) );
+
+    size_t *functions = malloc ( n_symbols * sizeof(size_t) );
+    size_t n = 0;
+    for ( size_t i = 0; i < n_symbols; i++ )
+    {
+        if ( !graph->reachable[i] )
+            continue;
+        functions[n++] = i;
+        leader[i] = last[i] = i;
+        next[i] = NO_FUNCTION;
+        cluster_size[i] = graph->size[i];
+        cluster_calls[i] = graph->calls[i];
+    }
+
+    // The caller making the most calls to each function, and how many calls all callers make
+    uint64_t *heaviest = calloc ( n_symbols, sizeof(uint64_t) );
+    uint64_t *incoming = calloc ( n_symbols, sizeof(uint64_t) );
+    size_t *heaviest_caller = malloc ( n_symbols * sizeof(size_t) );
+    for ( size_t i = 0; i < graph->n_edges; i++ )
+    {
+        call_edge_t *edge = &graph->edges[i];
+        if ( !graph->reachable[edge->caller] || edge->caller == edge->callee )
+            continue;
+        incoming[edge->callee] += edge->weight;
+        if ( edge->weight > heaviest[edge->callee] )
+        {
+            heaviest[edge->callee] = edge->weight;
+            heaviest_caller[edge->callee] = edge->caller;
+        }
+    }
+
+    sort_descending ( functions, n, cluster_calls );
+    size_t leaf_cluster = NO_FUNCTION;
+    for ( size_t i = 0; i < n; i++ )
+    {
+        size_t function = functions[i];
+        if ( heaviest[function] == 0 )
+            continue;
+
+        size_t source = leader[function];
+        size_t target = leader[heaviest_caller[function]];
+        bool is_leaf = graph->first_edge[function] == graph->first_edge[function + 1];
+        if ( is_leaf && heaviest[function] * 2 < incoming[function] )
+        {
+            // A leaf starts a new cluster of leaves if there is none yet, or the last one is full
+            if ( leaf_cluster == NO_FUNCTION
+              || cluster_size[leaf_cluster] + cluster_size[source] > CLUSTER_SIZE_LIMIT )
+            {
+                leaf_cluster = function;
+                continue;
+            }
+            target = leaf_cluster;
+        }
+        if ( source == target || cluster_size[source] + cluster_size[target] > CLUSTER_SIZE_LIMIT )
+            continue;
+
+        for ( size_t member = source; member != NO_FUNCTION; member = next[member] )
+            leader[member] = target;
+        next[last[target]] = source;
+        last[target] = last[source];
+        cluster_size[target] += cluster_size[source];
+        cluster_calls[target] += cluster_calls[source];
+    }
+
+    // Clusters are placed by density, from the order their functions were visited in
+    size_t *clusters = malloc ( n * sizeof(size_t) );
+    double *density = malloc ( n_symbols * sizeof(double) );
+    size_t n_clusters = 0;
+    for ( size_t i = 0; i < n; i++ )
+    {
+        size_t function = functions[i];
+        if ( leader[function] != function )
+            continue;
+        clusters[n_clusters++] = function;
+        density[function] = cluster_calls[function] / cluster_size[function];
+    }
+    sort_descending ( clusters, n_clusters, density );
+
+    // Each part of the text section keeps the order of the clusters
+    static const text_part_t PART_ORDER[] = { TEXT_PART_HOT, TEXT_PART_NORMAL, TEXT_PART_UNLIKELY };
+    symbol_t **order = malloc ( n * sizeof(symbol_t*) );
+    size_t n_placed = 0;
+    for ( size_t part = 0; part < sizeof(PART_ORDER) / sizeof(PART_ORDER[0]); part++ )
+        for ( size_t i = 0; i < n_clusters; i++ )
+            for ( size_t member = clusters[i]; member != NO_FUNCTION; member = next[member] )
+                if ( function_text_part ( member ) == PART_ORDER[part] )
+                    order[n_placed++] = global_symbols->symbols[member];
+    assert ( n_placed == n );
+
+    free ( leader );
+    free ( next );
+    free ( last );
+    free ( cluster_size );
+    free ( cluster_calls );
+    free ( functions );
+    free ( heaviest );
+    free ( incoming );
+    free ( heaviest_caller );
+    free ( clusters );
+    free ( density );
+    *n_functions = n;
+    return order;
+}
+
+text_part_t function_text_part ( size_t function )
+{
+    if ( profile == NULL || !profile->functions[function].present )
+        return TEXT_PART_NORMAL;
+    uint64_t calls = profile->functions[function].calls;
+    if ( calls == 0 )
+        return TEXT_PART_UNLIKELY;
+    if ( calls * HOT_FRACTION >= profile->max_calls )
+        return TEXT_PART_HOT;
+    return TEXT_PART_NORMAL;
+}
+
+/* Internal matters */
+
+static size_t count_nodes ( node_t *node )
+{
+    size_t count = 1;
+    for ( size_t i = 0; i < node->n_children; i++ )
+        count += count_nodes ( node->children[i] );
+    return count;
+}
+
+/* Adds an edge for every call in the syntax tree below node, where each call is made weight times.
+ * site is the number of the next call site, counting in the order the calls appear */
+static void find_calls ( call_graph_t *graph, size_t caller, node_t *node, uint64_t weight, size_t *site )
+{
+    if ( node->type == FUNCTION_CALL )
+    {
+        symbol_t *callee = node->children[0]->symbol;
+        if ( callee->type != SYMBOL_FUNCTION )
+        {
+            fprintf ( stderr, "error: '%s' is not a function\n", callee->name );
+            exit ( EXIT_FAILURE );
+        }
+        uint64_t calls = profile != NULL ? call_site_count ( &profile->functions[caller], *site ) : weight;
+        add_call ( graph, caller, callee->sequence_number, calls );
+        (*site)++;
+    }
+    if ( node->type == WHILE_STATEMENT && weight < MAX_ESTIMATED_WEIGHT )
+        weight *= LOOP_WEIGHT;
+    for ( size_t i = 0; i < node->n_children; i++ )
+        find_calls ( graph, caller, node->children[i], weight, site );
+}
+
+/* Counts another call site on the edge from caller to callee, adding the edge the first time.
+ * The caller's edges are the last ones added */
+static void add_call ( call_graph_t *graph, size_t caller, size_t callee, uint64_t weight )
+{
+    for ( size_t i = graph->first_edge[caller]; i < graph->n_edges; i++ )
+    {
+        if ( graph->edges[i].callee == callee )
+        {
+            graph->edges[i].n_calls++;
+            graph->edges[i].weight += weight;
+            return;
+        }
+    }
+
+    if ( graph->n_edges == graph->edges_capacity )
+    {
+        graph->edges_capacity = graph->edges_capacity * 2 + 8;
+        graph->edges = realloc ( graph->edges, graph->edges_capacity * sizeof(call_edge_t) );
+    }
+    graph->edges[graph->n_edges++] = (call_edge_t) {
+        .caller = caller, .callee = callee, .n_calls = 1, .weight = weight
+    };
+}
+
+static void mark_reachable ( call_graph_t *graph, size_t function )
+{
+    if ( graph->reachable[function] )
+        return;
+    graph->reachable[function] = true;
+    for ( size_t i = graph->first_edge[function]; i < graph->first_edge[function + 1]; i++ )
+        mark_reachable ( graph, graph->edges[i].callee );
+}
+
+/* Sorts items, which are sequence numbers, by key[item] from largest to smallest.
+ * Items with the same key are sorted by sequence number */
+static const double *sort_key;
+
+static int compare_descending ( const void *a, const void *b )
+{
+    size_t x = *(const size_t*) a, y = *(const size_t*) b;
+    if ( sort_key[x] != sort_key[y] )
+        return sort_key[x] > sort_key[y] ? -1 : 1;
+    return ( x > y ) - ( x < y );
+}
+
+static void sort_descending ( size_t *items, size_t n_items, const double *key )
+{
+    sort_key = key;
+    qsort ( items, n_items, sizeof(size_t), compare_descending );
+}
@@ -0,0 +1,241 @@
+#include "vslc.h"
+#include "assembler.h"
+
+#include <elf.h>
+
+// The sections of the object file, in the order they appear in the section header table
+enum {
+    SHDR_NULL, SHDR_TEXT, SHDR_RELA_TEXT, SHDR_RODATA, SHDR_BSS, SHDR_NOTE_GNU_STACK,
+    SHDR_SYMTAB, SHDR_STRTAB, SHDR_SHSTRTAB, SHDR_COUNT
+};
+
+static const int SECTION_HEADER_INDEX[] = {
+    [SECTION_TEXT] = SHDR_TEXT,
+    [SECTION_RODATA] = SHDR_RODATA,
+    [SECTION_BSS] = SHDR_BSS
+};
+
+/* A growable byte buffer, used to build the symbol, string and relocation tables */
+typedef struct
+{
+    uint8_t *bytes;
+    size_t size;
+    size_t capacity;
+} buffer_t;
+
+static void buffer_append ( buffer_t *buffer, const void *data, size_t size )
+{
+    if ( buffer->size + size > buffer->capacity )
+    {
+        buffer->capacity = ( buffer->size + size ) * 2;
+        buffer->bytes = realloc ( buffer->bytes, buffer->capacity );
+    }
+    memcpy ( &buffer->bytes[buffer->size], data, size );
+    buffer->size += size;
+}
+
+/* Adds a string to a string table, and returns its offset */
+static Elf64_Word add_string ( buffer_t *strtab, const char *string )
+{
+    Elf64_Word offset = strtab->size;
+    buffer_append ( strtab, string, strlen ( string ) + 1 );
+    return offset;
+}
+
+static void add_symbol ( buffer_t *symtab, Elf64_Word name, unsigned char binding, unsigned char type,
+                         Elf64_Section section, Elf64_Addr value, Elf64_Xword size )
+{
+    Elf64_Sym symbol = {
+        .st_name = name,
+        .st_info = ELF64_ST_INFO ( binding, type ),
+        .st_other = STV_DEFAULT,
+        .st_shndx = section,
+        .st_value = value,
+        .st_size = size
+    };
+    buffer_append ( symtab, &symbol, sizeof(symbol) );
+}
+
+/* Writes zero padding from the file position position, up to target */
+static size_t pad_to ( FILE *output, size_t position, size_t target )
+{
+    for ( ; position < target; position++ )
+        fputc ( 0, output );
+    return position;
+}
+
+/* Writes the assembled program as an ELF64 relocatable object for x86-64.
+ *
+ * Named labels become local symbols, so tools like objdump and perf can show function names, with the sizes
+ * OP_FUNCTION_END gives functions.
+ * Global labels become global symbols, and labels that are referenced but never defined become
+ * undefined global symbols, to be resolved by the linker.
+ * References to labels in other sections are relocated against the section symbols.
+ */
+void write_elf_object ( assembly_t *assembly, FILE *output )
+{
+    buffer_t symtab = { 0 }, strtab = { 0 }, shstrtab = { 0 }, rela_text = { 0 };
+    Elf64_Word *symbol_index = calloc ( assembly->n_labels, sizeof(Elf64_Word) );
+
+    add_string ( &strtab, "" );
+    add_symbol ( &symtab, 0, STB_LOCAL, STT_NOTYPE, SHN_UNDEF, 0, 0 );
+
+    // Section symbols come first, so relocations can refer to them by section
+    Elf64_Word section_symbol[_SECTION_COUNT];
+    Elf64_Word n_symbols = 1;
+    for ( int i = 0; i < _SECTION_COUNT; i++ )
+    {
+        add_symbol ( &symtab, 0, STB_LOCAL, STT_SECTION, SECTION_HEADER_INDEX[i], 0, 0 );
+        section_symbol[i] = n_symbols++;
+    }
+
+    // All local symbols must come before the global ones
+    for ( size_t i = 0; i < assembly->n_labels; i++ )
+    {
+        label_definition_t *label = &assembly->labels[i];
+        if ( !label->defined || label->global || label_name ( i ) == NULL )
+            continue;
+        unsigned char type = label->section == SECTION_TEXT ? STT_FUNC : STT_OBJECT;
+        add_symbol ( &symtab, add_string ( &strtab, label_name ( i ) ), STB_LOCAL, type,
+                     SECTION_HEADER_INDEX[label->section], label->offset, label->size );
+        symbol_index[i] = n_symbols++;
+    }
+    Elf64_Word first_global = n_symbols;
+
+    // Every label referenced without a definition needs an undefined symbol
+    bool *referenced = calloc ( assembly->n_labels, sizeof(bool) );
+    for ( size_t i = 0; i < assembly->n_relocations; i++ )
+        referenced[assembly->relocations[i].label] = true;
+
+    for ( size_t i = 0; i < assembly->n_labels; i++ )
+    {
+        label_definition_t *label = &assembly->labels[i];
+        if ( label->defined && label->global )
+        {
+            unsigned char type = label->section == SECTION_TEXT ? STT_FUNC : STT_OBJECT;
+            add_symbol ( &symtab, add_string ( &strtab, label_name ( i ) ), STB_GLOBAL, type,
+                         SECTION_HEADER_INDEX[label->section], label->offset, label->size );
+            symbol_index[i] = n_symbols++;
+        }
+        else if ( !label->defined && referenced[i] )
+        {
+            if ( label_name ( i ) == NULL )
+            {
+                fprintf ( stderr, "error: reference to undefined anonymous label .L%zu\n", i );
+                exit ( EXIT_FAILURE );
+            }
+            add_symbol ( &symtab, add_string ( &strtab, label_name ( i ) ), STB_GLOBAL, STT_NOTYPE, SHN_UNDEF, 0, 0 );
+            symbol_index[i] = n_symbols++;
+        }
+    }
+    free ( referenced );
+
+    for ( size_t i = 0; i < assembly->n_relocations; i++ )
+    {
+        relocation_t *relocation = &assembly->relocations[i];
+        label_definition_t *label = &assembly->labels[relocation->label];
+        assert ( relocation->section == SECTION_TEXT && relocation->size == 4 );
+
+        Elf64_Rela rela = { .r_offset = relocation->offset };
+        if ( label->defined )
+        {
+            // Relative to the start of the label's section
+            rela.r_info = ELF64_R_INFO ( section_symbol[label->section], R_X86_64_PC32 );
+            rela.r_addend = (Elf64_Sxword) label->offset + relocation->addend;
+        }
+        else
+        {
+            Elf64_Word type = relocation->is_call ? R_X86_64_PLT32 : R_X86_64_PC32;
+            rela.r_info = ELF64_R_INFO ( symbol_index[relocation->label], type );
+            rela.r_addend = relocation->addend;
+        }
+        buffer_append ( &rela_text, &rela, sizeof(rela) );
+    }
+    free ( symbol_index );
+
+    // Lay out the file: the ELF header, the contents of every section, then the section header table
+    Elf64_Shdr headers[SHDR_COUNT] = { 0 };
+    section_data_t *text = &assembly->sections[SECTION_TEXT];
+    section_data_t *rodata = &assembly->sections[SECTION_RODATA];
+    section_data_t *bss = &assembly->sections[SECTION_BSS];
+
+    add_string ( &shstrtab, "" );
+    headers[SHDR_TEXT] = (Elf64_Shdr) {
+        .sh_name = add_string ( &shstrtab, ".text" ), .sh_type = SHT_PROGBITS,
+        .sh_flags = SHF_ALLOC | SHF_EXECINSTR, .sh_size = text->size, .sh_addralign = 16
+    };
+    headers[SHDR_RELA_TEXT] = (Elf64_Shdr) {
+        .sh_name = add_string ( &shstrtab, ".rela.text" ), .sh_type = SHT_RELA, .sh_flags = SHF_INFO_LINK,
+        .sh_size = rela_text.size, .sh_link = SHDR_SYMTAB, .sh_info = SHDR_TEXT,
+        .sh_addralign = 8, .sh_entsize = sizeof(Elf64_Rela)
+    };
+    headers[SHDR_RODATA] = (Elf64_Shdr) {
+        .sh_name = add_string ( &shstrtab, ".rodata" ), .sh_type = SHT_PROGBITS,
+        .sh_flags = SHF_ALLOC, .sh_size = rodata->size, .sh_addralign = rodata->alignment
+    };
+    headers[SHDR_BSS] = (Elf64_Shdr) {
+        .sh_name = add_string ( &shstrtab, ".bss" ), .sh_type = SHT_NOBITS,
+        .sh_flags = SHF_ALLOC | SHF_WRITE, .sh_size = bss->size, .sh_addralign = bss->alignment
+    };
+    // An empty .note.GNU-stack tells the linker the program does not need an executable stack
+    headers[SHDR_NOTE_GNU_STACK] = (Elf64_Shdr) {
+        .sh_name = add_string ( &shstrtab, ".note.GNU-stack" ), .sh_type = SHT_PROGBITS, .sh_addralign = 1
+    };
+    headers[SHDR_SYMTAB] = (Elf64_Shdr) {
+        .sh_name = add_string ( &shstrtab, ".symtab" ), .sh_type = SHT_SYMTAB, .sh_size = symtab.size,
+        .sh_link = SHDR_STRTAB, .sh_info = first_global, .sh_addralign = 8, .sh_entsize = sizeof(Elf64_Sym)
+    };
+    headers[SHDR_STRTAB] = (Elf64_Shdr) {
+        .sh_name = add_string ( &shstrtab, ".strtab" ), .sh_type = SHT_STRTAB,
+        .sh_size = strtab.size, .sh_addralign = 1
+    };
+    headers[SHDR_SHSTRTAB] = (Elf64_Shdr) {
+        .sh_name = add_string ( &shstrtab, ".shstrtab" ), .sh_type = SHT_STRTAB, .sh_addralign = 1
+    };
+    headers[SHDR_SHSTRTAB].sh_size = shstrtab.size;
+
+    const void *contents[SHDR_COUNT] = {
+        [SHDR_TEXT] = text->bytes, [SHDR_RELA_TEXT] = rela_text.bytes, [SHDR_RODATA] = rodata->bytes,
+        [SHDR_SYMTAB] = symtab.bytes, [SHDR_STRTAB] = strtab.bytes, [SHDR_SHSTRTAB] = shstrtab.bytes
+    };
+
+    size_t position = sizeof(Elf64_Ehdr);
+    for ( int i = 1; i < SHDR_COUNT; i++ )
+    {
+        position = (position + headers[i].sh_addralign - 1) / headers[i].sh_addralign * headers[i].sh_addralign;
+        headers[i].sh_offset = position;
+        if ( headers[i].sh_type != SHT_NOBITS )
+            position += headers[i].sh_size;
+    }
+    size_t section_headers_offset = (position + 7) / 8 * 8;
+
+    Elf64_Ehdr header = {
+        .e_ident = { ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3, ELFCLASS64, ELFDATA2LSB, EV_CURRENT, ELFOSABI_SYSV },
+        .e_type = ET_REL,
+        .e_machine = EM_X86_64,
+        .e_version = EV_CURRENT,
+        .e_shoff = section_headers_offset,
+        .e_ehsize = sizeof(Elf64_Ehdr),
+        .e_shentsize = sizeof(Elf64_Shdr),
+        .e_shnum = SHDR_COUNT,
+        .e_shstrndx = SHDR_SHSTRTAB
+    };
+
+    fwrite ( &header, sizeof(header), 1, output );
+    position = sizeof(header);
+    for ( int i = 1; i < SHDR_COUNT; i++ )
+    {
+        if ( headers[i].sh_type == SHT_NOBITS || headers[i].sh_size == 0 )
+            continue;
+        position = pad_to ( output, position, headers[i].sh_offset );
+        fwrite ( contents[i], 1, headers[i].sh_size, output );
+        position += headers[i].sh_size;
+    }
+    pad_to ( output, position, section_headers_offset );
+    fwrite ( headers, sizeof(Elf64_Shdr), SHDR_COUNT, output );
+
+    free ( symtab.bytes );
+    free ( strtab.bytes );
+    free ( shstrtab.bytes );
+    free ( rela_text.bytes );
+}
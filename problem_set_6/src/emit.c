@@ -0,0 +1,481 @@
+#include "vslc.h"
+#include "emit.h"
+
+#include <ctype.h>
+
+/* The list of instructions generated so far, in program order */
+instruction_t *instructions;
+size_t n_instructions;
+static size_t instructions_capacity;
+
+int source_line, source_column;
+
+/* The names of all labels, indexed by label id. Anonymous labels have the name NULL */
+static char **label_names;
+static size_t n_labels;
+static size_t label_names_capacity;
+
+/* External interface */
+
+/* Appends a new instruction to the instruction list, resizing if needed */
+instruction_t* emit_instruction ( opcode_t opcode, operand_t source, operand_t destination )
+{
+    if ( n_instructions >= instructions_capacity )
+    {
+        instructions_capacity = instructions_capacity * 2 + 256;
+        instructions = realloc ( instructions, instructions_capacity * sizeof(instruction_t) );
+    }
+
+    instruction_t *instruction = &instructions[n_instructions++];
+    *instruction = (instruction_t) {
+        .opcode = opcode,
+        .operands = { source, destination },
+        .text = NULL,
+        .line = source_line,
+        .column = source_column
+    };
+    return instruction;
+}
+
+/* Appends an instruction carrying formatted text, such as OP_ASCIZ or OP_DIRECTIVE */
+void emit_text ( opcode_t opcode, const char *format, ... )
+{
+    va_list args, args_copy;
+    va_start ( args, format );
+    va_copy ( args_copy, args );
+    int length = vsnprintf ( NULL, 0, format, args );
+    va_end ( args );
+
+    char *text = malloc ( length + 1 );
+    vsnprintf ( text, length + 1, format, args_copy );
+    va_end ( args_copy );
+
+    emit_instruction ( opcode, NO_OPERAND, NO_OPERAND )->text = text;
+}
+
+/* Adds a label with the given (owned) name to the label list, and returns its id */
+static label_t add_label ( char *name )
+{
+    if ( n_labels >= label_names_capacity )
+    {
+        label_names_capacity = label_names_capacity * 2 + 64;
+        label_names = realloc ( label_names, label_names_capacity * sizeof(char*) );
+    }
+    label_names[n_labels] = name;
+    return n_labels++;
+}
+
+label_t new_label ( void )
+{
+    return add_label ( NULL );
+}
+
+label_t named_label ( const char *format, ... )
+{
+    va_list args, args_copy;
+    va_start ( args, format );
+    va_copy ( args_copy, args );
+    int length = vsnprintf ( NULL, 0, format, args );
+    va_end ( args );
+
+    char *name = malloc ( length + 1 );
+    vsnprintf ( name, length + 1, format, args_copy );
+    va_end ( args_copy );
+
+    return add_label ( name );
+}
+
+const char* label_name ( label_t label )
+{
+    assert ( label < n_labels );
+    return label_names[label];
+}
+
+size_t label_count ( void )
+{
+    return n_labels;
+}
+
+/* Removes the instructions from instructions[length] onwards, and the text they own */
+void truncate_instructions ( size_t length )
+{
+    assert ( length <= n_instructions );
+    for ( size_t i = length; i < n_instructions; i++ )
+        free ( instructions[i].text );
+    n_instructions = length;
+}
+
+/* Frees the instruction list, the text owned by instructions, and all label names */
+void destroy_instructions ( void )
+{
+    for ( size_t i = 0; i < n_instructions; i++ )
+        free ( instructions[i].text );
+    free ( instructions );
+    instructions = NULL;
+    n_instructions = instructions_capacity = 0;
+
+    for ( size_t i = 0; i < n_labels; i++ )
+        free ( label_names[i] );
+    free ( label_names );
+    label_names = NULL;
+    n_labels = label_names_capacity = 0;
+}
+
+/* Handles the escape sequences understood by the assembler: \n \t \r \b \f, \x hex, octal,
+ * and any other escaped character standing for itself, such as \" and \\
+ */
+char* decode_string_literal ( const char *literal, size_t *length )
+{
+    assert ( literal[0] == '"' );
+    // The decoded string is never longer than the literal
+    char *decoded = malloc ( strlen ( literal ) );
+    size_t n = 0;
+
+    const char *c = literal + 1;
+    while ( *c != '"' )
+    {
+        assert ( *c != '\0' && "Unterminated string literal" );
+        if ( *c != '\\' )
+        {
+            decoded[n++] = *c++;
+            continue;
+        }
+        c++;
+        switch ( *c )
+        {
+            case 'n': decoded[n++] = '\n'; c++; break;
+            case 't': decoded[n++] = '\t'; c++; break;
+            case 'r': decoded[n++] = '\r'; c++; break;
+            case 'b': decoded[n++] = '\b'; c++; break;
+            case 'f': decoded[n++] = '\f'; c++; break;
+            case 'x': {
+                c++;
+                uint8_t value = 0;
+                while ( isxdigit ( (unsigned char) *c ) )
+                {
+                    value = value * 16 + ( isdigit ( (unsigned char) *c ) ? *c - '0' : tolower ( *c ) - 'a' + 10 );
+                    c++;
+                }
+                decoded[n++] = value;
+                break;
+            }
+            default:
+                if ( *c >= '0' && *c <= '7' )
+                {
+                    // Up to three octal digits
+                    uint8_t value = 0;
+                    for ( int digits = 0; digits < 3 && *c >= '0' && *c <= '7'; digits++ )
+                        value = value * 8 + ( *c++ - '0' );
+                    decoded[n++] = value;
+                }
+                else
+                    decoded[n++] = *c++;
+                break;
+        }
+    }
+    decoded[n] = '\0';
+    *length = n;
+    return decoded;
+}
+
+/* Internal matters: rendering the instruction list as text */
+
+// All output is collected in this buffer, and only written out when it is full
+#define OUTPUT_BUFFER_SIZE (1 << 16)
+static char output_buffer[OUTPUT_BUFFER_SIZE];
+static size_t output_length;
+static FILE *output_file;
+
+static void flush_output ( void )
+{
+    fwrite ( output_buffer, 1, output_length, output_file );
+    output_length = 0;
+}
+
+static void output_string ( const char *string )
+{
+    size_t length = strlen ( string );
+    if ( output_length + length > OUTPUT_BUFFER_SIZE )
+    {
+        flush_output ( );
+        // Strings that don't fit in an empty buffer are written directly
+        if ( length > OUTPUT_BUFFER_SIZE )
+        {
+            fwrite ( string, 1, length, output_file );
+            return;
+        }
+    }
+    memcpy ( &output_buffer[output_length], string, length );
+    output_length += length;
+}
+
+static void output_char ( char c )
+{
+    if ( output_length == OUTPUT_BUFFER_SIZE )
+        flush_output ( );
+    output_buffer[output_length++] = c;
+}
+
+/* Writes the decimal representation of value, without going through printf */
+static void output_int ( int64_t value )
+{
+    char digits[24];
+    size_t position = sizeof(digits);
+    // Work on the unsigned magnitude, so that INT64_MIN is handled as well
+    uint64_t magnitude = value < 0 ? -(uint64_t) value : (uint64_t) value;
+    do {
+        digits[--position] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while ( magnitude != 0 );
+    if ( value < 0 )
+        digits[--position] = '-';
+
+    for ( ; position < sizeof(digits); position++ )
+        output_char ( digits[position] );
+}
+
+static void output_label ( label_t label )
+{
+    const char *name = label_name ( label );
+    if ( name != NULL )
+        output_string ( name );
+    else
+    {
+        output_string ( ".L" );
+        output_int ( label );
+    }
+}
+
+static const char *QUAD_REGISTER_NAMES[] = {
+    "%rax", "%rcx", "%rdx", "%rbx", "%rsp", "%rbp", "%rsi", "%rdi",
+    "%r8", "%r9", "%r10", "%r11", "%r12", "%r13", "%r14", "%r15", "%rip"
+};
+
+static const char *BYTE_REGISTER_NAMES[] = {
+    "%al", "%cl", "%dl", "%bl", "%spl", "%bpl", "%sil", "%dil",
+    "%r8b", "%r9b", "%r10b", "%r11b", "%r12b", "%r13b", "%r14b", "%r15b"
+};
+
+static const char *XMM_REGISTER_NAMES[] = {
+    "%xmm0", "%xmm1", "%xmm2", "%xmm3", "%xmm4", "%xmm5", "%xmm6", "%xmm7",
+    "%xmm8", "%xmm9", "%xmm10", "%xmm11", "%xmm12", "%xmm13", "%xmm14", "%xmm15"
+};
+
+static const char *YMM_REGISTER_NAMES[] = {
+    "%ymm0", "%ymm1", "%ymm2", "%ymm3", "%ymm4", "%ymm5", "%ymm6", "%ymm7",
+    "%ymm8", "%ymm9", "%ymm10", "%ymm11", "%ymm12", "%ymm13", "%ymm14", "%ymm15"
+};
+
+static void output_operand ( operand_t *operand )
+{
+    switch ( operand->type )
+    {
+        case OPERAND_REGISTER:
+            output_string ( operand->size == 1 ? BYTE_REGISTER_NAMES[operand->base]
+                          : operand->size == 16 ? XMM_REGISTER_NAMES[operand->base]
+                          : operand->size == 32 ? YMM_REGISTER_NAMES[operand->base]
+                                                : QUAD_REGISTER_NAMES[operand->base] );
+            break;
+        case OPERAND_IMMEDIATE:
+            output_char ( '$' );
+            output_int ( operand->value );
+            break;
+        case OPERAND_MEMORY:
+            if ( operand->base == REG_RIP )
+            {
+                output_label ( operand->label );
+                if ( operand->value > 0 )
+                    output_char ( '+' );
+            }
+            if ( operand->value != 0 )
+                output_int ( operand->value );
+            output_char ( '(' );
+            output_string ( QUAD_REGISTER_NAMES[operand->base] );
+            if ( operand->scale != 0 )
+            {
+                output_string ( ", " );
+                output_string ( QUAD_REGISTER_NAMES[operand->index] );
+                output_string ( ", " );
+                output_int ( operand->scale );
+            }
+            output_char ( ')' );
+            break;
+        case OPERAND_LABEL:
+            output_label ( operand->label );
+            break;
+        case OPERAND_NONE:
+            assert ( false && "Missing operand" );
+    }
+}
+
+static const char *MNEMONICS[] = {
+    [OP_MOVQ] = "movq", [OP_MOVB] = "movb", [OP_MOVZBQ] = "movzbq", [OP_LEAQ] = "leaq",
+    [OP_PUSHQ] = "pushq", [OP_POPQ] = "popq",
+    [OP_ADDQ] = "addq", [OP_SUBQ] = "subq", [OP_NEGQ] = "negq", [OP_IMULQ] = "imulq", [OP_MULQ] = "mulq",
+    [OP_CQO] = "cqo", [OP_IDIVQ] = "idivq", [OP_ANDQ] = "andq", [OP_SALQ] = "salq",
+    [OP_SARQ] = "sarq", [OP_SHRQ] = "shrq", [OP_CMPQ] = "cmpq", [OP_JMP] = "jmp", [OP_LOOP] = "loop",
+    [OP_CALL] = "call", [OP_RET] = "ret", [OP_SYSCALL] = "syscall", [OP_RDTSC] = "rdtsc",
+    [OP_REP_STOSQ] = "rep stosq", [OP_REP_MOVSQ] = "rep movsq",
+    [OP_PXOR] = "pxor", [OP_MOVDQU] = "movdqu", [OP_MOVDQA] = "movdqa", [OP_PADDQ] = "paddq",
+    [OP_PSUBQ] = "psubq", [OP_PUNPCKLQDQ] = "punpcklqdq", [OP_PUNPCKHQDQ] = "punpckhqdq",
+    [OP_VPBROADCASTQ] = "vpbroadcastq", [OP_VEXTRACTI128] = "vextracti128", [OP_VZEROUPPER] = "vzeroupper"
+};
+
+static const char *CONDITION_SUFFIXES[] = {
+    [COND_O] = "o", [COND_NO] = "no", [COND_E] = "e", [COND_NE] = "ne", [COND_L] = "l", [COND_GE] = "ge", [COND_LE] = "le", [COND_G] = "g"
+};
+
+static const char *SECTION_NAMES[] = {
+    [SECTION_TEXT] = ASM_TEXT_SECTION,
+    [SECTION_RODATA] = ASM_STRING_SECTION,
+    [SECTION_BSS] = ASM_BSS_SECTION
+};
+
+static const char *TEXT_PART_NAMES[] = {
+    [TEXT_PART_NORMAL] = ASM_TEXT_SECTION,
+    [TEXT_PART_HOT] = ASM_HOT_TEXT_SECTION,
+    [TEXT_PART_UNLIKELY] = ASM_UNLIKELY_TEXT_SECTION
+};
+
+static void output_instruction ( instruction_t *instruction )
+{
+    switch ( instruction->opcode )
+    {
+        case OP_LABEL:
+            output_label ( instruction->operands[0].label );
+            output_string ( ":\n" );
+            return;
+        case OP_SECTION:
+            output_string ( ".section " );
+            if ( instruction->operands[0].value == SECTION_TEXT )
+                output_string ( TEXT_PART_NAMES[instruction->operands[1].value] );
+            else
+                output_string ( SECTION_NAMES[instruction->operands[0].value] );
+            output_char ( '\n' );
+            return;
+        case OP_GLOBAL:
+            output_string ( ".global " );
+            output_label ( instruction->operands[0].label );
+            output_char ( '\n' );
+            return;
+        case OP_FUNCTION_END:
+#ifndef __APPLE__ // Mach-O symbols have no type or size
+            output_string ( ".type " );
+            output_label ( instruction->operands[0].label );
+            output_string ( ", @function\n.size " );
+            output_label ( instruction->operands[0].label );
+            output_string ( ", .-" );
+            output_label ( instruction->operands[0].label );
+            output_char ( '\n' );
+#endif
+            return;
+        case OP_ALIGN: {
+            // .align means bytes on some platforms and a power of two on others, but .p2align is the same everywhere
+            int power = 0;
+            while ( ( (int64_t) 1 << power ) < instruction->operands[0].value )
+                power++;
+            output_string ( ".p2align " );
+            output_int ( power );
+            output_char ( '\n' );
+            return;
+        }
+        case OP_ZERO:
+            output_string ( "\t.zero " );
+            output_int ( instruction->operands[0].value );
+            output_char ( '\n' );
+            return;
+        case OP_ASCIZ:
+            output_string ( "\t.asciz " );
+            output_string ( instruction->text );
+            output_char ( '\n' );
+            return;
+        case OP_DIRECTIVE:
+            output_string ( instruction->text );
+            output_char ( '\n' );
+            return;
+        case OP_JCC:
+            output_string ( "\tj" );
+            output_string ( CONDITION_SUFFIXES[instruction->condition] );
+            break;
+        case OP_CMOVQ:
+            output_string ( "\tcmov" );
+            output_string ( CONDITION_SUFFIXES[instruction->condition] );
+            output_char ( 'q' );
+            break;
+        case OP_PXOR: case OP_PADDQ: case OP_PSUBQ:
+            if ( instruction->operands[1].size != 32 )
+            {
+                output_char ( '\t' );
+                output_string ( MNEMONICS[instruction->opcode] );
+                break;
+            }
+            // The AVX2 forms take the destination twice, as the first source
+            output_string ( "\tv" );
+            output_string ( MNEMONICS[instruction->opcode] );
+            output_char ( ' ' );
+            output_operand ( &instruction->operands[0] );
+            output_string ( ", " );
+            output_operand ( &instruction->operands[1] );
+            output_string ( ", " );
+            output_operand ( &instruction->operands[1] );
+            output_char ( '\n' );
+            return;
+        case OP_MOVDQU: case OP_MOVDQA:
+            output_string ( instruction->operands[0].size == 32 || instruction->operands[1].size == 32 ? "\tv" : "\t" );
+            output_string ( MNEMONICS[instruction->opcode] );
+            break;
+        case OP_VEXTRACTI128:
+            // Always the high half
+            output_string ( "\tvextracti128 $1," );
+            break;
+        default:
+            output_char ( '\t' );
+            output_string ( MNEMONICS[instruction->opcode] );
+            break;
+    }
+
+    for ( int i = 0; i < 2 && instruction->operands[i].type != OPERAND_NONE; i++ )
+    {
+        output_string ( i == 0 ? " " : ", " );
+        if ( instruction->opcode == OP_CALL && instruction->operands[i].type == OPERAND_MEMORY )
+            output_char ( '*' );
+        output_operand ( &instruction->operands[i] );
+    }
+    output_char ( '\n' );
+}
+
+void write_instructions ( FILE *output )
+{
+    output_file = output;
+    if ( debug_info )
+    {
+        output_string ( ".file 1 \"" );
+        for ( const char *c = source_name; *c != '\0'; c++ )
+        {
+            if ( *c == '"' || *c == '\\' )
+                output_char ( '\\' );
+            output_char ( *c );
+        }
+        output_string ( "\"\n" );
+    }
+
+    // The line table only needs a new row where the source location changes
+    int line = -1, column = -1;
+    for ( size_t i = 0; i < n_instructions; i++ )
+    {
+        instruction_t *instruction = &instructions[i];
+        if ( debug_info && instruction->opcode < OP_LABEL
+             && ( instruction->line != line || instruction->column != column ) )
+        {
+            line = instruction->line;
+            column = instruction->column;
+            output_string ( "\t.loc 1 " );
+            output_int ( line );
+            output_char ( ' ' );
+            output_int ( column );
+            output_char ( '\n' );
+        }
+        output_instruction ( instruction );
+    }
+    flush_output ( );
+}
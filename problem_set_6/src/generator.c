@@ -1,11 +1,16 @@
 #include "vslc.h"
+#include "callgraph.h"
+#include "profile.h"
 
-// This header defines a bunch of macros we can use to emit assembly to stdout
+#include <inttypes.h>
+#include <stdarg.h>
+
+// This header defines a bunch of macros we can use to build the instruction list
 #include "emit.h"
 
 // In the System V calling convention, the first 6 integer parameters are passed in registers
 #define NUM_REGISTER_PARAMS 6
-static const char *REGISTER_PARAMS[6] = {RDI, RSI, RDX, RCX, R8, R9};
+static const reg_t REGISTER_PARAMS[6] = {REG_RDI, REG_RSI, REG_RDX, REG_RCX, REG_R8, REG_R9};
 
 // Takes in a symbol of type SYMBOL_FUNCTION, and returns how many parameters the function takes
 #define FUNC_PARAM_COUNT(func) ((func)->node->children[1]->n_children)
@@ -15,67 +20,263 @@ static void generate_global_variables ( void );
 static void generate_function ( symbol_t *function );
 static void generate_expression ( node_t *expression );
 static void generate_statement ( node_t *node );
+static void generate_cold_statements ( void );
+static bool is_induction_index ( node_t *index, symbol_t *variable, int64_t *offset );
+static size_t count_array_pointers ( node_t *node );
 static void generate_main ( symbol_t *first );
+static void generate_print_texts ( void );
+static void optimize_function ( size_t start, const char *name );
 
-// Function to generate a unique label
-const char *unique_label() {
-    static int counter = 0; // Static counter to keep track of label uniqueness
-    char *label = (char *)malloc(20* sizeof(char)); // Buffer to hold the label
-    snprintf(label, 20, ".L%d", counter++); // Format the label
-    return label; // Return the generated label
-}
+/* Labels for every global symbol, indexed by sequence number, and for every string in the string list */
+static label_t *global_labels;
+static label_t *string_labels;
+
+/* Labels for the strings, helper functions and library functions used by the generated code */
+static label_t errout_label, main_label, start_label;
+static label_t puts_label, strtol_label, exit_label, write_label;
+
+/* Labels for the output runtime, see generate_output_runtime */
+static label_t print_string_label, print_int_label, print_format_label, flush_output_label;
+static label_t output_buffer_label, output_length_label;
+
+static void create_labels ( void );
+
+/* With -fprofile-generate, the program counts how often every function is called, and how often its blocks
+ * and call sites run, see profile.h. All counters are in one table in .bss. The counters of a function are
+ * its calls, then its blocks, then its call sites, starting at counter_base.
+ */
+typedef struct
+{
+    symbol_t *function;
+    size_t counter_base;
+    size_t n_blocks, n_call_sites;
+} instrumented_function_t;
+
+static bool instrumenting;
+static label_t profile_counters_label;
+static instrumented_function_t *instrumented_functions;
+static size_t n_instrumented_functions, n_profile_counters;
+
+/* With -finstrument, every function keeps a record of its calls and the cycles spent in it, in .bss.
+ * Inclusive cycles count the whole time between entry and exit, only in the outermost of recursive calls,
+ * and exclusive cycles leave out the cycles spent in calls. The records are indexed in the order the
+ * functions are generated, and main prints them at exit. The format points to the function's line of the report.
+ */
+#define TIMING_CALLS 0
+#define TIMING_INCLUSIVE 8
+#define TIMING_EXCLUSIVE 16
+#define TIMING_DEPTH 24 // How many calls to the function have not returned yet
+#define TIMING_FORMAT 32
+#define TIMING_RECORD_SIZE 40
+
+static bool timing;
+// callee_cycles adds up the inclusive cycles of the calls the current function made so far
+static label_t function_times_label, callee_cycles_label;
+static symbol_t **timed_functions;
+static size_t n_timed_functions;
+// In a timed function's frame, the time stamp at entry, and the caller's callee_cycles
+static operand_t entry_cycles_slot, caller_cycles_slot;
+
+// Both the profile and the timing report are printed through the output runtime, to this file descriptor
+static label_t output_fd_label;
+
+/* Where every parameter and local variable of the current function is kept, indexed by sequence number */
+static operand_t *variable_locations;
+
+/* In tiered execution, calls go through the dispatch table entries at these labels, indexed by sequence number */
+static label_t *dispatch_labels;
+
+/* Statements moved out of line by generate_if_statement, as they are unlikely to run.
+ * generate_cold_statements places them after the rest of the function.
+ * Each one is entered by jumping to its label, and never falls through, so it needs no jump back.
+ */
+typedef struct
+{
+    node_t *statement;
+    label_t label;
+    label_t while_end_label; // Where break statements in it jump
+    size_t n_spare_registers; // The spare registers enclosing loops left unused, which it may use
+} cold_statement_t;
+
+static cold_statement_t *cold_statements;
+static size_t n_cold_statements, cold_statements_capacity;
+
+/* A variable that a loop steps by the same amount every iteration, with "i := i + step" as the last
+ * statement of its body, and no other assignment to it. The step is a constant, which may also be
+ * subtracted, or a variable the body never assigns, which is only added.
+ */
+typedef struct
+{
+    node_t *variable;      // An identifier of the variable
+    node_t *increment;     // The last statement of the body
+    node_t *step_variable; // The identifier of the step, or NULL when it is the constant step
+    int64_t step;
+} induction_variable_t;
+
+/* Inside a loop, the elements of an array indexed by the loop's induction variable, plus or minus a constant,
+ * are reached through a pointer register. It is set up before the loop, and moved along every time the
+ * increment runs, so the addresses are never computed from the index.
+ */
+typedef struct
+{
+    symbol_t *array;
+    induction_variable_t induction;
+    reg_t pointer; // Points to array[variable]
+} array_pointer_t;
+
+// Pointers are only kept in registers the current function has to spare, see generate_function
+#define MAX_ARRAY_POINTERS 6
+static array_pointer_t array_pointers[MAX_ARRAY_POINTERS];
+static size_t n_array_pointers;
+// The registers not taken by variables or the pointers of enclosing loops, used like a stack
+static reg_t spare_registers[MAX_ARRAY_POINTERS];
+static size_t n_spare_registers;
 
 /* Entry point for code generation */
 void generate_program ( void )
 {
+    create_labels ( );
     generate_stringtable ( );
     generate_global_variables ( );
 
-    DIRECTIVE ( ".text" );
-    symbol_t *first_function = NULL;
-    for ( size_t i = 0; i < global_symbols->n_symbols; i++ )
+    // Functions that are never called, directly or indirectly, from the first function are left out
+    call_graph_t *call_graph = create_call_graph ( );
+    if ( call_graph->entry == NULL )
     {
-        symbol_t *symbol = global_symbols->symbols[i];
-        if ( symbol->type != SYMBOL_FUNCTION )
-            continue;
-        if ( !first_function )
-            first_function = symbol;
-        generate_function ( symbol );
+        fprintf ( stderr, "error: program contained no functions\n" );
+        exit ( EXIT_FAILURE );
     }
 
-    if ( first_function == NULL )
+    instrumenting = profile_output != NULL;
+    timing = instrument_functions;
+    if ( instrumenting )
+        profile_counters_label = named_label ( "profile_counters" );
+    if ( timing )
     {
-        fprintf ( stderr, "error: program contained no functions\n" );
-        exit ( EXIT_FAILURE );
+        function_times_label = named_label ( "function_times" );
+        callee_cycles_label = named_label ( "callee_cycles" );
+    }
+    if ( instrumenting || timing )
+        output_fd_label = named_label ( "output_fd" );
+
+    // Callers are placed next to the functions they call most, see order_functions
+    SECTION ( SECTION_TEXT );
+    size_t n_functions;
+    symbol_t **functions = order_functions ( call_graph, &n_functions );
+    if ( timing )
+        timed_functions = malloc ( n_functions * sizeof(symbol_t*) );
+    text_part_t part = TEXT_PART_NORMAL;
+    for ( size_t i = 0; i < n_functions; i++ )
+    {
+        text_part_t function_part = function_text_part ( functions[i]->sequence_number );
+        if ( function_part != part )
+            TEXT_SECTION ( function_part );
+        part = function_part;
+        generate_function ( functions[i] );
     }
-    generate_main ( first_function );
+    if ( part != TEXT_PART_NORMAL )
+        TEXT_SECTION ( TEXT_PART_NORMAL );
+
+    if ( instrumenting || timing )
+    {
+        SECTION ( SECTION_BSS );
+        ALIGN ( 8 );
+        if ( instrumenting )
+        {
+            LABEL ( profile_counters_label );
+            ZERO ( n_profile_counters * 8 );
+        }
+        if ( timing )
+        {
+            LABEL ( function_times_label );
+            ZERO ( n_timed_functions * TIMING_RECORD_SIZE );
+            LABEL ( callee_cycles_label );
+            ZERO ( 8 );
+        }
+        LABEL ( output_fd_label );
+        ZERO ( 8 );
+        SECTION ( SECTION_TEXT );
+    }
+
+    generate_main ( call_graph->entry );
+    free ( functions );
+    destroy_call_graph ( call_graph );
+    free ( instrumented_functions );
+    instrumented_functions = NULL;
+    n_instrumented_functions = n_profile_counters = 0;
+    instrumenting = false;
+    free ( timed_functions );
+    timed_functions = NULL;
+    n_timed_functions = 0;
+    timing = false;
+    generate_print_texts ( );
+
+    free ( global_labels );
+    free ( string_labels );
+    free ( variable_locations );
+    variable_locations = NULL;
+    free ( cold_statements );
+    cold_statements = NULL;
+    cold_statements_capacity = 0;
 }
 
+/* Creates labels for all global symbols and strings, as well as the fixed labels used by generate_main */
+static void create_labels ( void )
+{
+    global_labels = malloc ( global_symbols->n_symbols * sizeof(label_t) );
+    for ( size_t i = 0; i < global_symbols->n_symbols; i++ )
+        global_labels[i] = named_label ( ".%s", global_symbols->symbols[i]->name );
+
+    string_labels = malloc ( string_list_len * sizeof(label_t) );
+    for ( size_t i = 0; i < string_list_len; i++ )
+        string_labels[i] = named_label ( "string%zu", i );
+
+    errout_label = named_label ( "errout" );
+    main_label = named_label ( "main" );
+    puts_label = named_label ( "puts" );
+    write_label = named_label ( "write" );
+    // A freestanding program brings its own replacements for the library functions main uses
+    start_label = named_label ( "_start" );
+    strtol_label = named_label ( freestanding ? "parse_int" : "strtol" );
+    exit_label = named_label ( freestanding ? "exit_program" : "exit" );
+
+    print_string_label = named_label ( "print_string" );
+    print_int_label = named_label ( "print_int" );
+    print_format_label = named_label ( "print_format" );
+    flush_output_label = named_label ( "flush_output" );
+    output_buffer_label = named_label ( "output_buffer" );
+    output_length_label = named_label ( "output_length" );
+}
+
+#define SYMBOL_LABEL(symbol) (global_labels[(symbol)->sequence_number])
+
 /* Prints one .asciz entry for each string in the global string_list */
 static void generate_stringtable ( void )
 {
-    DIRECTIVE ( ".section %s", ASM_STRING_SECTION );
-    // These strings are used by printf
-    DIRECTIVE ( "intout: .asciz \"%s\"", "%ld" );
-    DIRECTIVE ( "strout: .asciz \"%s\"", "%s" );
+    SECTION ( SECTION_RODATA );
     // This string is used by the entry point-wrapper
-    DIRECTIVE ( "errout: .asciz \"%s\"", "Wrong number of arguments" );
+    LABEL ( errout_label );
+    ASCIZ ( "\"%s\"", "Wrong number of arguments" );
 
     for ( size_t i = 0; i < string_list_len; i++ )
-        DIRECTIVE ( "string%ld: \t.asciz %s", i, string_list[i] );
+    {
+        LABEL ( string_labels[i] );
+        ASCIZ ( "%s", string_list[i] );
+    }
 }
 
 /* Prints .zero entries in the .bss section to allocate room for global variables and arrays */
 static void generate_global_variables ( void )
 {
-    DIRECTIVE ( ".section %s", ASM_BSS_SECTION );
-    DIRECTIVE ( ".align 8" );
+    SECTION ( SECTION_BSS );
+    ALIGN ( 8 );
     for ( size_t i = 0; i < global_symbols->n_symbols; i++ )
     {
         symbol_t *symbol = global_symbols->symbols[i];
         if ( symbol->type == SYMBOL_GLOBAL_VAR )
         {
-            DIRECTIVE ( ".%s: \t.zero 8", symbol->name );
+            LABEL ( SYMBOL_LABEL(symbol) );
+            ZERO ( 8 );
         }
         else if ( symbol->type == SYMBOL_GLOBAL_ARRAY )
         {
@@ -85,7 +286,8 @@ static void generate_global_variables ( void )
                 exit ( EXIT_FAILURE );
             }
             int64_t length = *(int64_t*) symbol->node->children[1]->data;
-            DIRECTIVE ( ".%s: \t.zero %ld", symbol->name, length*8 );
+            LABEL ( SYMBOL_LABEL(symbol) );
+            ZERO ( length*8 );
         }
     }
 }
@@ -93,32 +295,639 @@ static void generate_global_variables ( void )
 /* Global variable used to make the functon currently being generated accessible from anywhere */
 static symbol_t *current_function;
 
+/* The blocks and call sites of the current function, when it is instrumented or has a profile */
+static profile_points_t profile_points;
+/* What -fprofile-use counted for the current function, or NULL */
+static const function_profile_t *function_profile;
+
+/* The number of bytes the stack has grown by since %rbp was set up, which is 16-byte aligned.
+ * Every call is made with a 16-byte aligned stack, as the calling convention requires,
+ * so the code generator pads the stack wherever this would not be a multiple of 16.
+ */
+static size_t stack_depth;
+
+// The largest stack_depth reached, for measuring how much a leaf function pushes
+static size_t max_stack_depth;
+
+static void push_stack ( operand_t source )
+{
+    PUSHQ ( source );
+    stack_depth += 8;
+    if ( stack_depth > max_stack_depth )
+        max_stack_depth = stack_depth;
+}
+
+static void pop_stack ( operand_t destination )
+{
+    POPQ ( destination );
+    stack_depth -= 8;
+}
+
+/* Grows the stack by the given number of bytes, which must be a multiple of 8 */
+static void grow_stack ( size_t bytes )
+{
+    if ( bytes == 0 )
+        return;
+    SUBQ ( IMMEDIATE(bytes), RSP );
+    stack_depth += bytes;
+    if ( stack_depth > max_stack_depth )
+        max_stack_depth = stack_depth;
+}
+
+static void shrink_stack ( size_t bytes )
+{
+    if ( bytes == 0 )
+        return;
+    ADDQ ( IMMEDIATE(bytes), RSP );
+    stack_depth -= bytes;
+}
+
+// The padding needed for the stack to be 16-byte aligned once it has grown by another extra bytes
+#define ALIGNMENT_PADDING(extra) ( ( stack_depth + (extra) ) % 16 )
+
+/* Finds the local variables that may be read before anything is written to them, which must start out as 0.
+ * written tells which variables are certainly written at this point, and is updated by the statement.
+ * Every time a loop body runs, at least the variables written before the loop are written,
+ * so looking at each loop body once is enough.
+ */
+static void find_reads_before_writes ( node_t *node, bool *written, bool *read_first )
+{
+    size_t n_variables = current_function->function_symtable->n_symbols;
+    switch ( node->type )
+    {
+        case IDENTIFIER_DATA:
+            if ( node->symbol->type == SYMBOL_LOCAL_VAR && !written[node->symbol->sequence_number] )
+                read_first[node->symbol->sequence_number] = true;
+            break;
+        case BLOCK:
+            // Skips the declarations
+            find_reads_before_writes ( node->children[node->n_children-1], written, read_first );
+            break;
+        case ASSIGNMENT_STATEMENT: {
+            node_t *destination = node->children[0];
+            find_reads_before_writes ( node->children[1], written, read_first );
+            if ( destination->type == ARRAY_INDEXING )
+                find_reads_before_writes ( destination->children[1], written, read_first );
+            else if ( destination->symbol->type == SYMBOL_LOCAL_VAR )
+                written[destination->symbol->sequence_number] = true;
+            break;
+        }
+        case IF_STATEMENT: {
+            find_reads_before_writes ( node->children[0], written, read_first );
+            bool *written_then = malloc ( n_variables * sizeof(bool) );
+            memcpy ( written_then, written, n_variables * sizeof(bool) );
+            find_reads_before_writes ( node->children[1], written_then, read_first );
+            if ( node->n_children == 3 )
+            {
+                // Only what both branches write is certainly written afterwards
+                find_reads_before_writes ( node->children[2], written, read_first );
+                for ( size_t i = 0; i < n_variables; i++ )
+                    written[i] = written[i] && written_then[i];
+            }
+            free ( written_then );
+            break;
+        }
+        case WHILE_STATEMENT: {
+            // The body might never run
+            find_reads_before_writes ( node->children[0], written, read_first );
+            bool *written_body = malloc ( n_variables * sizeof(bool) );
+            memcpy ( written_body, written, n_variables * sizeof(bool) );
+            find_reads_before_writes ( node->children[1], written_body, read_first );
+            free ( written_body );
+            break;
+        }
+        default:
+            for ( size_t i = 0; i < node->n_children; i++ )
+                find_reads_before_writes ( node->children[i], written, read_first );
+            break;
+    }
+}
+
+// Frames needing at least this many zeroed slots are cleared with 16-byte vector stores
+#define VECTOR_ZEROING_THRESHOLD 4
+
+/* Gives a slot to every local variable declared in the block and the blocks nested in it, starting at next_slot.
+ * Variables in sibling blocks are never alive at the same time, so they share slots.
+ * Blocks are visited in the order symbols.c declared their variables, with next_symbol counting them.
+ * Variables that may be read before they are written keep the slot they already have,
+ * since they must still hold 0, or their value from the last time the block ran.
+ */
+static void assign_block_slots ( node_t *node, size_t *next_symbol, size_t next_slot, size_t *n_slots,
+                                 bool *read_first )
+{
+    if ( node->type == BLOCK && node->n_children == 2 )
+    {
+        node_t *declarations = node->children[0];
+        for ( size_t i = 0; i < declarations->n_children; i++ )
+            for ( size_t j = 0; j < declarations->children[i]->n_children; j++ )
+            {
+                symbol_t *symbol = current_function->function_symtable->symbols[(*next_symbol)++];
+                assert ( symbol->node == declarations->children[i]->children[j] );
+                if ( read_first[symbol->sequence_number] )
+                    continue;
+                next_slot++;
+                variable_locations[symbol->sequence_number] = MEM_OFFSET ( -(int64_t) next_slot * 8, RBP );
+            }
+        if ( next_slot > *n_slots )
+            *n_slots = next_slot;
+    }
+
+    for ( size_t i = 0; i < node->n_children; i++ )
+        assign_block_slots ( node->children[i], next_symbol, next_slot, n_slots, read_first );
+}
+
+/* Places the parameters passed in registers, and then the local variables, in 8-byte slots below %rbp.
+ * Parameters passed on the stack stay where the caller put them, starting at 16(%rbp).
+ * Locals that may be read before they are written get consecutive slots of their own, right after the parameters.
+ */
+static void layout_frame ( symbol_t *function, bool *read_first )
+{
+    symbol_table_t *symbols = function->function_symtable;
+    variable_locations = realloc ( variable_locations, symbols->n_symbols * sizeof(operand_t) );
+
+    size_t n_slots = 0, n_parameters = 0;
+    for ( size_t i = 0; i < symbols->n_symbols; i++ )
+    {
+        symbol_t *symbol = symbols->symbols[i];
+        if ( symbol->type == SYMBOL_PARAMETER )
+        {
+            n_parameters++;
+            if ( symbol->sequence_number >= NUM_REGISTER_PARAMS )
+                variable_locations[i] = MEM_OFFSET ( 16 + (symbol->sequence_number - NUM_REGISTER_PARAMS) * 8, RBP );
+            else
+                variable_locations[i] = MEM_OFFSET ( -(int64_t) ++n_slots * 8, RBP );
+        }
+        else if ( read_first[i] )
+            variable_locations[i] = MEM_OFFSET ( -(int64_t) ++n_slots * 8, RBP );
+    }
+
+    size_t next_symbol = n_parameters;
+    assign_block_slots ( function->node->children[2], &next_symbol, n_slots, &n_slots, read_first );
+    assert ( next_symbol == symbols->n_symbols );
+}
+
+/* Writes 0 to the local variables of the current function that may be read before they are written */
+static void generate_frame_zeroing ( bool *read_first )
+{
+    size_t n_variables = current_function->function_symtable->n_symbols;
+    size_t n_zeroed = 0;
+    for ( size_t i = 0; i < n_variables; i++ )
+        n_zeroed += read_first[i];
+
+    bool vector = n_zeroed >= VECTOR_ZEROING_THRESHOLD;
+    if ( vector )
+        PXOR ( XMM0, XMM0 );
+    for ( size_t i = 0; i < n_variables; i++ )
+    {
+        if ( !read_first[i] )
+            continue;
+        // These locals have consecutive slots, growing downwards, so two neighbours are cleared together
+        size_t next = i + 1;
+        while ( next < n_variables && !read_first[next] )
+            next++;
+        if ( vector && next < n_variables && variable_locations[i].type == OPERAND_MEMORY
+             && variable_locations[next].type == OPERAND_MEMORY
+             && variable_locations[next].value == variable_locations[i].value - 8 )
+        {
+            MOVDQU ( XMM0, variable_locations[next] );
+            i = next;
+        }
+        else
+            MOVQ ( IMMEDIATE(0), variable_locations[i] );
+    }
+}
+
+/* Returns the number of slots below %rbp that layout_frame used for the current function */
+static size_t count_frame_slots ( void )
+{
+    size_t n_slots = 0;
+    for ( size_t i = 0; i < current_function->function_symtable->n_symbols; i++ )
+        if ( variable_locations[i].value < 0 && (size_t) -variable_locations[i].value / 8 > n_slots )
+            n_slots = -variable_locations[i].value / 8;
+    return n_slots;
+}
+
+/* Set while generating a function without a frame, see place_leaf_slots */
+static bool leaf_function;
+
+// The size of the area below %rsp that signal handlers leave alone, which leaf functions can use without a frame
+#define RED_ZONE_SIZE 128
+
+// Leaf functions keep their first slots in these registers, which expressions never use.
+// They are the parameter registers, except that %rdx and %rcx are needed for dividing, shifting and indexing
+#define NUM_LEAF_REGISTERS 6
+static const reg_t LEAF_REGISTERS[NUM_LEAF_REGISTERS] = {REG_RDI, REG_RSI, REG_R10, REG_R11, REG_R8, REG_R9};
+
+/* Returns true if the statement makes no calls, including the ones print statements make */
+static bool is_leaf ( node_t *node )
+{
+    if ( node->type == FUNCTION_CALL || node->type == PRINT_STATEMENT )
+        return false;
+    for ( size_t i = 0; i < node->n_children; i++ )
+        if ( !is_leaf ( node->children[i] ) )
+            return false;
+    return true;
+}
+
+/* Returns the most bytes the statement pushes to the stack at once, by generating it and throwing the code away */
+static size_t measure_stack_usage ( node_t *statement )
+{
+    size_t start = n_instructions;
+    stack_depth = max_stack_depth = 0;
+    generate_statement ( statement );
+    generate_cold_statements ( );
+    truncate_instructions ( start );
+    return max_stack_depth;
+}
+
+/* Moves the slots layout_frame gave the current function out of its frame, so that it needs none.
+ * The first slots go in registers, and the rest in the red zone, below the pushed bytes expressions may need.
+ * Parameters passed on the stack are found above the return address instead.
+ * These locations are relative to %rsp at the function's entry, and generate_variable_access adjusts them.
+ * Returns false without changing anything if the slots do not fit.
+ */
+static bool place_leaf_slots ( size_t pushed )
+{
+    size_t n_variables = current_function->function_symtable->n_symbols;
+    size_t n_slots = count_frame_slots ( );
+    size_t spilled = n_slots > NUM_LEAF_REGISTERS ? n_slots - NUM_LEAF_REGISTERS : 0;
+    if ( pushed + spilled * 8 > RED_ZONE_SIZE )
+        return false;
+
+    for ( size_t i = 0; i < n_variables; i++ )
+    {
+        operand_t *location = &variable_locations[i];
+        if ( location->value > 0 )
+        {
+            // Without the saved %rbp, only the return address is in between
+            *location = MEM_OFFSET ( location->value - 8, RSP );
+            continue;
+        }
+        size_t slot = -location->value / 8;
+        if ( slot <= NUM_LEAF_REGISTERS )
+            *location = REGISTER ( LEAF_REGISTERS[slot-1] );
+        else
+            *location = MEM_OFFSET ( -(int64_t) ( pushed + ( slot - NUM_LEAF_REGISTERS ) * 8 ), RSP );
+    }
+
+    // The registers no slot got are free for array pointers
+    for ( size_t i = n_slots; i < NUM_LEAF_REGISTERS; i++ )
+        spare_registers[n_spare_registers++] = LEAF_REGISTERS[i];
+    return true;
+}
+
+// Slots used less than this, weighted by loop depth, are not worth saving and restoring a register for
+#define CALLEE_SAVED_MIN_WEIGHT 3
+// Every level of loop nesting makes a use count this many times more, up to MAX_WEIGHTED_LOOP_DEPTH levels
+#define LOOP_WEIGHT 8
+#define MAX_WEIGHTED_LOOP_DEPTH 6
+
+// Functions with a frame keep their most used slots in these registers, which calls leave alone
+#define NUM_CALLEE_SAVED 5
+static const reg_t CALLEE_SAVED[NUM_CALLEE_SAVED] = {REG_RBX, REG_R12, REG_R13, REG_R14, REG_R15};
+static const char *CALLEE_SAVED_NAMES[NUM_CALLEE_SAVED] = {"%rbx", "%r12", "%r13", "%r14", "%r15"};
+
+/* The callee-saved registers the current function uses, and the slots their old values are kept in */
+static size_t n_saved_registers;
+static operand_t saved_register_slots[NUM_CALLEE_SAVED];
+
+/* Adds up how often the statement uses each variable, counting uses inside loops as more frequent */
+static void weigh_variable_uses ( node_t *node, size_t loop_depth, size_t *weights )
+{
+    switch ( node->type )
+    {
+        case IDENTIFIER_DATA: {
+            symbol_t *symbol = node->symbol;
+            if ( symbol->type == SYMBOL_LOCAL_VAR || symbol->type == SYMBOL_PARAMETER )
+            {
+                size_t weight = 1;
+                for ( size_t i = 0; i < loop_depth && i < MAX_WEIGHTED_LOOP_DEPTH; i++ )
+                    weight *= LOOP_WEIGHT;
+                weights[symbol->sequence_number] += weight;
+            }
+            break;
+        }
+        case BLOCK:
+            // Skips the declarations
+            weigh_variable_uses ( node->children[node->n_children-1], loop_depth, weights );
+            break;
+        case WHILE_STATEMENT:
+            weigh_variable_uses ( node->children[0], loop_depth + 1, weights );
+            weigh_variable_uses ( node->children[1], loop_depth + 1, weights );
+            break;
+        default:
+            for ( size_t i = 0; i < node->n_children; i++ )
+                weigh_variable_uses ( node->children[i], loop_depth, weights );
+            break;
+    }
+}
+
+/* Moves the most used slots layout_frame gave the current function to callee-saved registers.
+ * Variables sharing a slot share the register. Up to n_pointers of the registers left over become
+ * spare registers for array pointers. The slots left in the frame are packed together,
+ * and followed by the slots the callee-saved registers are saved in.
+ * Returns the new size of the frame, which is a multiple of 16.
+ */
+static size_t place_callee_saved ( size_t n_pointers )
+{
+    symbol_table_t *symbols = current_function->function_symtable;
+    size_t n_slots = count_frame_slots ( );
+
+    size_t *weights = calloc ( symbols->n_symbols, sizeof(size_t) );
+    weigh_variable_uses ( current_function->node->children[2], 0, weights );
+    size_t *slot_weights = calloc ( n_slots + 1, sizeof(size_t) );
+    for ( size_t i = 0; i < symbols->n_symbols; i++ )
+        if ( variable_locations[i].value < 0 )
+            slot_weights[-variable_locations[i].value / 8] += weights[i];
+
+    // Indexed by slot, the register the slot gets, or the slot it moves to when it stays in the frame
+    operand_t *new_slots = malloc ( ( n_slots + 1 ) * sizeof(operand_t) );
+    bool *in_register = calloc ( n_slots + 1, sizeof(bool) );
+    n_saved_registers = 0;
+    while ( n_saved_registers < NUM_CALLEE_SAVED )
+    {
+        size_t best = 0;
+        for ( size_t slot = 1; slot <= n_slots; slot++ )
+            if ( !in_register[slot] && slot_weights[slot] >= CALLEE_SAVED_MIN_WEIGHT
+                 && ( best == 0 || slot_weights[slot] > slot_weights[best] ) )
+                best = slot;
+        if ( best == 0 )
+            break;
+        in_register[best] = true;
+        new_slots[best] = REGISTER ( CALLEE_SAVED[n_saved_registers++] );
+    }
+    while ( n_spare_registers < n_pointers && n_saved_registers < NUM_CALLEE_SAVED )
+        spare_registers[n_spare_registers++] = CALLEE_SAVED[n_saved_registers++];
+
+    size_t n_frame_slots = 0;
+    for ( size_t slot = 1; slot <= n_slots; slot++ )
+        if ( !in_register[slot] )
+            new_slots[slot] = MEM_OFFSET ( -(int64_t) ++n_frame_slots * 8, RBP );
+    for ( size_t i = 0; i < n_saved_registers; i++ )
+        saved_register_slots[i] = MEM_OFFSET ( -(int64_t) ++n_frame_slots * 8, RBP );
+    if ( timing )
+    {
+        entry_cycles_slot = MEM_OFFSET ( -(int64_t) ++n_frame_slots * 8, RBP );
+        caller_cycles_slot = MEM_OFFSET ( -(int64_t) ++n_frame_slots * 8, RBP );
+    }
+
+    for ( size_t i = 0; i < symbols->n_symbols; i++ )
+        if ( variable_locations[i].value < 0 )
+            variable_locations[i] = new_slots[-variable_locations[i].value / 8];
+
+    free ( weights );
+    free ( slot_weights );
+    free ( new_slots );
+    free ( in_register );
+    return ( n_frame_slots * 8 + 15 ) / 16 * 16;
+}
+
+/* Returns an operand for a field of the current function's timing record */
+static operand_t timing_field ( size_t field )
+{
+    operand_t location = RIP_LABEL ( function_times_label );
+    location.value = ( n_timed_functions - 1 ) * TIMING_RECORD_SIZE + field;
+    return location;
+}
+
+/* Reads the time stamp counter into %rax, clobbering %rdx */
+static void generate_read_cycles ( void )
+{
+    RDTSC;
+    SAL ( IMMEDIATE(32), RDX );
+    ADDQ ( RDX, RAX );
+}
+
+/* Counts a call to the current function, and starts timing it. %rax, %rcx and %rdx are free */
+static void generate_timing_entry ( void )
+{
+    ADDQ ( IMMEDIATE(1), timing_field ( TIMING_CALLS ) );
+    ADDQ ( IMMEDIATE(1), timing_field ( TIMING_DEPTH ) );
+    MOVQ ( RIP_LABEL(callee_cycles_label), RAX );
+    MOVQ ( RAX, caller_cycles_slot );
+    MOVQ ( IMMEDIATE(0), RIP_LABEL(callee_cycles_label) );
+    generate_read_cycles ( );
+    MOVQ ( RAX, entry_cycles_slot );
+}
+
+/* Adds the cycles since generate_timing_entry to the current function's record, and to the cycles
+ * its caller spent in calls. The return value in %rax is kept in %rsi meanwhile.
+ */
+static void generate_timing_exit ( void )
+{
+    label_t recursive_label = new_label ( );
+    MOVQ ( RAX, RSI );
+    generate_read_cycles ( );
+    SUBQ ( entry_cycles_slot, RAX );
+    MOVQ ( RAX, RCX );
+    SUBQ ( RIP_LABEL(callee_cycles_label), RCX );
+    ADDQ ( RCX, timing_field ( TIMING_EXCLUSIVE ) );
+    // The outermost call already counts the time of the recursive calls it made
+    SUBQ ( IMMEDIATE(1), timing_field ( TIMING_DEPTH ) );
+    JNE ( recursive_label );
+    ADDQ ( RAX, timing_field ( TIMING_INCLUSIVE ) );
+    LABEL ( recursive_label );
+    ADDQ ( caller_cycles_slot, RAX );
+    MOVQ ( RAX, RIP_LABEL(callee_cycles_label) );
+    MOVQ ( RSI, RAX );
+}
+
+/* Sets up the frame of the current function, with %rbp pointing to the saved %rbp */
+static void generate_frame_setup ( void )
+{
+    PUSHQ ( RBP );
+    if ( debug_info )
+    {
+        DIRECTIVE ( "\t.cfi_def_cfa_offset 16" );
+        DIRECTIVE ( "\t.cfi_offset %%rbp, -16" );
+    }
+    MOVQ ( RSP, RBP );
+    if ( debug_info )
+        DIRECTIVE ( "\t.cfi_def_cfa_register %%rbp" );
+}
+
+/* Returns from the current function, with the return value already in %rax */
+static void generate_function_exit ( void )
+{
+    if ( leaf_function )
+    {
+        assert ( stack_depth == 0 );
+        RET;
+        return;
+    }
+    if ( timing )
+        generate_timing_exit ( );
+    // The code after the return still runs in the frame
+    if ( debug_info )
+        DIRECTIVE ( "\t.cfi_remember_state" );
+    for ( size_t i = 0; i < n_saved_registers; i++ )
+        MOVQ ( saved_register_slots[i], REGISTER(CALLEE_SAVED[i]) );
+    // leaveq is written out manually, to increase clarity of what happens
+    MOVQ ( RBP, RSP );
+    POPQ ( RBP );
+    if ( debug_info )
+        DIRECTIVE ( "\t.cfi_def_cfa %%rsp, 8" );
+    RET;
+    if ( debug_info )
+        DIRECTIVE ( "\t.cfi_restore_state" );
+}
+
+/* Finds the blocks and call sites of the function, if it is instrumented or has a profile,
+ * and gives an instrumented function its counters */
+static void start_function_profile ( symbol_t *function )
+{
+    function_profile = NULL;
+    if ( profile != NULL && profile->functions[function->sequence_number].present )
+        function_profile = &profile->functions[function->sequence_number];
+    if ( !instrumenting && function_profile == NULL )
+        return;
+    find_profile_points ( function, &profile_points );
+    if ( !instrumenting )
+        return;
+
+    instrumented_functions = realloc ( instrumented_functions,
+                                       ( n_instrumented_functions + 1 ) * sizeof(instrumented_function_t) );
+    instrumented_functions[n_instrumented_functions++] = (instrumented_function_t) {
+        .function = function,
+        .counter_base = n_profile_counters,
+        .n_blocks = profile_points.n_blocks,
+        .n_call_sites = profile_points.n_call_sites
+    };
+    n_profile_counters += 1 + profile_points.n_blocks + profile_points.n_call_sites;
+}
+
+static void end_function_profile ( void )
+{
+    destroy_profile_points ( &profile_points );
+    function_profile = NULL;
+}
+
+/* Adds one to a counter of the current function, which only changes the flags */
+static void generate_counter_increment ( size_t counter )
+{
+    operand_t location = RIP_LABEL ( profile_counters_label );
+    location.value = ( instrumented_functions[n_instrumented_functions - 1].counter_base + counter ) * 8;
+    ADDQ ( IMMEDIATE(1), location );
+}
+
+/* In an instrumented function, counts a run of the block at node, if there is one */
+static void count_block ( node_t *node )
+{
+    if ( !instrumenting )
+        return;
+    size_t block = find_profile_point ( profile_points.blocks, profile_points.n_blocks, node );
+    if ( block != SIZE_MAX )
+        generate_counter_increment ( 1 + block );
+}
+
+static void count_call ( node_t *call )
+{
+    if ( !instrumenting )
+        return;
+    size_t site = find_profile_point ( profile_points.call_sites, profile_points.n_call_sites, call );
+    generate_counter_increment ( 1 + profile_points.n_blocks + site );
+}
+
+/* Finds how many times the profile saw the block at node run. Returns false if it has no count for it */
+static bool profiled_block_count ( node_t *node, uint64_t *count )
+{
+    if ( function_profile == NULL )
+        return false;
+    size_t block = find_profile_point ( profile_points.blocks, profile_points.n_blocks, node );
+    if ( block == SIZE_MAX )
+        return false;
+    *count = block < function_profile->n_blocks ? function_profile->blocks[block] : 0;
+    return true;
+}
+
 /* Prints the entry point. preamble, statements and epilouge of the given function */
 static void generate_function ( symbol_t *function )
 {
-    LABEL( ".%s", function->name );
+    size_t start = n_instructions;
+    LABEL ( SYMBOL_LABEL(function) );
+    if ( debug_info )
+        DIRECTIVE ( "\t.cfi_startproc" );
     current_function = function;
+    start_function_profile ( function );
+    // The code that is not part of any statement is marked as the function's
+    source_line = function->node->line;
+    source_column = function->node->column;
+    if ( timing )
+        timed_functions[n_timed_functions++] = function;
+
+    size_t n_variables = function->function_symtable->n_symbols;
+    bool *written = calloc ( n_variables, sizeof(bool) );
+    bool *read_first = calloc ( n_variables, sizeof(bool) );
+    find_reads_before_writes ( function->node->children[2], written, read_first );
+    layout_frame ( function, read_first );
+
+    // Functions that make no calls need no frame, if their variables fit in registers and the red zone
+    // While it is measured, a leaf function has no spare registers, so any statement that saves the ones it
+    // borrows does so, and the most stack is counted
+    n_saved_registers = 0;
+    n_spare_registers = 0;
+    n_array_pointers = 0;
+    // Timed functions keep their entry time in the frame
+    leaf_function = !timing && is_leaf ( function->node->children[2] );
+    if ( leaf_function )
+    {
+        // The call frame information of a function without a frame could not follow what expressions push
+        size_t pushed = measure_stack_usage ( function->node->children[2] );
+        leaf_function = ( !debug_info || pushed == 0 ) && place_leaf_slots ( pushed );
+    }
 
-    PUSHQ ( RBP );
-    MOVQ ( RSP, RBP );
+    stack_depth = 0;
+    if ( !leaf_function )
+    {
+        generate_frame_setup ( );
+        // The whole frame is allocated at once, and it keeps the stack aligned between statements
+        grow_stack ( place_callee_saved ( count_array_pointers ( function->node->children[2] ) ) );
+        for ( size_t i = 0; i < n_saved_registers; i++ )
+        {
+            MOVQ ( REGISTER(CALLEE_SAVED[i]), saved_register_slots[i] );
+            // The canonical frame address is 16 bytes above %rbp
+            if ( debug_info )
+                DIRECTIVE ( "\t.cfi_offset %s, %" PRId64, CALLEE_SAVED_NAMES[i], saved_register_slots[i].value - 16 );
+        }
+    }
 
-    // Up to 6 prameters have been passed in registers. Place them on the stack instead
+    // Up to 6 prameters have been passed in registers. Move them to their slots
     for ( size_t i = 0; i < FUNC_PARAM_COUNT(function) && i < NUM_REGISTER_PARAMS; i++ )
-        PUSHQ ( REGISTER_PARAMS[i] );
+        MOVQ ( REGISTER(REGISTER_PARAMS[i]), variable_locations[i] );
 
-    // Now, for each local variable, push 8-byte 0 values to the stack
-    for ( size_t i = 0; i < function->function_symtable->n_symbols; i++ )
-        if ( function->function_symtable->symbols[i]->type == SYMBOL_LOCAL_VAR )
-            PUSHQ("$0");
+    // Local variables start out as 0, but only the ones read before they are written need it
+    generate_frame_zeroing ( read_first );
+    free ( written );
+    free ( read_first );
+
+    if ( instrumenting )
+        generate_counter_increment ( 0 );
+    if ( timing )
+        generate_timing_entry ( );
 
     generate_statement( function->node->children[2] );
 
     // In case the function didn't return, return 0 here
-    MOVQ ( "$0", RAX );
-    // leaveq is written out manually, to increase clarity of what happens
-    MOVQ ( RBP, RSP );
-    POPQ ( RBP );
-    RET;
+    MOVQ ( IMMEDIATE(0), RAX );
+    generate_function_exit ( );
+
+    // The unlikely statements come last, so that the likely path through the function is one straight line
+    generate_cold_statements ( );
+    end_function_profile ( );
+
+    optimize_function ( start, function->name );
+    if ( debug_info )
+        DIRECTIVE ( "\t.cfi_endproc" );
+    FUNCTION_END ( SYMBOL_LABEL(function) );
+    source_line = source_column = 0;
+}
+
+/* Runs the peephole optimizer on the function starting at instructions[start] */
+static void optimize_function ( size_t start, const char *name )
+{
+    size_t removed = peephole_optimize ( start );
+    if ( print_peephole_statistics )
+        fprintf ( stderr, "peephole: removed %zu instructions from '%s'\n", removed, name );
 }
 
 static void generate_function_call ( node_t *call )
@@ -139,59 +948,50 @@ static void generate_function_call ( node_t *call )
         exit(EXIT_FAILURE);
     }
 
+    // The parameters passed on the stack end up right below the padding, which aligns the call
+    size_t stack_parameters = parameter_count > NUM_REGISTER_PARAMS ? parameter_count - NUM_REGISTER_PARAMS : 0;
+    size_t padding = ALIGNMENT_PADDING ( stack_parameters * 8 );
+    grow_stack ( padding );
+
     // We evaluate all parameters from right to left, pushing them to the stack
     for ( int i = parameter_count-1; i >= 0; i-- ) {
         generate_expression( argument_list->children[i] );
-        PUSHQ ( RAX );
+        push_stack ( RAX );
     }
 
     // Up to 6 parameters should be passed through registers instead. Pop them off the stack
     for ( size_t i = 0; i < parameter_count && i < NUM_REGISTER_PARAMS; i++ )
-        POPQ ( REGISTER_PARAMS[i] );
+        pop_stack ( REGISTER(REGISTER_PARAMS[i]) );
+    assert ( stack_depth % 16 == 0 );
 
-    EMIT ( "call .%s", symbol->name );
+    count_call ( call );
+    if ( dispatch_labels != NULL )
+        CALL_INDIRECT ( RIP_LABEL(dispatch_labels[symbol->sequence_number]) );
+    else
+        CALL ( SYMBOL_LABEL(symbol) );
 
-    // Now pop away any stack passed parameters still left on the stack, by moving %rsp upwards
-    if ( parameter_count > NUM_REGISTER_PARAMS )
-        EMIT ( "addq $%d, %s", (parameter_count-NUM_REGISTER_PARAMS)*8, RSP );
+    // Now pop away any stack passed parameters still left on the stack, and the padding, by moving %rsp upwards
+    shrink_stack ( stack_parameters * 8 + padding );
 }
 
-/* Returns a string for accessing the quadword referenced by node */
-static const char* generate_variable_access ( node_t* node )
+/* Returns an operand for accessing the quadword referenced by node */
+static operand_t generate_variable_access ( node_t* node )
 {
-    static char result[100];
-
     assert ( node->type == IDENTIFIER_DATA );
 
     symbol_t *symbol = node->symbol;
     switch ( symbol->type )
     {
         case SYMBOL_GLOBAL_VAR:
-            snprintf ( result, sizeof(result), ".%s(%s)", symbol->name, RIP );
-            return result;
-        case SYMBOL_LOCAL_VAR: {
-            // If we have more than 6 parameters, subtract away the hole in the sequence numbers
-            int call_frame_offset = symbol->sequence_number;
-            if ( FUNC_PARAM_COUNT(current_function) > NUM_REGISTER_PARAMS )
-                call_frame_offset -= FUNC_PARAM_COUNT(current_function) - NUM_REGISTER_PARAMS;
-            // The stack grows down, in multiples of 8, and sequence number 0 corresponds to -8
-            call_frame_offset = (-call_frame_offset - 1) * 8;
-
-            snprintf ( result, sizeof(result), "%d(%s)", call_frame_offset, RBP );
-            return result;
-        }
-        case SYMBOL_PARAMETER: {
-            int call_frame_offset;
-            // Handle the first 6 parameters differently
-            if (symbol->sequence_number < NUM_REGISTER_PARAMS)
-                // Move along down the stack, with parameter 0 at position -8(%rbp)
-                call_frame_offset = (-symbol->sequence_number - 1) * 8;
-            else
-                // Parameter 6 is at 16(%rbp), with further parameters moving up from there
-                call_frame_offset = 16 + (symbol->sequence_number - NUM_REGISTER_PARAMS) * 8;
-
-            snprintf ( result, sizeof(result), "%d(%s)", call_frame_offset, RBP );
-            return result;
+            return RIP_LABEL ( SYMBOL_LABEL(symbol) );
+        case SYMBOL_LOCAL_VAR:
+        case SYMBOL_PARAMETER:
+        {
+            // Laid out by layout_frame. Without a frame, they are relative to %rsp, which moves as values are pushed
+            operand_t location = variable_locations[symbol->sequence_number];
+            if ( location.type == OPERAND_MEMORY && location.base == REG_RSP )
+                location.value += stack_depth;
+            return location;
         }
         case SYMBOL_FUNCTION:
             fprintf ( stderr, "error: symbol '%s' is a function, not a variable\n", symbol->name );
@@ -206,9 +1006,9 @@ static const char* generate_variable_access ( node_t* node )
 /* Takes in an ARRAY_INDEXING node, such as array[x]
  * The function emits code to evaluate x, which may clobber all registers.
  * Once x is evaluated, the address of array[x] is calculated, and stored in the RCX register.
- * The return value is the string "(%rcx)", the assembly for using RCX as an address.
+ * The return value is the operand "(%rcx)", for using RCX as an address.
  */
-static const char* generate_array_access ( node_t* node ) {
+static operand_t generate_array_access ( node_t* node ) {
     assert ( node->type == ARRAY_INDEXING );
 
     symbol_t *symbol = node->children[0]->symbol;
@@ -217,14 +1017,23 @@ static const char* generate_array_access ( node_t* node ) {
         exit (EXIT_FAILURE);
     }
 
+    // Inside loops, the element may already have a pointer to it
+    for ( size_t i = 0; i < n_array_pointers; i++ )
+    {
+        int64_t offset;
+        if ( array_pointers[i].array == symbol
+             && is_induction_index ( node->children[1], array_pointers[i].induction.variable->symbol, &offset ) )
+            return MEM_OFFSET ( offset * 8, REGISTER(array_pointers[i].pointer) );
+    }
+
     // Calculate the index of the array into %rax
     generate_expression ( node->children[1] );
 
     // Place the base of the array into %rcx
-    EMIT ( "leaq .%s(%s), %s", symbol->name, RIP, RCX );
+    LEAQ ( RIP_LABEL(SYMBOL_LABEL(symbol)), RCX );
 
     // Place the exact position of the element we wish to access, into %rcx
-    EMIT ( "leaq (%s, %s, 8), %s", RCX, RAX, RCX );
+    LEAQ ( ARRAY_MEM(RCX, RAX, 8), RCX );
 
     // Now, the address of the element is stored at %rcx, so just use MEM() to reference it
     return MEM(RCX);
@@ -237,7 +1046,7 @@ static void generate_expression ( node_t *expression )
     {
         case NUMBER_DATA:
             // Simply place the number into %rax
-            EMIT ( "movq $%ld, %s", *(int64_t*)expression->data, RAX );
+            MOVQ ( IMMEDIATE(*(int64_t*)expression->data), RAX );
             break;
         case IDENTIFIER_DATA:
             // Load the variable, and put the result in RAX
@@ -252,9 +1061,9 @@ static void generate_expression ( node_t *expression )
             if ( strcmp ( data, "+" ) == 0 )
             {
                 generate_expression ( expression->children[0] );
-                PUSHQ ( RAX );
+                push_stack ( RAX );
                 generate_expression ( expression->children[1] );
-                POPQ ( RCX );
+                pop_stack ( RCX );
                 ADDQ ( RCX, RAX );
             }
             else if ( strcmp ( data, "-" ) == 0)
@@ -268,9 +1077,9 @@ static void generate_expression ( node_t *expression )
                 {
                     // Binary minus. Evaluate RHS first, to get the result in RAX easier
                     generate_expression ( expression->children[1] );
-                    PUSHQ ( RAX );
+                    push_stack ( RAX );
                     generate_expression ( expression->children[0] );
-                    POPQ ( RCX );
+                    pop_stack ( RCX );
                     SUBQ ( RCX, RAX );
                 }
             }
@@ -278,36 +1087,36 @@ static void generate_expression ( node_t *expression )
             {
                 // Multiplication does not need to do sign extend
                 generate_expression ( expression->children[0] );
-                PUSHQ ( RAX );
+                push_stack ( RAX );
                 generate_expression ( expression->children[1] );
-                POPQ ( RCX );
+                pop_stack ( RCX );
                 IMULQ ( RCX, RAX );
             }
             else if ( strcmp ( data, "/" ) == 0 )
             {
                 generate_expression ( expression->children[1] );
-                PUSHQ ( RAX );
+                push_stack ( RAX );
                 generate_expression ( expression->children[0] );
                 CQO; // Sign extend RAX -> RDX:RAX
-                POPQ ( RCX );
+                pop_stack ( RCX );
                 IDIVQ ( RCX ); // Didivde RDX:RAX by RCX, placing the result in RAX
             }
             else if ( strcmp ( data, "<<" ) == 0 )
             {
                 // Evaluate the shift amount first, and push it to stack
                 generate_expression ( expression->children[1] );
-                PUSHQ ( RAX );
+                push_stack ( RAX );
                 generate_expression ( expression->children[0] );
-                POPQ ( RCX ); // Pop the shift amount
+                pop_stack ( RCX ); // Pop the shift amount
                 SAL ( CL, RAX ); // RAX = RAX<<CL
             }
             else if ( strcmp ( data, ">>" ) == 0 )
             {
                 // Evaluate the shift amount first, and push it to stack
                 generate_expression ( expression->children[1] );
-                PUSHQ ( RAX );
+                push_stack ( RAX );
                 generate_expression ( expression->children[0] );
-                POPQ ( RCX ); // Pop the shift amount
+                pop_stack ( RCX ); // Pop the shift amount
                 SAR ( CL, RAX ); // RAX = RAX>>CL
             }
             else assert ( false && "Unknown expression operation" );
@@ -334,67 +1143,384 @@ static void generate_assignment_statement ( node_t *statement )
     else {
         // Store rax until the final address of the array element is found,
         // since array index calculation can potentially modify all registers
-        PUSHQ ( RAX );
-        const char* dest_mem = generate_array_access( dest );
-        POPQ ( RAX );
+        push_stack ( RAX );
+        operand_t dest_mem = generate_array_access( dest );
+        pop_stack ( RAX );
         MOVQ ( RAX, dest_mem );
     }
-}
 
-static void generate_print_statement ( node_t *statement )
-{
-    node_t *print_items = statement->children[0];
-    for ( size_t i = 0; i < print_items->n_children; i++ )
+    // Array pointers move along with their induction variable
+    for ( size_t i = 0; i < n_array_pointers; i++ )
     {
-        node_t *item = print_items->children[i];
-        if ( item->type == STRING_LIST_REFERENCE )
+        array_pointer_t *pointer = &array_pointers[i];
+        if ( pointer->induction.increment != statement )
+            continue;
+        if ( pointer->induction.step_variable != NULL )
         {
-            EMIT ( "leaq strout(%s), %s", RIP, RDI );
-            EMIT ( "leaq string%zu(%s), %s", (size_t) item->data, RIP, RSI );
+            MOVQ ( generate_variable_access ( pointer->induction.step_variable ), RAX );
+            LEAQ ( ARRAY_MEM(REGISTER(pointer->pointer), RAX, 8), REGISTER(pointer->pointer) );
         }
         else
-        {
-            generate_expression ( item );
-            MOVQ ( RAX, RSI );
-            EMIT ( "leaq intout(%s), %s", RIP, RDI );
-        }
-        EMIT ( "call safe_printf" );
+            ADDQ ( IMMEDIATE(pointer->induction.step * 8), REGISTER(pointer->pointer) );
     }
-
-    MOVQ ( "$'\\n'", RDI );
-    EMIT ( "call putchar" );
 }
 
-static void generate_return_statement ( node_t *statement )
+/* Text for print statements, built at compile time. Every entry is placed in .rodata at the end of generation */
+typedef struct
 {
-    generate_expression ( statement->children[0] );
-    MOVQ ( RBP, RSP );
-    POPQ ( RBP );
-    RET;
+    char *text;  // The contents of a string literal, without the quotes
+    label_t label;
+} print_text_t;
+
+static print_text_t *print_texts;
+static size_t n_print_texts;
+
+// The number of integers print_format takes, in the argument registers after the format itself
+#define PRINT_FORMAT_ARGUMENTS ( NUM_REGISTER_PARAMS - 1 )
+
+/* Appends printf-style formatted text to an owned string, which may be NULL */
+static void append_text ( char **text, const char *format, ... )
+{
+    va_list args, args_copy;
+    va_start ( args, format );
+    va_copy ( args_copy, args );
+    size_t old_length = *text == NULL ? 0 : strlen ( *text );
+    int length = vsnprintf ( NULL, 0, format, args );
+    *text = realloc ( *text, old_length + length + 1 );
+    vsnprintf ( *text + old_length, length + 1, format, args_copy );
+    va_end ( args_copy );
+    va_end ( args );
 }
 
-static void generate_relation ( node_t *relation )
+/* Returns the label of a string literal with the given contents, reusing an identical one if possible */
+static label_t print_text_label ( const char *text )
 {
-    // TODO (2.1):
-    // Generate code for evaluating the relation's LHS and RHS, and compare them.
-    // Remember that AT&T's cmp instruction is a bit "backwards" in terms of LHS and RHS.
+    for ( size_t i = 0; i < n_print_texts; i++ )
+        if ( strcmp ( print_texts[i].text, text ) == 0 )
+            return print_texts[i].label;
+
+    print_texts = realloc ( print_texts, ( n_print_texts + 1 ) * sizeof(print_text_t) );
+    print_texts[n_print_texts].text = strdup ( text );
+    print_texts[n_print_texts].label = named_label ( "format%zu", n_print_texts );
+    return print_texts[n_print_texts++].label;
+}
+
+static void generate_print_texts ( void )
+{
+    SECTION ( SECTION_RODATA );
+    for ( size_t i = 0; i < n_print_texts; i++ )
+    {
+        LABEL ( print_texts[i].label );
+        ASCIZ ( "\"%s\"", print_texts[i].text );
+        free ( print_texts[i].text );
+    }
+    free ( print_texts );
+    print_texts = NULL;
+    n_print_texts = 0;
+}
+
+static bool contains_function_call ( node_t *node )
+{
+    if ( node->type == FUNCTION_CALL )
+        return true;
+    for ( size_t i = 0; i < node->n_children; i++ )
+        if ( contains_function_call ( node->children[i] ) )
+            return true;
+    return false;
+}
+
+/* Emits a single call printing the text pieces, with the values pushed to the stack in between them.
+ * Without any values, the text is printed as is, otherwise it becomes the format string of print_format.
+ * Frees the pieces.
+ */
+static void generate_print_call ( char **pieces, size_t n_values )
+{
+    if ( n_values == 0 )
+    {
+        assert ( stack_depth % 16 == 0 );
+        LEAQ ( RIP_LABEL(print_text_label ( pieces[0] )), RDI );
+        CALL ( print_string_label );
+        free ( pieces[0] );
+        pieces[0] = NULL;
+        return;
+    }
+
+    char *format = NULL;
+    for ( size_t i = 0; i <= n_values; i++ )
+    {
+        if ( i > 0 )
+            append_text ( &format, "%%ld" );
+        // Percent signs are doubled, also when they were escaped by a backslash
+        for ( char *c = pieces[i]; c != NULL && *c != '\0'; c++ )
+        {
+            if ( c[0] == '\\' && c[1] == '%' )
+                c++;
+            if ( c[0] == '%' )
+                append_text ( &format, "%%%%" );
+            else if ( c[0] == '\\' )
+                append_text ( &format, "%c%c", c[0], c[1] ), c++;
+            else
+                append_text ( &format, "%c", c[0] );
+        }
+        free ( pieces[i] );
+        pieces[i] = NULL;
+    }
+
+    // The last value pushed is the last argument
+    for ( size_t i = n_values; i > 0; i-- )
+        pop_stack ( REGISTER(REGISTER_PARAMS[i]) );
+    assert ( stack_depth % 16 == 0 );
+    LEAQ ( RIP_LABEL(print_text_label ( format )), RDI );
+    CALL ( print_format_label );
+    free ( format );
+}
+
+/* All items of a print statement, and the newline, are printed by one call, with a format string built
+ * at compile time. Strings and numbers are folded into the format, so the values of expressions are all
+ * that is left to pass. Since an expression calling a function could print on its own, the text before it
+ * is printed first. Statements with many expressions are split into several calls.
+ */
+static void generate_print_statement ( node_t *statement )
+{
+    node_t *print_items = statement->children[0];
+    char *pieces[PRINT_FORMAT_ARGUMENTS + 1] = { NULL };
+    size_t n_values = 0;
+
+    for ( size_t i = 0; i < print_items->n_children; i++ )
+    {
+        node_t *item = print_items->children[i];
+        if ( item->type == STRING_LIST_REFERENCE )
+        {
+            const char *literal = string_list[(size_t) item->data];
+            // Without the quotes
+            append_text ( &pieces[n_values], "%.*s", (int) strlen ( literal ) - 2, literal + 1 );
+        }
+        else if ( item->type == NUMBER_DATA )
+            append_text ( &pieces[n_values], "%" PRId64, *(int64_t*) item->data );
+        else
+        {
+            if ( contains_function_call ( item ) && ( n_values > 0 || pieces[0] != NULL ) )
+            {
+                generate_print_call ( pieces, n_values );
+                n_values = 0;
+            }
+            if ( n_values == PRINT_FORMAT_ARGUMENTS )
+            {
+                generate_print_call ( pieces, n_values );
+                n_values = 0;
+            }
+            generate_expression ( item );
+            push_stack ( RAX );
+            n_values++;
+        }
+    }
+
+    append_text ( &pieces[n_values], "\\n" );
+    generate_print_call ( pieces, n_values );
+}
+
+static void generate_return_statement ( node_t *statement )
+{
+    generate_expression ( statement->children[0] );
+    generate_function_exit ( );
+}
+
+/* Emits code comparing the LHS and RHS of the relation.
+ * Returns the condition under which the relation holds, for use with JCC.
+ */
+static condition_t generate_relation ( node_t *relation )
+{
+    // TODO (2.1):
+    // Generate code for evaluating the relation's LHS and RHS, and compare them.
+    // Remember that AT&T's cmp instruction is a bit "backwards" in terms of LHS and RHS.
 
     // Remember that conditional jumps have different suffixes for
     // signed inequalities and unsigned inequalities. Use the signed variety
 
+    generate_expression ( relation->children[0] );
+    push_stack ( RAX );
+    generate_expression ( relation->children[1] );
+    pop_stack ( RCX );
+
+    // Sets the flags based on LHS - RHS
+    CMPQ ( RAX, RCX );
+
+    const char *type = relation->data;
+    if ( strcmp ( type, "=" ) == 0 )
+        return COND_E;
+    if ( strcmp ( type, "!=" ) == 0 )
+        return COND_NE;
+    if ( strcmp ( type, "<" ) == 0 )
+        return COND_L;
+    if ( strcmp ( type, "<=" ) == 0 )
+        return COND_LE;
+    if ( strcmp ( type, ">" ) == 0 )
+        return COND_G;
+    if ( strcmp ( type, ">=" ) == 0 )
+        return COND_GE;
+    assert ( false && "Unknown relation type" );
+}
 
-    generate_expression(relation->children[0]);
+/* The end label of the innermost while loop being generated, which is where break statements jump */
+static label_t innermost_while_end_label;
 
-    PUSHQ(RAX);
+// Loop headers are aligned to this many bytes, so that short loops fit in as few fetch blocks as possible
+#define LOOP_ALIGNMENT 16
 
-    generate_expression(relation->children[1]);
+/* Returns a label for jumping to the statement, once generate_cold_statements has placed it */
+static label_t defer_cold_statement ( node_t *statement )
+{
+    if ( n_cold_statements >= cold_statements_capacity )
+    {
+        cold_statements_capacity = cold_statements_capacity * 2 + 8;
+        cold_statements = realloc ( cold_statements, cold_statements_capacity * sizeof(cold_statement_t) );
+    }
+    label_t label = new_label ( );
+    cold_statements[n_cold_statements++] = (cold_statement_t) {
+        .statement = statement,
+        .label = label,
+        .while_end_label = innermost_while_end_label,
+        .n_spare_registers = n_spare_registers
+    };
+    return label;
+}
 
-    POPQ(RCX);
+/* Generates the statements deferred while generating the current function, including the ones they defer */
+static void generate_cold_statements ( void )
+{
+    for ( size_t i = 0; i < n_cold_statements; i++ )
+    {
+        cold_statement_t cold = cold_statements[i];
+        innermost_while_end_label = cold.while_end_label;
+        // The pointers of the loops it was in are still in use, but out of reach
+        n_spare_registers = cold.n_spare_registers;
+        n_array_pointers = 0;
+        LABEL ( cold.label );
+        generate_statement ( cold.statement );
+    }
+    n_cold_statements = 0;
+}
 
-    CMPQ(RCX, RAX);
+/* Returns true if the statement never continues with what follows it, since it ends by returning or breaking */
+static bool leaves_block ( node_t *statement )
+{
+    switch ( statement->type )
+    {
+        case RETURN_STATEMENT:
+        case BREAK_STATEMENT:
+            return true;
+        case BLOCK: {
+            node_t *statement_list = statement->children[statement->n_children-1];
+            return statement_list->n_children > 0
+                && leaves_block ( statement_list->children[statement_list->n_children-1] );
+        }
+        case IF_STATEMENT:
+            return statement->n_children > 2
+                && leaves_block ( statement->children[1] ) && leaves_block ( statement->children[2] );
+        default:
+            return false;
+    }
+}
 
+/* Returns true if the statement does nothing but break out of the innermost loop */
+static bool is_break ( node_t *statement )
+{
+    if ( statement->type == BLOCK )
+    {
+        node_t *statement_list = statement->children[statement->n_children-1];
+        return statement_list->n_children == 1 && is_break ( statement_list->children[0] );
+    }
+    return statement->type == BREAK_STATEMENT;
+}
+
+// Values with more nodes than this are not worth evaluating when they might not be used
+#define MAX_SPECULATED_NODES 7
+
+// A branch that goes one way at least this many times as often as the other is predicted well enough
+// to be cheaper than a conditional move
+#define PREDICTABLE_RATIO 20
+
+/* Returns true if the expression may be evaluated even when its value ends up unused, since it is cheap,
+ * has no side effects, and can not fault. Array elements are left out, since the index may only be valid
+ * when the value is used. budget is the number of nodes the expression may have, and is used up.
+ */
+static bool is_speculatable ( node_t *expression, size_t *budget )
+{
+    if ( *budget == 0 )
+        return false;
+    (*budget)--;
+    switch ( expression->type )
+    {
+        case NUMBER_DATA:
+        case IDENTIFIER_DATA:
+            return true;
+        case EXPRESSION:
+            // Dividing by zero faults
+            if ( strcmp ( expression->data, "/" ) == 0 )
+                return false;
+            for ( size_t i = 0; i < expression->n_children; i++ )
+                if ( !is_speculatable ( expression->children[i], budget ) )
+                    return false;
+            return true;
+        default:
+            return false;
+    }
 }
 
+/* Returns the statement if it is an assignment to a variable, also when it is alone in a block, or NULL */
+static node_t* single_variable_assignment ( node_t *statement )
+{
+    if ( statement->type == BLOCK && statement->n_children == 1 && statement->children[0]->n_children == 1 )
+        return single_variable_assignment ( statement->children[0]->children[0] );
+    if ( statement->type == ASSIGNMENT_STATEMENT && statement->children[0]->type == IDENTIFIER_DATA )
+        return statement;
+    return NULL;
+}
+
+/* Generates an if statement that only chooses which value to assign to a variable as a conditional move.
+ * Without an else branch, the other value is what the variable already holds.
+ * Returns false without generating anything if the statement does not qualify.
+ */
+static bool generate_conditional_move ( node_t *statement )
+{
+    node_t *then_assignment = single_variable_assignment ( statement->children[1] );
+    node_t *else_assignment = NULL;
+    if ( then_assignment == NULL )
+        return false;
+    if ( statement->n_children > 2 )
+    {
+        else_assignment = single_variable_assignment ( statement->children[2] );
+        if ( else_assignment == NULL || else_assignment->children[0]->symbol != then_assignment->children[0]->symbol )
+            return false;
+    }
+
+    // Both values are evaluated before the relation, which must not change what they read
+    size_t budget = MAX_SPECULATED_NODES;
+    if ( !is_speculatable ( then_assignment->children[1], &budget ) )
+        return false;
+    budget = MAX_SPECULATED_NODES;
+    if ( else_assignment != NULL && !is_speculatable ( else_assignment->children[1], &budget ) )
+        return false;
+    if ( contains_function_call ( statement->children[0] ) )
+        return false;
+
+    node_t *destination = then_assignment->children[0];
+    generate_expression ( then_assignment->children[1] );
+    push_stack ( RAX );
+    if ( else_assignment != NULL )
+        generate_expression ( else_assignment->children[1] );
+    else
+        MOVQ ( generate_variable_access ( destination ), RAX );
+    push_stack ( RAX );
+
+    // Popping leaves the flags of the comparison alone
+    condition_t condition = generate_relation ( statement->children[0] );
+    pop_stack ( RAX );
+    pop_stack ( RCX );
+    CMOVQ ( condition, RCX, RAX );
+    MOVQ ( RAX, generate_variable_access ( destination ) );
+    return true;
+}
 
 static void generate_if_statement ( node_t *statement )
 {
@@ -406,105 +1532,1093 @@ static void generate_if_statement ( node_t *statement )
 
     // You will need to define your own unique labels for this if statement,
     // so consider using a global variable as a counter to give each label a unique suffix.
-    generate_relation(statement->children[0]);
-    
-    const char *then_label = unique_label();
-    const char *else_label = unique_label();
-    const char *endif_label = unique_label();
 
-    node_t *relation = statement->children[0];
+    node_t *then_statement = statement->children[1];
+    node_t *else_statement = statement->n_children > 2 ? statement->children[2] : NULL;
+
+    // A profile counts how often each branch ran. Without an else statement, skipping the then statement
+    // is counted at the relation
+    uint64_t then_count = 0, else_count = 0;
+    bool profiled = profiled_block_count ( then_statement, &then_count )
+        && profiled_block_count ( else_statement != NULL ? else_statement : statement->children[0], &else_count )
+        && then_count + else_count > 0;
+    uint64_t rarer_count = then_count < else_count ? then_count : else_count;
+    bool predictable = profiled && rarer_count * PREDICTABLE_RATIO <= then_count + else_count - rarer_count;
+
+    // Choosing between two values is done without jumping, since unpredictable jumps are expensive.
+    // An instrumented program has to run the branch to count it
+    if ( !instrumenting && !predictable && generate_conditional_move ( statement ) )
+        return;
 
-    const char *jmp_instruction;
+    condition_t condition = generate_relation ( statement->children[0] );
 
-    if (strcmp(relation->data, "=") == 0) {
-        jmp_instruction = "jne";
-    } else if (strcmp(relation->data, "!=") == 0) {
-        jmp_instruction = "je";
+    // A branch that only breaks becomes a jump straight out of the loop
+    if ( !instrumenting && is_break ( then_statement ) )
+    {
+        JCC ( condition, innermost_while_end_label );
+        if ( else_statement != NULL )
+            generate_statement ( else_statement );
+        return;
     }
-    else if (strcmp(relation->data, ">=") == 0) {
-        jmp_instruction = "jg";
+    if ( !instrumenting && else_statement != NULL && is_break ( else_statement ) )
+    {
+        JCC ( NEGATE_CONDITION(condition), innermost_while_end_label );
+        generate_statement ( then_statement );
+        return;
     }
-    else if (strcmp(relation->data, ">") == 0) {
-        jmp_instruction = "jge";
+
+    // A branch that returns or breaks is assumed to be the unlikely one, like the base case of a recursion,
+    // or the exit from a loop, unless the profile says otherwise.
+    // It is moved out of line, so the likely branch falls through without a jump
+    bool then_leaves = leaves_block ( then_statement );
+    bool else_leaves = else_statement != NULL && leaves_block ( else_statement );
+    if ( then_leaves && !else_leaves && ( !profiled || then_count < else_count ) )
+    {
+        JCC ( condition, defer_cold_statement ( then_statement ) );
+        if ( else_statement != NULL )
+            generate_statement ( else_statement );
+        else
+            count_block ( statement->children[0] );
+        return;
     }
-    else if (strcmp(relation->data, "<=") == 0) {
-        jmp_instruction = "jl";
+    if ( else_leaves && !then_leaves && ( !profiled || else_count < then_count ) )
+    {
+        JCC ( NEGATE_CONDITION(condition), defer_cold_statement ( else_statement ) );
+        generate_statement ( then_statement );
+        return;
     }
-    else if (strcmp(relation->data, "<") == 0) {
-        jmp_instruction = "jle";
+
+    // The branch the profile saw run most falls through
+    if ( profiled && else_statement != NULL && else_count > then_count )
+    {
+        label_t then_label = new_label ( );
+        label_t endif_label = new_label ( );
+        JCC ( condition, then_label );
+        generate_statement ( else_statement );
+        JMP ( endif_label );
+        LABEL ( then_label );
+        generate_statement ( then_statement );
+        LABEL ( endif_label );
+        return;
     }
 
-    EMIT("%s %s", jmp_instruction, else_label);
+    label_t else_label = new_label ( );
 
-    LABEL("%s", then_label);
-    generate_statement(statement->children[1]);
-    JMP(endif_label);
+    // Skip the then-block when the relation does not hold
+    JCC ( NEGATE_CONDITION(condition), else_label );
 
+    generate_statement ( then_statement );
 
-    LABEL("%s", else_label);
-    if (statement->n_children > 2)
+    // Without an else-block, there is nothing to jump past
+    if ( else_statement != NULL )
+    {
+        label_t endif_label = new_label ( );
+        JMP ( endif_label );
+        LABEL ( else_label );
+        generate_statement ( else_statement );
+        LABEL ( endif_label );
+    }
+    else if ( instrumenting )
     {
-        generate_statement(statement->children[2]);
+        // Skipping the then statement is counted on a path of its own
+        label_t endif_label = new_label ( );
+        JMP ( endif_label );
+        LABEL ( else_label );
+        count_block ( statement->children[0] );
+        LABEL ( endif_label );
     }
+    else
+        LABEL ( else_label );
+}
 
-    LABEL("%s", endif_label);
+// Counted loops are unrolled as many times as fit in this many nodes, but at most MAX_UNROLL times
+#define UNROLL_NODE_BUDGET 48
+#define MAX_UNROLL 4
+// Counted loops with a known number of iterations are replaced by copies of their body,
+// as long as the copies have at most this many nodes in total
+#define FULL_UNROLL_NODE_BUDGET 64
 
-    free((void *)then_label);
-    free((void *)else_label);
-    free((void *)endif_label);
+/* A while loop of the form "while i < bound do begin ... i := i + step end", with a constant step,
+ * where the bound reads no variable the body assigns. The relation can also be <=, or > and >= when the step
+ * is negative. When asked for, the step can also be a variable, which the loop is then assumed to count up by.
+ */
+typedef struct
+{
+    induction_variable_t induction;
+    node_t *bound;
+    condition_t condition; // When the loop keeps going
+} counted_loop_t;
+
+static size_t count_nodes ( node_t *node )
+{
+    size_t count = 1;
+    for ( size_t i = 0; i < node->n_children; i++ )
+        count += count_nodes ( node->children[i] );
+    return count;
 }
 
-static const char *innermost_while_end_label = NULL;
+/* Returns true if the statement assigns to the variable anywhere, or calls a function that might,
+ * leaving out the assignment skip, if it is not NULL
+ */
+static bool assigns_variable ( node_t *node, symbol_t *variable, node_t *skip )
+{
+    if ( node == skip )
+        return false;
+    if ( node->type == ASSIGNMENT_STATEMENT && node->children[0]->type == IDENTIFIER_DATA
+         && node->children[0]->symbol == variable )
+        return true;
+    if ( node->type == FUNCTION_CALL && variable->type == SYMBOL_GLOBAL_VAR )
+        return true;
+    for ( size_t i = 0; i < node->n_children; i++ )
+        if ( assigns_variable ( node->children[i], variable, skip ) )
+            return true;
+    return false;
+}
 
-static void generate_while_statement ( node_t *statement )
+/* Returns true if the expression is made of numbers and variables the body never changes */
+static bool is_loop_invariant ( node_t *expression, node_t *body )
 {
-    // TODO (2.2):
-    // Implement while loops, similarily to the way if statements were generated.
-    // Remember to make label names unique, and to handle nested while loops.
+    switch ( expression->type )
+    {
+        case NUMBER_DATA:
+            return true;
+        case IDENTIFIER_DATA:
+            return !assigns_variable ( body, expression->symbol, NULL );
+        case EXPRESSION:
+            for ( size_t i = 0; i < expression->n_children; i++ )
+                if ( !is_loop_invariant ( expression->children[i], body ) )
+                    return false;
+            return true;
+        default:
+            return false;
+    }
+}
 
-    const char *while_start_label = unique_label();
-    const char *while_end_label = unique_label();
+// Constant steps are multiplied by the unroll factor and the element size, and then used as 32-bit immediates
+#define MAX_CONSTANT_STEP ( INT32_MAX / 8 / MAX_UNROLL )
 
-    const char *previous_innermost_while_end_label = innermost_while_end_label;
+/* Recognizes the induction variable of a while loop. Returns false if it has none */
+static bool find_induction_variable ( node_t *statement, induction_variable_t *induction )
+{
+    node_t *body = statement->children[1];
+    if ( body->type != BLOCK )
+        return false;
+    node_t *statement_list = body->children[body->n_children-1];
+    if ( statement_list->n_children == 0 )
+        return false;
+    node_t *increment = statement_list->children[statement_list->n_children-1];
+    if ( increment->type != ASSIGNMENT_STATEMENT || increment->children[0]->type != IDENTIFIER_DATA )
+        return false;
+    symbol_t *variable = increment->children[0]->symbol;
+    if ( variable->type != SYMBOL_LOCAL_VAR && variable->type != SYMBOL_PARAMETER )
+        return false;
+
+    node_t *value = increment->children[1];
+    if ( value->type != EXPRESSION || value->n_children != 2 )
+        return false;
+    node_t *lhs = value->children[0], *rhs = value->children[1];
+    const char *operator = value->data;
+    if ( strcmp ( operator, "+" ) == 0 && ( lhs->type != IDENTIFIER_DATA || lhs->symbol != variable ) )
+    {
+        // step + i is the same as i + step
+        node_t *swap = lhs;
+        lhs = rhs;
+        rhs = swap;
+    }
+    if ( lhs->type != IDENTIFIER_DATA || lhs->symbol != variable )
+        return false;
+
+    induction->step_variable = NULL;
+    induction->step = 0;
+    if ( rhs->type == NUMBER_DATA && strcmp ( operator, "+" ) == 0 )
+        induction->step = *(int64_t*) rhs->data;
+    else if ( rhs->type == NUMBER_DATA && strcmp ( operator, "-" ) == 0 )
+        induction->step = -*(int64_t*) rhs->data;
+    else if ( rhs->type == IDENTIFIER_DATA && strcmp ( operator, "+" ) == 0 && rhs->symbol != variable
+              && ( rhs->symbol->type == SYMBOL_LOCAL_VAR || rhs->symbol->type == SYMBOL_PARAMETER
+                   || rhs->symbol->type == SYMBOL_GLOBAL_VAR )
+              && is_loop_invariant ( rhs, body ) )
+        induction->step_variable = rhs;
+    else
+        return false;
+    if ( induction->step_variable == NULL
+         && ( induction->step == 0 || induction->step > MAX_CONSTANT_STEP || induction->step < -MAX_CONSTANT_STEP ) )
+        return false;
+
+    induction->variable = increment->children[0];
+    induction->increment = increment;
+    return !assigns_variable ( body, variable, increment );
+}
 
-    innermost_while_end_label = while_end_label;
+/* Recognizes a counted loop, allowing a variable step if variable_step is set. Returns false if the loop is not one */
+static bool find_counted_loop ( node_t *statement, counted_loop_t *loop, bool variable_step )
+{
+    node_t *relation = statement->children[0];
+    if ( !find_induction_variable ( statement, &loop->induction )
+         || ( loop->induction.step_variable != NULL && !variable_step ) )
+        return false;
+    node_t *tested = relation->children[0];
+    if ( tested->type != IDENTIFIER_DATA || tested->symbol != loop->induction.variable->symbol )
+        return false;
+
+    // A variable step is taken to be positive
+    int64_t step = loop->induction.step_variable != NULL ? 1 : loop->induction.step;
+    const char *type = relation->data;
+    if ( strcmp ( type, "<" ) == 0 && step > 0 )
+        loop->condition = COND_L;
+    else if ( strcmp ( type, "<=" ) == 0 && step > 0 )
+        loop->condition = COND_LE;
+    else if ( strcmp ( type, ">" ) == 0 && step < 0 )
+        loop->condition = COND_G;
+    else if ( strcmp ( type, ">=" ) == 0 && step < 0 )
+        loop->condition = COND_GE;
+    else
+        return false;
+
+    loop->bound = relation->children[1];
+    return is_loop_invariant ( loop->bound, statement->children[1] );
+}
 
-    LABEL("%s", while_start_label);
+/* Compares the induction variable with the bound of the loop, like generate_relation.
+ * Returns the condition under which the loop keeps going.
+ */
+static condition_t generate_counted_loop_test ( counted_loop_t *loop )
+{
+    generate_expression ( loop->bound );
+    MOVQ ( generate_variable_access ( loop->induction.variable ), RCX );
+    CMPQ ( RAX, RCX );
+    return loop->condition;
+}
 
-    generate_relation(statement->children[0]);
+/* Tests whether the induction variable plus offset, the value it has in the last of the iterations an unrolled
+ * loop runs at once, still passes the test of the loop. It is compared with the bound minus offset,
+ * since the variable plus offset may overflow where the loop itself never does.
+ * When the bound minus offset overflows, no value of the variable passes, and this jumps to overflow_label.
+ * Returns the condition under which the unrolled loop keeps going.
+ */
+static condition_t generate_unrolled_loop_test ( counted_loop_t *loop, int64_t offset, label_t overflow_label )
+{
+    generate_expression ( loop->bound );
+    SUBQ ( IMMEDIATE(offset), RAX );
+    JCC ( COND_O, overflow_label );
+    MOVQ ( generate_variable_access ( loop->induction.variable ), RCX );
+    CMPQ ( RAX, RCX );
+    return loop->condition;
+}
 
-    const char *jmp_instruction;
+/* Returns true if the index is the induction variable plus or minus a constant, and stores the constant in offset */
+static bool is_induction_index ( node_t *index, symbol_t *variable, int64_t *offset )
+{
+    if ( index->type == IDENTIFIER_DATA && index->symbol == variable )
+    {
+        *offset = 0;
+        return true;
+    }
+    if ( index->type != EXPRESSION || index->n_children != 2 )
+        return false;
+    node_t *lhs = index->children[0], *rhs = index->children[1];
+    const char *operator = index->data;
+    if ( strcmp ( operator, "+" ) == 0 && lhs->type == NUMBER_DATA )
+    {
+        node_t *swap = lhs;
+        lhs = rhs;
+        rhs = swap;
+    }
+    if ( lhs->type != IDENTIFIER_DATA || lhs->symbol != variable || rhs->type != NUMBER_DATA )
+        return false;
+
+    // The offset becomes a 32-bit displacement in bytes
+    int64_t constant = *(int64_t*) rhs->data;
+    if ( constant > INT32_MAX / 8 || constant < -( INT32_MAX / 8 ) )
+        return false;
+    if ( strcmp ( operator, "+" ) == 0 )
+        *offset = constant;
+    else if ( strcmp ( operator, "-" ) == 0 )
+        *offset = -constant;
+    else
+        return false;
+    return true;
+}
 
-        if (strcmp(statement->children[0]->data, "=") == 0) {
-            jmp_instruction = "jne";
-        } else if (strcmp(statement->children[0]->data, "!=") == 0) {
-            jmp_instruction = "je";
-        }
-        else if (strcmp(statement->children[0]->data, ">=") == 0) {
-            jmp_instruction = "jg";
-        }
-        else if (strcmp(statement->children[0]->data, ">") == 0) {
-            jmp_instruction = "jge";
+/* Adds the global arrays the statement indexes by the induction variable to arrays, if they are not there yet */
+static void find_induction_arrays ( node_t *node, symbol_t *variable, symbol_t **arrays, size_t *n_arrays )
+{
+    int64_t offset;
+    if ( node->type == ARRAY_INDEXING && node->children[0]->symbol->type == SYMBOL_GLOBAL_ARRAY
+         && is_induction_index ( node->children[1], variable, &offset ) )
+    {
+        symbol_t *array = node->children[0]->symbol;
+        bool found = false;
+        for ( size_t i = 0; i < *n_arrays; i++ )
+            found = found || arrays[i] == array;
+        if ( !found && *n_arrays < MAX_ARRAY_POINTERS )
+            arrays[(*n_arrays)++] = array;
+    }
+    for ( size_t i = 0; i < node->n_children; i++ )
+        find_induction_arrays ( node->children[i], variable, arrays, n_arrays );
+}
+
+/* Returns how many array pointers the statement could use at once, with its loops nested in each other */
+static size_t count_array_pointers ( node_t *node )
+{
+    size_t most = 0;
+    for ( size_t i = 0; i < node->n_children; i++ )
+    {
+        size_t count = count_array_pointers ( node->children[i] );
+        if ( count > most )
+            most = count;
+    }
+
+    induction_variable_t induction;
+    if ( node->type == WHILE_STATEMENT && find_induction_variable ( node, &induction ) )
+    {
+        symbol_t *arrays[MAX_ARRAY_POINTERS];
+        size_t n_arrays = 0;
+        find_induction_arrays ( node->children[1], induction.variable->symbol, arrays, &n_arrays );
+        most += n_arrays;
+    }
+    return most < MAX_ARRAY_POINTERS ? most : MAX_ARRAY_POINTERS;
+}
+
+/* Points spare registers to the elements the loop's induction variable indexes, as long as there are any.
+ * Returns how many pointers it made, which release_array_pointers must be given after the loop.
+ */
+static size_t generate_array_pointers ( node_t *statement, induction_variable_t *induction )
+{
+    symbol_t *arrays[MAX_ARRAY_POINTERS];
+    size_t n_arrays = 0;
+    find_induction_arrays ( statement->children[1], induction->variable->symbol, arrays, &n_arrays );
+
+    size_t n_pointers = 0;
+    for ( ; n_pointers < n_arrays && n_spare_registers > 0; n_pointers++ )
+    {
+        operand_t pointer = REGISTER ( spare_registers[--n_spare_registers] );
+        MOVQ ( generate_variable_access ( induction->variable ), RAX );
+        LEAQ ( RIP_LABEL(SYMBOL_LABEL(arrays[n_pointers])), pointer );
+        LEAQ ( ARRAY_MEM(pointer, RAX, 8), pointer );
+        array_pointers[n_array_pointers++] = (array_pointer_t) {
+            .array = arrays[n_pointers],
+            .induction = *induction,
+            .pointer = pointer.base
+        };
+    }
+    return n_pointers;
+}
+
+static void release_array_pointers ( size_t n_pointers )
+{
+    for ( size_t i = 0; i < n_pointers; i++ )
+        spare_registers[n_spare_registers++] = array_pointers[--n_array_pointers].pointer;
+}
+
+/* Finds how many times a counted loop runs, when it starts right after a constant is assigned to its
+ * induction variable by previous, and its bound is a constant. Returns false if that is unknown,
+ * or more than limit.
+ */
+static bool find_trip_count ( counted_loop_t *loop, node_t *previous, size_t limit, size_t *trip_count )
+{
+    if ( previous == NULL || previous->type != ASSIGNMENT_STATEMENT
+         || previous->children[0]->type != IDENTIFIER_DATA || previous->children[0]->symbol != loop->induction.variable->symbol
+         || previous->children[1]->type != NUMBER_DATA || loop->bound->type != NUMBER_DATA )
+        return false;
+
+    int64_t value = *(int64_t*) previous->children[1]->data;
+    int64_t bound = *(int64_t*) loop->bound->data;
+    for ( *trip_count = 0; *trip_count <= limit; (*trip_count)++ )
+    {
+        bool keeps_going;
+        switch ( loop->condition )
+        {
+            case COND_L: keeps_going = value < bound; break;
+            case COND_LE: keeps_going = value <= bound; break;
+            case COND_G: keeps_going = value > bound; break;
+            case COND_GE: keeps_going = value >= bound; break;
+            default: assert ( false && "Unexpected counted loop condition" );
         }
-        else if (strcmp(statement->children[0]->data, "<=") == 0) {
-            jmp_instruction = "jl";
+        if ( !keeps_going )
+            return true;
+        if ( __builtin_add_overflow ( value, loop->induction.step, &value ) )
+            return false;
+    }
+    return false;
+}
+
+/* Emits the loop rotated, testing the relation at the bottom, so each iteration only takes one jump.
+ * The relation is also tested once on the way in, in case the body should not run at all.
+ */
+static void generate_rotated_loop ( node_t *statement, label_t while_end_label )
+{
+    label_t while_start_label = new_label ( );
+
+    condition_t condition = generate_relation ( statement->children[0] );
+    JCC ( NEGATE_CONDITION(condition), while_end_label );
+
+    ALIGN ( LOOP_ALIGNMENT );
+    LABEL ( while_start_label );
+    generate_statement ( statement->children[1] );
+
+    // Keep looping while the relation holds
+    condition = generate_relation ( statement->children[0] );
+    JCC ( condition, while_start_label );
+}
+
+// Vectorized loops handle this many iterations at once, one per quadword of a vector register
+#define VECTOR_LANES ( avx2 ? 4 : 2 )
+#define VECTOR_BYTES ( VECTOR_LANES * 8 )
+#define NUM_VECTOR_REGISTERS 16
+// Every array needs a general purpose register for its address, and every invariant a vector register
+#define MAX_VECTOR_ARRAYS ( 1 + NUM_LEAF_REGISTERS )
+#define MAX_VECTOR_INVARIANTS 8
+
+/* A counted loop stepping its induction variable by one, repeating a single statement that either stores
+ * to a global array, "a[i] := value", or accumulates a sum, "sum := sum + value" or "sum := sum - value".
+ * The value is built with + and - from elements of global arrays indexed by i plus or minus a constant,
+ * and expressions the loop never changes.
+ */
+typedef struct
+{
+    counted_loop_t loop;
+    node_t *target;    // The array element the statement stores to, or the variable it accumulates into
+    node_t *value;
+    bool subtracts;    // If a sum subtracts the value
+    symbol_t *arrays[MAX_VECTOR_ARRAYS];
+    size_t n_arrays;
+    node_t *invariants[MAX_VECTOR_INVARIANTS];
+    size_t n_invariants;
+    node_t *aligned;   // The array element the scalar prologue aligns, or NULL if there are none
+} vector_loop_t;
+
+static bool is_vector_element ( node_t *node, symbol_t *variable, int64_t *offset )
+{
+    return node->type == ARRAY_INDEXING && node->children[0]->symbol->type == SYMBOL_GLOBAL_ARRAY
+        && is_induction_index ( node->children[1], variable, offset );
+}
+
+/* Returns the position of the element's array in the loop's list of arrays, adding it if needed, or -1 if full */
+static int vector_array_index ( vector_loop_t *vector, node_t *element )
+{
+    symbol_t *array = element->children[0]->symbol;
+    for ( size_t i = 0; i < vector->n_arrays; i++ )
+        if ( vector->arrays[i] == array )
+            return i;
+    if ( vector->n_arrays == MAX_VECTOR_ARRAYS )
+        return -1;
+    vector->arrays[vector->n_arrays] = array;
+    return vector->n_arrays++;
+}
+
+/* Collects the arrays and invariant parts of a value. Returns false if the value can not be vectorized */
+static bool find_vector_operands ( vector_loop_t *vector, node_t *value, node_t *body )
+{
+    int64_t offset;
+    if ( is_loop_invariant ( value, body ) )
+    {
+        if ( vector->n_invariants == MAX_VECTOR_INVARIANTS )
+            return false;
+        vector->invariants[vector->n_invariants++] = value;
+        return true;
+    }
+    if ( is_vector_element ( value, vector->loop.induction.variable->symbol, &offset ) )
+    {
+        if ( vector->aligned == NULL )
+            vector->aligned = value;
+        return vector_array_index ( vector, value ) >= 0;
+    }
+    if ( value->type != EXPRESSION || ( strcmp ( value->data, "+" ) != 0 && strcmp ( value->data, "-" ) != 0 ) )
+        return false;
+    for ( size_t i = 0; i < value->n_children; i++ )
+        if ( !find_vector_operands ( vector, value->children[i], body ) )
+            return false;
+    return true;
+}
+
+/* Returns the number of the invariant register holding the value, or -1 if it is not an invariant */
+static int vector_invariant_index ( vector_loop_t *vector, node_t *value )
+{
+    for ( size_t i = 0; i < vector->n_invariants; i++ )
+        if ( vector->invariants[i] == value )
+            return i;
+    return -1;
+}
+
+/* An upper bound on the registers evaluating the value takes, besides the invariant registers */
+static size_t count_vector_temporaries ( vector_loop_t *vector, node_t *value )
+{
+    if ( vector_invariant_index ( vector, value ) >= 0 )
+        return 0;
+    size_t most = 0;
+    for ( size_t i = 0; i < value->n_children; i++ )
+    {
+        size_t count = count_vector_temporaries ( vector, value->children[i] );
+        if ( count > most )
+            most = count;
+    }
+    return value->type == ARRAY_INDEXING ? 1 : most + 1;
+}
+
+/* Returns true if the value reads an element of the array that an earlier iteration stored to,
+ * at an offset below the stored one. Running several iterations at once would read it before it is stored.
+ */
+static bool has_loop_carried_dependence ( node_t *value, symbol_t *array, int64_t stored_offset, symbol_t *variable )
+{
+    int64_t offset;
+    if ( is_vector_element ( value, variable, &offset ) && value->children[0]->symbol == array )
+        return offset < stored_offset;
+    for ( size_t i = 0; i < value->n_children; i++ )
+        if ( has_loop_carried_dependence ( value->children[i], array, stored_offset, variable ) )
+            return true;
+    return false;
+}
+
+/* Finds the registers a vectorized loop can keep the addresses of its arrays in, and returns how many there are.
+ * %rax and %rdx hold its position and end, and framed functions keep no variables in caller-saved registers.
+ */
+static size_t find_vector_array_registers ( reg_t *registers )
+{
+    static const reg_t CALLER_SAVED[] = {REG_RSI, REG_RDI, REG_R8, REG_R9, REG_R10, REG_R11};
+    size_t n_registers = 0;
+    registers[n_registers++] = REG_RCX;
+    if ( leaf_function )
+        for ( size_t i = 0; i < n_spare_registers; i++ )
+            registers[n_registers++] = spare_registers[i];
+    else
+        for ( size_t i = 0; i < sizeof(CALLER_SAVED) / sizeof(CALLER_SAVED[0]); i++ )
+            registers[n_registers++] = CALLER_SAVED[i];
+    return n_registers;
+}
+
+/* Recognizes a counted loop that can be vectorized. Returns false if it can not be */
+static bool find_vector_loop ( node_t *statement, counted_loop_t *loop, vector_loop_t *vector )
+{
+    node_t *body = statement->children[1];
+    node_t *statement_list = body->children[body->n_children-1];
+    if ( !vectorize || loop->induction.step != 1 || statement_list->n_children != 2 )
+        return false;
+    node_t *kernel = statement_list->children[0];
+    if ( kernel->type != ASSIGNMENT_STATEMENT )
+        return false;
+
+    *vector = (vector_loop_t) { .loop = *loop, .target = kernel->children[0], .value = kernel->children[1] };
+    symbol_t *variable = loop->induction.variable->symbol;
+    int64_t stored_offset;
+    if ( vector->target->type == ARRAY_INDEXING )
+    {
+        if ( !is_vector_element ( vector->target, variable, &stored_offset ) )
+            return false;
+        vector_array_index ( vector, vector->target );
+        vector->aligned = vector->target;
+    }
+    else
+    {
+        // The sum can be on either side of +
+        symbol_t *sum = vector->target->symbol;
+        node_t *value = vector->value;
+        if ( sum == variable || value->type != EXPRESSION || value->n_children != 2
+             || ( sum->type != SYMBOL_LOCAL_VAR && sum->type != SYMBOL_PARAMETER && sum->type != SYMBOL_GLOBAL_VAR ) )
+            return false;
+        node_t *lhs = value->children[0], *rhs = value->children[1];
+        bool lhs_is_sum = lhs->type == IDENTIFIER_DATA && lhs->symbol == sum;
+        bool rhs_is_sum = rhs->type == IDENTIFIER_DATA && rhs->symbol == sum;
+        if ( strcmp ( value->data, "+" ) == 0 && lhs_is_sum )
+            vector->value = rhs;
+        else if ( strcmp ( value->data, "+" ) == 0 && rhs_is_sum )
+            vector->value = lhs;
+        else if ( strcmp ( value->data, "-" ) == 0 && lhs_is_sum )
+        {
+            vector->value = rhs;
+            vector->subtracts = true;
         }
-        else if (strcmp(statement->children[0]->data, "<") == 0) {
-            jmp_instruction = "jle";
+        else
+            return false;
+    }
+
+    if ( !find_vector_operands ( vector, vector->value, body ) )
+        return false;
+    if ( vector->target->type == ARRAY_INDEXING
+         && has_loop_carried_dependence ( vector->value, vector->target->children[0]->symbol, stored_offset, variable ) )
+        return false;
+
+    // The invariants, the sum, and the temporaries all need a register
+    reg_t array_registers[MAX_VECTOR_ARRAYS];
+    return vector->n_invariants + 1 + count_vector_temporaries ( vector, vector->value ) <= NUM_VECTOR_REGISTERS
+        && vector->n_arrays <= find_vector_array_registers ( array_registers );
+}
+
+static operand_t vector_register ( size_t number )
+{
+    return avx2 ? YMM(number) : XMM(number);
+}
+
+/* Returns true if the element is always aligned to the vector size in the vectorized loop */
+static bool is_aligned_element ( vector_loop_t *vector, node_t *element )
+{
+    symbol_t *variable = vector->loop.induction.variable->symbol;
+    int64_t offset, aligned_offset;
+    is_induction_index ( element->children[1], variable, &offset );
+    is_induction_index ( vector->aligned->children[1], variable, &aligned_offset );
+    return element->children[0]->symbol == vector->aligned->children[0]->symbol
+        && ( offset - aligned_offset ) % VECTOR_LANES == 0;
+}
+
+/* Moves a vector to or from the element at the loop's position, which is in %rax */
+static void generate_vector_move ( vector_loop_t *vector, node_t *element, reg_t *array_registers, bool store,
+                                   operand_t vector_register )
+{
+    int64_t offset;
+    is_induction_index ( element->children[1], vector->loop.induction.variable->symbol, &offset );
+    operand_t memory = ARRAY_MEM ( REGISTER(array_registers[vector_array_index ( vector, element )]), RAX, 8 );
+    memory.value = offset * 8;
+
+    operand_t source = store ? vector_register : memory;
+    operand_t destination = store ? memory : vector_register;
+    if ( is_aligned_element ( vector, element ) )
+        MOVDQA ( source, destination );
+    else
+        MOVDQU ( source, destination );
+}
+
+/* Evaluates a value of a vectorized loop into vector register number r, using the registers from r upwards,
+ * and returns the register holding it. Invariants are returned as the register they are kept in.
+ */
+static operand_t generate_vector_value ( vector_loop_t *vector, node_t *value, size_t r, reg_t *array_registers )
+{
+    int invariant = vector_invariant_index ( vector, value );
+    if ( invariant >= 0 )
+        return vector_register ( invariant );
+
+    operand_t result = vector_register ( r );
+    if ( value->type == ARRAY_INDEXING )
+    {
+        generate_vector_move ( vector, value, array_registers, false, result );
+        return result;
+    }
+    if ( value->n_children == 1 )
+    {
+        // Unary minus subtracts from zero
+        operand_t operand = generate_vector_value ( vector, value->children[0], r + 1, array_registers );
+        PXOR ( result, result );
+        PSUBQ ( operand, result );
+        return result;
+    }
+
+    node_t *lhs = value->children[0], *rhs = value->children[1];
+    bool subtract = strcmp ( value->data, "-" ) == 0;
+    if ( !subtract && vector_invariant_index ( vector, lhs ) >= 0 )
+    {
+        // Adding to an invariant would take a copy of its register first
+        node_t *swap = lhs;
+        lhs = rhs;
+        rhs = swap;
+    }
+    operand_t left = generate_vector_value ( vector, lhs, r, array_registers );
+    if ( left.base != result.base )
+        MOVDQA ( left, result );
+    operand_t right = generate_vector_value ( vector, rhs, r + 1, array_registers );
+    if ( subtract )
+        PSUBQ ( right, result );
+    else
+        PADDQ ( right, result );
+    return result;
+}
+
+/* Emits a vectorized loop in three parts. A scalar prologue runs single iterations until the element it aligns
+ * is at a multiple of the vector size. The vectorized loop then runs VECTOR_LANES iterations at a time,
+ * and the remaining iterations run one at a time in a rotated loop.
+ */
+static void generate_vector_loop ( node_t *statement, vector_loop_t *vector, label_t while_end_label )
+{
+    node_t *variable = vector->loop.induction.variable;
+    reg_t array_registers[MAX_VECTOR_ARRAYS];
+    find_vector_array_registers ( array_registers );
+    label_t vector_label = new_label ( );
+    label_t loop_label = new_label ( );
+    label_t remainder_label = new_label ( );
+
+    label_t prologue_label = new_label ( );
+    LABEL ( prologue_label );
+    condition_t condition = generate_counted_loop_test ( &vector->loop );
+    JCC ( NEGATE_CONDITION(condition), while_end_label );
+    if ( vector->aligned != NULL )
+    {
+        int64_t offset;
+        is_induction_index ( vector->aligned->children[1], variable->symbol, &offset );
+        operand_t element = ARRAY_MEM ( RCX, RAX, 8 );
+        element.value = offset * 8;
+        MOVQ ( generate_variable_access ( variable ), RAX );
+        LEAQ ( RIP_LABEL(SYMBOL_LABEL(vector->aligned->children[0]->symbol)), RCX );
+        LEAQ ( element, RCX );
+        ANDQ ( IMMEDIATE(VECTOR_BYTES - 1), RCX );
+        JCC ( COND_E, vector_label );
+        generate_statement ( statement->children[1] );
+        JMP ( prologue_label );
+    }
+    LABEL ( vector_label );
+
+    // Invariants are placed in the low quadword of their register here, and copied to every lane below
+    for ( size_t i = 0; i < vector->n_invariants; i++ )
+    {
+        generate_expression ( vector->invariants[i] );
+        MOVQ ( RAX, XMM(i) );
+        if ( !avx2 )
+            PUNPCKLQDQ ( XMM(i), XMM(i) );
+    }
+
+    // The vectorized loop ends where a multiple of VECTOR_LANES iterations remain to run.
+    // The count is unsigned, and the loop test only checks for the end, so neither can overflow
+    generate_expression ( vector->loop.bound );
+    if ( vector->loop.condition == COND_LE )
+        ADDQ ( IMMEDIATE(1), RAX );
+    MOVQ ( generate_variable_access ( variable ), RDX );
+    SUBQ ( RDX, RAX );
+    ANDQ ( IMMEDIATE(-VECTOR_LANES), RAX );
+    JCC ( COND_E, remainder_label );
+    ADDQ ( RAX, RDX );
+    MOVQ ( generate_variable_access ( variable ), RAX );
+
+    // Only AVX2 code runs from here on, until vzeroupper
+    if ( avx2 )
+        for ( size_t i = 0; i < vector->n_invariants; i++ )
+            VPBROADCASTQ ( XMM(i), YMM(i) );
+    for ( size_t i = 0; i < vector->n_arrays; i++ )
+        LEAQ ( RIP_LABEL(SYMBOL_LABEL(vector->arrays[i])), REGISTER(array_registers[i]) );
+    size_t sum = vector->n_invariants;
+    if ( vector->target->type == IDENTIFIER_DATA )
+        PXOR ( vector_register ( sum ), vector_register ( sum ) );
+
+    ALIGN ( LOOP_ALIGNMENT );
+    LABEL ( loop_label );
+    operand_t value = generate_vector_value ( vector, vector->value, sum + 1, array_registers );
+    if ( vector->target->type == ARRAY_INDEXING )
+        generate_vector_move ( vector, vector->target, array_registers, true, value );
+    else if ( vector->subtracts )
+        PSUBQ ( value, vector_register ( sum ) );
+    else
+        PADDQ ( value, vector_register ( sum ) );
+    ADDQ ( IMMEDIATE(VECTOR_LANES), RAX );
+    CMPQ ( RDX, RAX );
+    JCC ( COND_NE, loop_label );
+    MOVQ ( RAX, generate_variable_access ( variable ) );
+
+    if ( vector->target->type == IDENTIFIER_DATA )
+    {
+        // Add the lanes of the sum together, and then to the variable
+        if ( avx2 )
+        {
+            VEXTRACTI128 ( YMM(sum), XMM(sum + 1) );
+            VZEROUPPER;
+            PADDQ ( XMM(sum + 1), XMM(sum) );
         }
+        MOVDQA ( XMM(sum), XMM(sum + 1) );
+        PUNPCKHQDQ ( XMM(sum + 1), XMM(sum + 1) );
+        PADDQ ( XMM(sum + 1), XMM(sum) );
+        MOVQ ( XMM(sum), RAX );
+        ADDQ ( RAX, generate_variable_access ( vector->target ) );
+    }
+    else if ( avx2 )
+        VZEROUPPER;
 
-    EMIT("%s %s", jmp_instruction, while_end_label);
+    LABEL ( remainder_label );
+    generate_rotated_loop ( statement, while_end_label );
+}
 
+/* A counted loop counting upwards, which repeats a single store to a global array, "a[i] := value".
+ * The value is either the same every time, or an element of a global array at the same position, "b[i + 1]".
+ * Fills stepping by one become rep stosq, copies rep movsq, and fills with a larger step a strided store loop.
+ */
+typedef struct
+{
+    counted_loop_t loop;
+    node_t *target;
+    node_t *value;
+    bool copies;
+} store_loop_t;
+
+/* Recognizes a store loop. Returns false if the loop is not one */
+static bool find_store_loop ( node_t *statement, store_loop_t *store )
+{
+    counted_loop_t *loop = &store->loop;
+    if ( !find_counted_loop ( statement, loop, true ) || ( loop->condition != COND_L && loop->condition != COND_LE ) )
+        return false;
+    node_t *body = statement->children[1];
+    node_t *statement_list = body->children[body->n_children-1];
+    if ( statement_list->n_children != 2 || statement_list->children[0]->type != ASSIGNMENT_STATEMENT )
+        return false;
+
+    node_t *kernel = statement_list->children[0];
+    symbol_t *variable = loop->induction.variable->symbol;
+    int64_t offset;
+    store->target = kernel->children[0];
+    store->value = kernel->children[1];
+    if ( !is_vector_element ( store->target, variable, &offset ) )
+        return false;
+    // rep movsq copies one element at a time, in the same order as the loop, so the arrays may even overlap
+    store->copies = is_vector_element ( store->value, variable, &offset );
+    if ( store->copies )
+        return loop->induction.step == 1;
+    return is_loop_invariant ( store->value, body );
+}
 
-    generate_statement(statement->children[1]);
+/* Returns true if the register holds a variable or an array pointer. Only leaf functions keep those in
+ * caller-saved registers, and the ones they leave over are spare.
+ */
+static bool is_register_taken ( reg_t reg )
+{
+    if ( !leaf_function )
+        return false;
+    for ( size_t i = 0; i < n_spare_registers; i++ )
+        if ( spare_registers[i] == reg )
+            return false;
+    return true;
+}
 
-    JMP(while_start_label);
+/* Saves the registers a statement borrows on the stack, if they are taken */
+static void save_registers ( const reg_t *registers, size_t n_registers )
+{
+    for ( size_t i = 0; i < n_registers; i++ )
+        if ( is_register_taken ( registers[i] ) )
+            push_stack ( REGISTER(registers[i]) );
+}
 
-    LABEL("%s", while_end_label);
+static void restore_registers ( const reg_t *registers, size_t n_registers )
+{
+    for ( size_t i = n_registers; i-- > 0; )
+        if ( is_register_taken ( registers[i] ) )
+            pop_stack ( REGISTER(registers[i]) );
+}
 
-    free((void *)while_start_label);
-    free((void *)while_end_label);
+/* Places the address the element has when the induction variable is zero in destination */
+static void generate_element_base ( node_t *element, symbol_t *variable, operand_t destination )
+{
+    int64_t offset;
+    is_induction_index ( element->children[1], variable, &offset );
+    operand_t array = RIP_LABEL ( SYMBOL_LABEL(element->children[0]->symbol) );
+    array.value = offset * 8;
+    LEAQ ( array, destination );
+}
+
+/* Places the address of the element in destination, when the induction variable has the value in index */
+static void generate_element_address ( node_t *element, symbol_t *variable, operand_t index, operand_t destination )
+{
+    generate_element_base ( element, variable, destination );
+    LEAQ ( ARRAY_MEM(destination, index, 8), destination );
+}
+
+/* Fills or copies all the elements at once, with rep stosq or rep movsq */
+static void generate_string_store ( store_loop_t *store )
+{
+    static const reg_t STRING_REGISTERS[] = {REG_RDI, REG_RSI};
+    size_t n_borrowed = store->copies ? 2 : 1;
+    node_t *variable = store->loop.induction.variable;
+
+    save_registers ( STRING_REGISTERS, n_borrowed );
+    if ( !store->copies )
+    {
+        generate_expression ( store->value );
+        push_stack ( RAX );
+    }
+
+    // Every variable is read before %rdi and %rsi change, since they may live there
+    generate_expression ( store->loop.bound );
+    if ( store->loop.condition == COND_LE )
+        ADDQ ( IMMEDIATE(1), RAX );
+    MOVQ ( generate_variable_access ( variable ), RDX );
+    MOVQ ( RAX, RCX );
+    SUBQ ( RDX, RCX );
+    generate_element_address ( store->target, variable->symbol, RDX, RDI );
+    if ( store->copies )
+        generate_element_address ( store->value, variable->symbol, RDX, RSI );
+
+    // The induction variable ends up at the bound, kept in %rdx until the registers are restored
+    MOVQ ( RAX, RDX );
+    if ( store->copies )
+        REP_MOVSQ;
+    else
+    {
+        pop_stack ( RAX );
+        REP_STOSQ;
+    }
+    restore_registers ( STRING_REGISTERS, n_borrowed );
+    MOVQ ( RDX, generate_variable_access ( variable ) );
+}
+
+/* Fills every step-th element, four at a time while there are that many left, by moving a pointer along */
+static void generate_strided_store ( store_loop_t *store )
+{
+    // Spare registers need no saving
+    reg_t registers[2] = {REG_RDI, REG_RSI};
+    if ( leaf_function && n_spare_registers >= 2 )
+    {
+        registers[0] = spare_registers[0];
+        registers[1] = spare_registers[1];
+    }
+    operand_t position = REGISTER ( registers[0] ), end = REGISTER ( registers[1] );
+    node_t *variable = store->loop.induction.variable;
+    label_t unrolled_label = new_label ( );
+    label_t remainder_label = new_label ( );
+    label_t single_label = new_label ( );
+    label_t done_label = new_label ( );
+
+    save_registers ( registers, 2 );
+    generate_expression ( store->value );
+    push_stack ( RAX );
+    if ( store->loop.induction.step_variable != NULL )
+        MOVQ ( generate_variable_access ( store->loop.induction.step_variable ), RAX );
+    else
+        MOVQ ( IMMEDIATE(store->loop.induction.step), RAX );
+    push_stack ( RAX );
+
+    // Every variable is read before the borrowed registers change, since they may live there
+    generate_expression ( store->loop.bound );
+    if ( store->loop.condition == COND_LE )
+        ADDQ ( IMMEDIATE(1), RAX );
+    MOVQ ( generate_variable_access ( variable ), RDX );
+    generate_element_address ( store->target, variable->symbol, RAX, end );
+    generate_element_address ( store->target, variable->symbol, RDX, position );
+    pop_stack ( RDX );
+    SAL ( IMMEDIATE(3), RDX );
+    pop_stack ( RAX );
+
+    // The unrolled loop runs while the last of its four elements is before the end, kept in %rcx
+    LEAQ ( ARRAY_MEM(RDX, RDX, 2), RCX );
+    NEGQ ( RCX );
+    ADDQ ( end, RCX );
+    CMPQ ( RCX, position );
+    JCC ( COND_GE, remainder_label );
+    ALIGN ( LOOP_ALIGNMENT );
+    LABEL ( unrolled_label );
+    MOVQ ( RAX, MEM(position) );
+    MOVQ ( RAX, ARRAY_MEM(position, RDX, 1) );
+    LEAQ ( ARRAY_MEM(position, RDX, 2), position );
+    MOVQ ( RAX, MEM(position) );
+    MOVQ ( RAX, ARRAY_MEM(position, RDX, 1) );
+    LEAQ ( ARRAY_MEM(position, RDX, 2), position );
+    CMPQ ( RCX, position );
+    JCC ( COND_L, unrolled_label );
+
+    LABEL ( remainder_label );
+    CMPQ ( end, position );
+    JCC ( COND_GE, done_label );
+    LABEL ( single_label );
+    MOVQ ( RAX, MEM(position) );
+    ADDQ ( RDX, position );
+    CMPQ ( end, position );
+    JCC ( COND_L, single_label );
+    LABEL ( done_label );
+
+    // The induction variable ends up at the first position at or past the end
+    generate_element_base ( store->target, variable->symbol, RCX );
+    MOVQ ( position, RDX );
+    SUBQ ( RCX, RDX );
+    SAR ( IMMEDIATE(3), RDX );
+    restore_registers ( registers, 2 );
+    MOVQ ( RDX, generate_variable_access ( variable ) );
+}
 
+static void generate_store_loop ( node_t *statement, store_loop_t *store, label_t while_end_label )
+{
+    node_t *step_variable = store->loop.induction.step_variable;
+    label_t scalar_label = new_label ( );
+    if ( step_variable != NULL )
+    {
+        // Only a positive step ever reaches the bound. Any other step is left to the loop itself
+        MOVQ ( generate_variable_access ( step_variable ), RAX );
+        CMPQ ( IMMEDIATE(0), RAX );
+        JCC ( COND_LE, scalar_label );
+    }
+
+    condition_t condition = generate_counted_loop_test ( &store->loop );
+    JCC ( NEGATE_CONDITION(condition), while_end_label );
+    if ( step_variable == NULL && store->loop.induction.step == 1 )
+        generate_string_store ( store );
+    else
+        generate_strided_store ( store );
+
+    if ( step_variable != NULL )
+    {
+        JMP ( while_end_label );
+        LABEL ( scalar_label );
+        generate_rotated_loop ( statement, while_end_label );
+    }
+}
+
+/* previous is the statement right before the loop in the same block, or NULL */
+static void generate_while_statement ( node_t *statement, node_t *previous )
+{
+    // TODO (2.2):
+    // Implement while loops, similarily to the way if statements were generated.
+    // Remember to make label names unique, and to handle nested while loops.
+
+    label_t while_end_label = new_label ( );
+
+    label_t previous_innermost_while_end_label = innermost_while_end_label;
+    innermost_while_end_label = while_end_label;
+
+    // Entering the loop is counted at its relation
+    count_block ( statement->children[0] );
+
+    node_t *body = statement->children[1];
+    size_t body_nodes = count_nodes ( body );
+    counted_loop_t loop;
+    vector_loop_t vector;
+    store_loop_t store;
+    size_t trip_count;
+    size_t factor = UNROLL_NODE_BUDGET / body_nodes;
+    if ( factor > MAX_UNROLL )
+        factor = MAX_UNROLL;
+
+    // A loop the profile never saw entered is kept small, and one that runs fewer iterations than the
+    // unrolled loop takes on average is not unrolled. An instrumented loop has to run its body to count it
+    uint64_t entries, iterations;
+    bool profiled = profiled_block_count ( statement->children[0], &entries )
+        && profiled_block_count ( body, &iterations );
+    bool counted = find_counted_loop ( statement, &loop, false ) && !( profiled && entries == 0 );
+    bool transformable = !instrumenting && !( profiled && entries == 0 );
+    bool unrollable = counted && factor >= 2 && !( profiled && iterations < entries * factor );
+
+    if ( counted && find_trip_count ( &loop, previous, FULL_UNROLL_NODE_BUDGET / body_nodes, &trip_count ) )
+    {
+        // A short loop that always runs the same number of times needs no tests at all
+        for ( size_t i = 0; i < trip_count; i++ )
+            generate_statement ( body );
+    }
+    else if ( transformable && find_store_loop ( statement, &store ) )
+        generate_store_loop ( statement, &store, while_end_label );
+    else if ( transformable && counted && find_vector_loop ( statement, &loop, &vector ) )
+        generate_vector_loop ( statement, &vector, while_end_label );
+    else if ( unrollable )
+    {
+        size_t n_pointers = generate_array_pointers ( statement, &loop.induction );
+
+        // The unrolled loop runs while there are at least factor iterations left,
+        // and the rotated loop after it runs the rest, one at a time
+        int64_t offset = (int64_t) ( factor - 1 ) * loop.induction.step;
+        label_t unrolled_label = new_label ( );
+        label_t remainder_label = new_label ( );
+
+        condition_t condition = generate_unrolled_loop_test ( &loop, offset, remainder_label );
+        JCC ( NEGATE_CONDITION(condition), remainder_label );
+        ALIGN ( LOOP_ALIGNMENT );
+        LABEL ( unrolled_label );
+        for ( size_t i = 0; i < factor; i++ )
+            generate_statement ( body );
+        condition = generate_unrolled_loop_test ( &loop, offset, remainder_label );
+        JCC ( condition, unrolled_label );
+
+        LABEL ( remainder_label );
+        generate_rotated_loop ( statement, while_end_label );
+        release_array_pointers ( n_pointers );
+    }
+    else
+    {
+        induction_variable_t induction;
+        size_t n_pointers = 0;
+        if ( find_induction_variable ( statement, &induction ) )
+            n_pointers = generate_array_pointers ( statement, &induction );
+        generate_rotated_loop ( statement, while_end_label );
+        release_array_pointers ( n_pointers );
+    }
+
+    LABEL ( while_end_label );
 
     innermost_while_end_label = previous_innermost_while_end_label;
 }
@@ -514,12 +2628,26 @@ static void generate_break_statement ( )
     // TODO (2.3):
     // Generate the break statement, jumping out past the end of the innermost while loop.
     // You can use a global variable to keep track of the current innermost call to generate_while_statement().
-    JMP(innermost_while_end_label);
+    JMP ( innermost_while_end_label );
+}
+
+/* Marks the instructions generated next as the node's, if it has a source location */
+static void locate_instructions ( node_t *node )
+{
+    if ( node->line == 0 )
+        return;
+    source_line = node->line;
+    source_column = node->column;
 }
 
 /* Recursively generate the given statement node, and all sub-statements. */
 static void generate_statement ( node_t *node )
 {
+    // The code of an enclosing statement that follows this one is marked as the enclosing one's again
+    int enclosing_line = source_line, enclosing_column = source_column;
+    locate_instructions ( node );
+    // Every copy of a block that unrolling or moving it out of line makes counts it
+    count_block ( node );
     switch ( node->type )
     {
         case BLOCK: {
@@ -527,7 +2655,17 @@ static void generate_statement ( node_t *node )
             // Just generate the statements that make up the statement body, one by one
             node_t *statement_list = node->children[node->n_children-1];
             for ( size_t i = 0; i < statement_list->n_children; i++ )
-                generate_statement( statement_list->children[i] );
+            {
+                // While loops look at the statement before them, to see what their counter starts at
+                node_t *statement = statement_list->children[i];
+                if ( statement->type == WHILE_STATEMENT )
+                {
+                    locate_instructions ( statement );
+                    generate_while_statement ( statement, i > 0 ? statement_list->children[i-1] : NULL );
+                }
+                else
+                    generate_statement ( statement );
+            }
             break;
         }
         case ASSIGNMENT_STATEMENT:
@@ -543,7 +2681,7 @@ static void generate_statement ( node_t *node )
             generate_if_statement ( node );
             break;
         case WHILE_STATEMENT:
-            generate_while_statement ( node );
+            generate_while_statement ( node, NULL );
             break;
         case BREAK_STATEMENT:
             generate_break_statement ( );
@@ -553,90 +2691,609 @@ static void generate_statement ( node_t *node )
             break;
         default: assert( false && "Unknown statement type" );
     }
+    source_line = enclosing_line;
+    source_column = enclosing_column;
 }
 
-static void generate_safe_printf ( void )
+// System call numbers on Linux x86-64
+#define SYS_WRITE 1
+#define SYS_OPEN 2
+#define SYS_CLOSE 3
+#define SYS_EXIT_GROUP 231
+
+// O_WRONLY | O_CREAT | O_TRUNC on Linux, and the permissions of a file created by open
+#define OPEN_FOR_WRITING 01101
+#define NEW_FILE_MODE 0644
+
+// The size of the buffer print statements write to. It is only written out when it is full, and at exit
+#define OUTPUT_BUFFER_SIZE 65536
+// Room for the longest number, -9223372036854775808
+#define MAX_NUMBER_LENGTH 20
+
+/* Emits the runtime used by print statements, which collects all output in one large buffer:
+ *     print_string ( const char *string )
+ *     print_int ( int64_t number )
+ *     print_format ( const char *format, ... ), taking up to PRINT_FORMAT_ARGUMENTS numbers for %ld
+ *     flush_output ( ), which writes the buffer to stdout and empties it
+ * They follow the System V calling convention, and only call write when the buffer is flushed.
+ * Like all generated code, they keep the stack 16-byte aligned at every call.
+ */
+static void generate_output_runtime ( void )
 {
-    LABEL ( "safe_printf" );
+    SECTION ( SECTION_BSS );
+    ALIGN ( 8 );
+    LABEL ( output_length_label );
+    ZERO ( 8 );
+    LABEL ( output_buffer_label );
+    ZERO ( OUTPUT_BUFFER_SIZE );
+    SECTION ( SECTION_TEXT );
+
+    // print_string copies bytes until the terminating 0, flushing whenever the buffer fills up.
+    // %rcx is the length of the buffer, %rdx its start
+    label_t copy_byte = new_label ( ), string_done = new_label ( );
+    LABEL ( print_string_label );
+    MOVQ ( RIP_LABEL(output_length_label), RCX );
+    LEAQ ( RIP_LABEL(output_buffer_label), RDX );
+    LABEL ( copy_byte );
+    MOVZBQ ( MEM(RDI), RAX );
+    CMPQ ( IMMEDIATE(0), RAX );
+    JCC ( COND_E, string_done );
+    MOVB ( AL, ARRAY_MEM(RDX, RCX, 1) );
+    ADDQ ( IMMEDIATE(1), RCX );
+    ADDQ ( IMMEDIATE(1), RDI );
+    CMPQ ( IMMEDIATE(OUTPUT_BUFFER_SIZE), RCX );
+    JNE ( copy_byte );
+    MOVQ ( RCX, RIP_LABEL(output_length_label) );
+    PUSHQ ( RDI );
+    CALL ( flush_output_label );
+    POPQ ( RDI );
+    JMP ( print_string_label );
+    LABEL ( string_done );
+    MOVQ ( RCX, RIP_LABEL(output_length_label) );
+    RET;
+
+    // print_int first makes sure the whole number fits in the buffer.
+    // The digits are produced from the lowest one up, into the red zone below %rsp, and then copied.
+    // Dividing by 10 is done by multiplying with 2^67 / 10, and keeping the high bits of the product.
+    label_t has_room = new_label ( ), not_negative = new_label ( );
+    label_t next_digit = new_label ( ), copy_digit = new_label ( );
+    LABEL ( print_int_label );
+    MOVQ ( RIP_LABEL(output_length_label), RCX );
+    CMPQ ( IMMEDIATE(OUTPUT_BUFFER_SIZE - MAX_NUMBER_LENGTH), RCX );
+    JCC ( COND_LE, has_room );
+    PUSHQ ( RDI );
+    CALL ( flush_output_label );
+    POPQ ( RDI );
+    MOVQ ( IMMEDIATE(0), RCX );
+    LABEL ( has_room );
+
+    // %rsi points to where the next character goes
+    LEAQ ( RIP_LABEL(output_buffer_label), RSI );
+    ADDQ ( RCX, RSI );
+    CMPQ ( IMMEDIATE(0), RDI );
+    JCC ( COND_GE, not_negative );
+    MOVB ( IMMEDIATE('-'), MEM(RSI) );
+    ADDQ ( IMMEDIATE(1), RSI );
+    // Negating INT64_MIN gives itself, which is still correct once treated as unsigned below
+    NEGQ ( RDI );
+    LABEL ( not_negative );
+
+    // %rdi is what remains of the number, %r8 points to the last digit produced
+    MOVQ ( RSP, R8 );
+    MOVQ ( IMMEDIATE((int64_t) 0xCCCCCCCCCCCCCCCD), R9 );
+    MOVQ ( IMMEDIATE(10), R10 );
+    LABEL ( next_digit );
+    MOVQ ( RDI, RAX );
+    MULQ ( R9 );
+    SHR ( IMMEDIATE(3), RDX ); // The number divided by 10
+    MOVQ ( RDX, RAX );
+    IMULQ ( R10, RAX );
+    SUBQ ( RAX, RDI ); // The remainder is the next digit
+    ADDQ ( IMMEDIATE('0'), RDI );
+    SUBQ ( IMMEDIATE(1), R8 );
+    MOVB ( BYTE_REGISTER(REG_RDI), MEM(R8) );
+    MOVQ ( RDX, RDI );
+    CMPQ ( IMMEDIATE(0), RDI );
+    JNE ( next_digit );
+
+    LABEL ( copy_digit );
+    MOVZBQ ( MEM(R8), RAX );
+    MOVB ( AL, MEM(RSI) );
+    ADDQ ( IMMEDIATE(1), RSI );
+    ADDQ ( IMMEDIATE(1), R8 );
+    CMPQ ( RSP, R8 );
+    JNE ( copy_digit );
+
+    LEAQ ( RIP_LABEL(output_buffer_label), RAX );
+    SUBQ ( RAX, RSI );
+    MOVQ ( RSI, RIP_LABEL(output_length_label) );
+    RET;
+
+    // print_format copies the format one byte at a time, and prints the next argument at every %ld.
+    // The arguments are pushed so they are in order on the stack, with %r12 pointing to the next one,
+    // and %rbx points to the rest of the format. Between calls, the buffer length is kept in %rcx
+    label_t load_length = new_label ( ), next_byte = new_label ( ), print_byte = new_label ( );
+    label_t print_argument = new_label ( ), format_done = new_label ( );
+    LABEL ( print_format_label );
+    PUSHQ ( RBP );
+    MOVQ ( RSP, RBP );
+    PUSHQ ( RBX );
+    PUSHQ ( R12 );
+    SUBQ ( IMMEDIATE(8), RSP ); // Padding, so the stack is aligned once the arguments are pushed
+    for ( size_t i = PRINT_FORMAT_ARGUMENTS; i > 0; i-- )
+        PUSHQ ( REGISTER(REGISTER_PARAMS[i]) );
+    MOVQ ( RDI, RBX );
+    MOVQ ( RSP, R12 );
+    LABEL ( load_length );
+    MOVQ ( RIP_LABEL(output_length_label), RCX );
+    LEAQ ( RIP_LABEL(output_buffer_label), RDX );
+    LABEL ( next_byte );
+    MOVZBQ ( MEM(RBX), RAX );
+    CMPQ ( IMMEDIATE(0), RAX );
+    JCC ( COND_E, format_done );
+    CMPQ ( IMMEDIATE('%'), RAX );
+    JNE ( print_byte );
+    // Either %% or %ld
+    ADDQ ( IMMEDIATE(1), RBX );
+    MOVZBQ ( MEM(RBX), RAX );
+    CMPQ ( IMMEDIATE('%'), RAX );
+    JNE ( print_argument );
+    LABEL ( print_byte );
+    MOVB ( AL, ARRAY_MEM(RDX, RCX, 1) );
+    ADDQ ( IMMEDIATE(1), RCX );
+    ADDQ ( IMMEDIATE(1), RBX );
+    CMPQ ( IMMEDIATE(OUTPUT_BUFFER_SIZE), RCX );
+    JNE ( next_byte );
+    MOVQ ( RCX, RIP_LABEL(output_length_label) );
+    CALL ( flush_output_label );
+    JMP ( load_length );
+    LABEL ( print_argument );
+    MOVQ ( RCX, RIP_LABEL(output_length_label) );
+    ADDQ ( IMMEDIATE(2), RBX );
+    MOVQ ( MEM(R12), RDI );
+    ADDQ ( IMMEDIATE(8), R12 );
+    CALL ( print_int_label );
+    JMP ( load_length );
+    LABEL ( format_done );
+    MOVQ ( RCX, RIP_LABEL(output_length_label) );
+    MOVQ ( MEM_OFFSET(-16, RBP), R12 );
+    MOVQ ( MEM_OFFSET(-8, RBP), RBX );
+    MOVQ ( RBP, RSP );
+    POPQ ( RBP );
+    RET;
 
+    // flush_output calls write until everything is written, or it fails.
+    // %rbx points to what remains to be written, and %r12 is its length
+    label_t write_more = new_label ( ), flush_done = new_label ( );
+    LABEL ( flush_output_label );
     PUSHQ ( RBP );
     MOVQ ( RSP, RBP );
-    // This is a bitmask that abuses how negative numbers work, to clear the last 4 bits
-    // A stack pointer that is not 16-byte aligned, will be moved down to a 16-byte boundary
-    ANDQ ( "$-16", RSP );
-    EMIT ( "call printf" );
-    // Cleanup the stack back to how it was
+    PUSHQ ( RBX );
+    PUSHQ ( R12 );
+    LEAQ ( RIP_LABEL(output_buffer_label), RBX );
+    MOVQ ( RIP_LABEL(output_length_label), R12 );
+    LABEL ( write_more );
+    CMPQ ( IMMEDIATE(0), R12 );
+    JCC ( COND_LE, flush_done );
+    // An instrumented program also writes its profile and timing report through the output buffer
+    if ( instrumenting || timing )
+        MOVQ ( RIP_LABEL(output_fd_label), RDI );
+    else
+        MOVQ ( IMMEDIATE(1), RDI ); // stdout
+    MOVQ ( RBX, RSI );
+    MOVQ ( R12, RDX );
+    if ( freestanding )
+    {
+        MOVQ ( IMMEDIATE(SYS_WRITE), RAX );
+        SYSCALL;
+    }
+    else
+        CALL ( write_label );
+    CMPQ ( IMMEDIATE(0), RAX );
+    JCC ( COND_LE, flush_done );
+    ADDQ ( RAX, RBX );
+    SUBQ ( RAX, R12 );
+    JMP ( write_more );
+    LABEL ( flush_done );
+    MOVQ ( IMMEDIATE(0), RIP_LABEL(output_length_label) );
+    MOVQ ( MEM_OFFSET(-16, RBP), R12 );
+    MOVQ ( MEM_OFFSET(-8, RBP), RBX );
     MOVQ ( RBP, RSP );
     POPQ ( RBP );
     RET;
 }
 
+/* Emits what a freestanding program needs instead of libc:
+ *     _start, where the kernel starts the program, which calls main ( argc, argv )
+ *     parse_int ( const char *string ), replacing strtol for decimal numbers with an optional sign, which
+ *       like strtol gives the largest or smallest number for numbers out of range
+ *     exit_program ( int status ), ending all threads of the process like exit does.
+ *       Output must be flushed first, which main does
+ */
+static void generate_freestanding_runtime ( void )
+{
+    // The kernel places argc at the top of the stack, followed by the argv array.
+    // %rsp is 16-byte aligned, so the stack is aligned for the call
+    LABEL ( start_label );
+    MOVQ ( MEM(RSP), RDI );
+    LEAQ ( MEM_OFFSET(8, RSP), RSI );
+    CALL ( main_label );
+
+    // %rcx is set when the number is negative, and %rax holds the value parsed so far, negated, since the
+    // negative numbers go one further. Like strtol, numbers out of range give the largest or smallest number
+    label_t not_minus = new_label ( ), next_digit = new_label ( ), parse_done = new_label ( );
+    label_t negative = new_label ( ), out_of_range = new_label ( );
+    LABEL ( strtol_label );
+    MOVQ ( IMMEDIATE(0), RAX );
+    MOVQ ( IMMEDIATE(0), RCX );
+    MOVQ ( IMMEDIATE(10), R8 );
+    MOVZBQ ( MEM(RDI), RDX );
+    CMPQ ( IMMEDIATE('-'), RDX );
+    JNE ( not_minus );
+    MOVQ ( IMMEDIATE(1), RCX );
+    ADDQ ( IMMEDIATE(1), RDI );
+    JMP ( next_digit );
+    LABEL ( not_minus );
+    CMPQ ( IMMEDIATE('+'), RDX );
+    JNE ( next_digit );
+    ADDQ ( IMMEDIATE(1), RDI );
+    LABEL ( next_digit );
+    MOVZBQ ( MEM(RDI), RDX );
+    SUBQ ( IMMEDIATE('0'), RDX );
+    CMPQ ( IMMEDIATE(0), RDX );
+    JCC ( COND_L, parse_done );
+    CMPQ ( IMMEDIATE(9), RDX );
+    JCC ( COND_G, parse_done );
+    IMULQ ( R8, RAX );
+    JCC ( COND_O, out_of_range );
+    SUBQ ( RDX, RAX );
+    JCC ( COND_O, out_of_range );
+    ADDQ ( IMMEDIATE(1), RDI );
+    JMP ( next_digit );
+    LABEL ( parse_done );
+    CMPQ ( IMMEDIATE(0), RCX );
+    JCC ( COND_NE, negative );
+    NEGQ ( RAX );
+    JCC ( COND_O, out_of_range );
+    LABEL ( negative );
+    RET;
+    LABEL ( out_of_range );
+    MOVQ ( IMMEDIATE(INT64_MAX), RAX );
+    ADDQ ( RCX, RAX );
+    RET;
+
+    LABEL ( exit_label );
+    MOVQ ( IMMEDIATE(SYS_EXIT_GROUP), RAX );
+    SYSCALL;
+}
+
+/* Writes the counters to profile_output when the program exits, in the format read_profile reads.
+ * The program's output has been flushed, so the output runtime prints the profile, into the file instead.
+ * If the file can not be opened, nothing is written.
+ */
+static void generate_profile_writer ( void )
+{
+    // The name is placed in .rodata as a string literal
+    char *file_name = NULL;
+    for ( const char *c = profile_output; *c != '\0'; c++ )
+        append_text ( &file_name, *c == '"' || *c == '\\' ? "\\%c" : "%c", *c );
+    LEAQ ( RIP_LABEL(print_text_label ( file_name )), RDI );
+    free ( file_name );
+    MOVQ ( IMMEDIATE(OPEN_FOR_WRITING), RSI );
+    MOVQ ( IMMEDIATE(NEW_FILE_MODE), RDX );
+    MOVQ ( IMMEDIATE(SYS_OPEN), RAX );
+    SYSCALL;
+    MOVQ ( RAX, RIP_LABEL(output_fd_label) );
+
+    // Every call to print_format prints the lines of up to PRINT_FORMAT_ARGUMENTS counters
+    char *format = NULL;
+    size_t n_values = 0;
+    for ( size_t i = 0; i < n_instrumented_functions; i++ )
+    {
+        instrumented_function_t *function = &instrumented_functions[i];
+        size_t n_counters = 1 + function->n_blocks + function->n_call_sites;
+        for ( size_t j = 0; j < n_counters; j++ )
+        {
+            if ( j == 0 )
+                append_text ( &format, "function %s %" PRIu64 " %%ld\\n",
+                              function->function->name, structural_hash ( function->function ) );
+            else if ( j <= function->n_blocks )
+                append_text ( &format, "block %zu %%ld\\n", j - 1 );
+            else
+                append_text ( &format, "call %zu %%ld\\n", j - 1 - function->n_blocks );
+
+            operand_t counter = RIP_LABEL ( profile_counters_label );
+            counter.value = ( function->counter_base + j ) * 8;
+            MOVQ ( counter, REGISTER(REGISTER_PARAMS[1 + n_values++]) );
+            if ( n_values == PRINT_FORMAT_ARGUMENTS )
+            {
+                LEAQ ( RIP_LABEL(print_text_label ( format )), RDI );
+                CALL ( print_format_label );
+                free ( format );
+                format = NULL;
+                n_values = 0;
+            }
+        }
+    }
+    if ( n_values > 0 )
+    {
+        LEAQ ( RIP_LABEL(print_text_label ( format )), RDI );
+        CALL ( print_format_label );
+        free ( format );
+    }
+
+    CALL ( flush_output_label );
+    MOVQ ( RIP_LABEL(output_fd_label), RDI );
+    MOVQ ( IMMEDIATE(SYS_CLOSE), RAX );
+    SYSCALL;
+}
+
+/* Points the timing record of every function to its line of the report */
+static void generate_timing_formats ( void )
+{
+    for ( size_t i = 0; i < n_timed_functions; i++ )
+    {
+        char *format = NULL;
+        append_text ( &format, "%%ld\\t%%ld\\t%%ld\\t%%ld%%%%\\t%s\\n", timed_functions[i]->name );
+        LEAQ ( RIP_LABEL(print_text_label ( format )), RAX );
+        free ( format );
+        operand_t record = RIP_LABEL ( function_times_label );
+        record.value = i * TIMING_RECORD_SIZE + TIMING_FORMAT;
+        MOVQ ( RAX, record );
+    }
+}
+
+/* Prints the timing records of the functions that were called to stderr, the most exclusive cycles first.
+ * Each round picks the largest record left, prints it, and clears its calls so it is not picked again.
+ * %r12 points to the largest record so far, %r13 to the next record, and %r14 holds the total exclusive
+ * cycles of all functions, for their shares. The output runtime leaves them alone.
+ */
+static void generate_timing_report ( void )
+{
+    MOVQ ( IMMEDIATE(2), RIP_LABEL(output_fd_label) ); // stderr
+    LEAQ ( RIP_LABEL(print_text_label ( "calls\\tinclusive cycles\\texclusive cycles\\tshare\\tfunction\\n" )),
+           RDI );
+    CALL ( print_string_label );
+
+    MOVQ ( IMMEDIATE(0), R14 );
+    for ( size_t i = 0; i < n_timed_functions; i++ )
+    {
+        operand_t exclusive = RIP_LABEL ( function_times_label );
+        exclusive.value = i * TIMING_RECORD_SIZE + TIMING_EXCLUSIVE;
+        ADDQ ( exclusive, R14 );
+    }
+    label_t find_largest = new_label ( ), next_record = new_label ( ), take_record = new_label ( );
+    label_t skip_record = new_label ( ), report_done = new_label ( ), nonzero_total = new_label ( );
+    CMPQ ( IMMEDIATE(0), R14 );
+    JNE ( nonzero_total );
+    MOVQ ( IMMEDIATE(1), R14 );
+    LABEL ( nonzero_total );
+
+    LABEL ( find_largest );
+    MOVQ ( IMMEDIATE(0), R12 );
+    LEAQ ( RIP_LABEL(function_times_label), R13 );
+    LABEL ( next_record );
+    CMPQ ( IMMEDIATE(0), MEM_OFFSET(TIMING_CALLS, R13) );
+    JCC ( COND_E, skip_record );
+    CMPQ ( IMMEDIATE(0), R12 );
+    JCC ( COND_E, take_record );
+    MOVQ ( MEM_OFFSET(TIMING_EXCLUSIVE, R13), RAX );
+    CMPQ ( MEM_OFFSET(TIMING_EXCLUSIVE, R12), RAX );
+    JCC ( COND_LE, skip_record );
+    LABEL ( take_record );
+    MOVQ ( R13, R12 );
+    LABEL ( skip_record );
+    ADDQ ( IMMEDIATE(TIMING_RECORD_SIZE), R13 );
+    operand_t records_end = RIP_LABEL ( function_times_label );
+    records_end.value = n_timed_functions * TIMING_RECORD_SIZE;
+    LEAQ ( records_end, RAX );
+    CMPQ ( RAX, R13 );
+    JNE ( next_record );
+
+    CMPQ ( IMMEDIATE(0), R12 );
+    JCC ( COND_E, report_done );
+    // The share is in percent of the total, rounded down
+    MOVQ ( MEM_OFFSET(TIMING_EXCLUSIVE, R12), RAX );
+    MOVQ ( IMMEDIATE(100), RCX );
+    IMULQ ( RCX, RAX );
+    CQO;
+    IDIVQ ( R14 );
+    MOVQ ( RAX, R8 );
+    MOVQ ( MEM_OFFSET(TIMING_CALLS, R12), RSI );
+    MOVQ ( MEM_OFFSET(TIMING_INCLUSIVE, R12), RDX );
+    MOVQ ( MEM_OFFSET(TIMING_EXCLUSIVE, R12), RCX );
+    MOVQ ( MEM_OFFSET(TIMING_FORMAT, R12), RDI );
+    CALL ( print_format_label );
+    MOVQ ( IMMEDIATE(0), MEM_OFFSET(TIMING_CALLS, R12) );
+    JMP ( find_largest );
+
+    LABEL ( report_done );
+    CALL ( flush_output_label );
+}
+
 static void generate_main ( symbol_t *first )
 {
     // Make the globally available main function
-    LABEL ( "main" );
+    size_t start = n_instructions;
+    LABEL ( main_label );
+    if ( debug_info )
+        DIRECTIVE ( "\t.cfi_startproc" );
 
     // Save old base pointer, and set new base pointer
-    PUSHQ ( RBP );
-    MOVQ ( RSP, RBP );
+    generate_frame_setup ( );
+    stack_depth = 0;
 
     // Which registers argc and argv are passed in
-    const char* argc = RDI;
-    const char* argv = RSI;
+    const operand_t argc = RDI;
+    const operand_t argv = RSI;
 
     const size_t expected_args = FUNC_PARAM_COUNT ( first );
 
-    SUBQ ( "$1", argc ); // argc counts the name of the binary, so subtract that
-    EMIT ( "cmpq $%ld, %s", expected_args, argc );
-    JNE ( "ABORT" ); // If the provdied number of arguments is not equal, go to the abort label
+    label_t abort_label = named_label ( "ABORT" );
+    label_t parse_argv_label = named_label ( "PARSE_ARGV" );
+
+    if ( instrumenting || timing )
+        MOVQ ( IMMEDIATE(1), RIP_LABEL(output_fd_label) ); // stdout, until the profile is written
+    if ( timing )
+        generate_timing_formats ( );
+
+    SUBQ ( IMMEDIATE(1), argc ); // argc counts the name of the binary, so subtract that
+    CMPQ ( IMMEDIATE(expected_args), argc );
+    JNE ( abort_label ); // If the provdied number of arguments is not equal, go to the abort label
 
     if (expected_args == 0)
         goto skip_args; // No need to parse argv
 
-    // Now we emit a loop to parse all parameters, and push them to the stack,
-    // in right-to-left order
+    // Now we emit a loop to parse all parameters, and store them to the stack,
+    // in right-to-left order. Room is made for all of them first, with padding above them,
+    // so that the stack stays aligned for the calls to strtol
+    grow_stack ( expected_args * 8 + ALIGNMENT_PADDING(expected_args * 8) );
 
     // First move the argv pointer to the vert rightmost parameter
-    EMIT( "addq $%ld, %s", expected_args*8, argv );
+    ADDQ ( IMMEDIATE(expected_args*8), argv );
 
     // We use rcx as a counter, starting at the number of arguments
     MOVQ ( argc, RCX );
-    LABEL ( "PARSE_ARGV" ); // A loop to parse all parameters
-    PUSHQ ( argv ); // push registers to caller save them
-    PUSHQ ( RCX );
+    LABEL ( parse_argv_label ); // A loop to parse all parameters
+    push_stack ( argv ); // push registers to caller save them
+    push_stack ( RCX );
 
     // Now call strtol to parse the argument
-    EMIT ( "movq (%s), %s", argv, RDI ); // 1st argument, the char *
-    MOVQ ( "$0", RSI ); // 2nd argument, a null pointer
-    MOVQ ( "$10", RDX ); //3rd argument, we want base 10
-    EMIT ( "call strtol" );
+    MOVQ ( MEM(argv), RDI ); // 1st argument, the char *
+    MOVQ ( IMMEDIATE(0), RSI ); // 2nd argument, a null pointer
+    MOVQ ( IMMEDIATE(10), RDX ); //3rd argument, we want base 10
+    CALL ( strtol_label );
 
     // Restore caller saved registers
-    POPQ ( RCX );
-    POPQ ( argv );
-    PUSHQ ( RAX ); // Store the parsed argument on the stack
+    pop_stack ( RCX );
+    pop_stack ( argv );
+    // Store the parsed argument on the stack, with the first argument at the top
+    operand_t argument_slot = ARRAY_MEM ( RSP, RCX, 8 );
+    argument_slot.value = -8;
+    MOVQ ( RAX, argument_slot );
 
-    SUBQ ( "$8", argv ); // Point to the previous char*
-    EMIT ( "loop PARSE_ARGV" ); // Loop uses RCX as a counter automatically
+    SUBQ ( IMMEDIATE(8), argv ); // Point to the previous char*
+    LOOP ( parse_argv_label ); // Loop uses RCX as a counter automatically
 
     // Now, pop up to 6 arguments into registers instead of stack
     for ( size_t i = 0; i < expected_args && i < NUM_REGISTER_PARAMS; i++ )
-        POPQ ( REGISTER_PARAMS[i] );
+        pop_stack ( REGISTER(REGISTER_PARAMS[i]) );
+    // When no arguments are passed on the stack, only the padding is left
+    if ( expected_args <= NUM_REGISTER_PARAMS )
+        shrink_stack ( stack_depth );
+    assert ( stack_depth % 16 == 0 );
 
     skip_args:
 
-    EMIT ( "call .%s", first->name );
-    MOVQ ( RAX, RDI ); // Move the return value of the function into RDI
-    EMIT ( "call exit" ); // Exit with the return value as exit code
+    CALL ( SYMBOL_LABEL(first) );
+    // Keep the return value while the buffered output is written.
+    // %rbx is preserved by flush_output, and main never returns to anyone relying on it
+    MOVQ ( RAX, RBX );
+    CALL ( flush_output_label );
+    if ( timing )
+        generate_timing_report ( );
+    if ( instrumenting )
+        generate_profile_writer ( );
+    MOVQ ( RBX, RDI ); // Move the return value of the function into RDI
+    CALL ( exit_label ); // Exit with the return value as exit code
+
+    LABEL ( abort_label ); // In case of incorrect number of arguments
+    if ( freestanding )
+    {
+        LEAQ ( RIP_LABEL(print_text_label ( "Wrong number of arguments\\n" )), RDI );
+        CALL ( print_string_label );
+        CALL ( flush_output_label );
+    }
+    else
+    {
+        LEAQ ( RIP_LABEL(errout_label), RDI );
+        CALL ( puts_label ); // print the errout string
+    }
+    MOVQ ( IMMEDIATE(1), RDI );
+    CALL ( exit_label ); // Exit with return code 1
+
+    optimize_function ( start, "main" );
+    if ( debug_info )
+        DIRECTIVE ( "\t.cfi_endproc" );
+    FUNCTION_END ( main_label );
 
-    LABEL ( "ABORT" ); // In case of incorrect number of arguments
-    EMIT ( "leaq errout(%s), %s", RIP, RDI );
-    EMIT ( "call puts" ); // print the errout string
-    MOVQ ( "$1", RDI );
-    EMIT ( "call exit" ); // Exit with return code 1
+    generate_output_runtime ( );
 
-    generate_safe_printf();
+    if ( freestanding )
+    {
+        generate_freestanding_runtime ( );
+        GLOBAL ( start_label );
+        return;
+    }
 
-    // Declares global symbols we use or emit, such as main, printf and putchar
+    // Declares global symbols we use or emit, such as main, puts and strtol
+    GLOBAL ( main_label );
+#ifdef __APPLE__
     DIRECTIVE ( "%s", ASM_DECLARE_SYMBOLS );
+#endif
+}
+
+/* Tiered execution (tiered.c) compiles one function at a time. Global variables, strings and other functions
+ * are only referenced by label, and resolved to the interpreter's data when the function is loaded.
+ */
+void generate_tiered_function ( symbol_t *function )
+{
+    create_labels ( );
+    dispatch_labels = malloc ( global_symbols->n_symbols * sizeof(label_t) );
+    for ( size_t i = 0; i < global_symbols->n_symbols; i++ )
+        dispatch_labels[i] = named_label ( "dispatch.%s", global_symbols->symbols[i]->name );
+
+    SECTION ( SECTION_TEXT );
+    generate_function ( function );
+    generate_print_texts ( );
+
+    free ( dispatch_labels );
+    dispatch_labels = NULL;
+    free ( global_labels );
+    free ( string_labels );
+    free ( variable_locations );
+    variable_locations = NULL;
+    free ( cold_statements );
+    cold_statements = NULL;
+    cold_statements_capacity = 0;
+}
+
+/* Generates an entry point named interpret.<name> for every function, which native code can call
+ * while the function is still interpreted. It pushes the arguments into an array on the stack,
+ * and passes it to interpret_function, along with the index of the function among all functions.
+ */
+void generate_interpreter_entries ( void )
+{
+    label_t interpret_function_label = named_label ( "interpret_function" );
+    SECTION ( SECTION_TEXT );
+
+    size_t function_index = 0;
+    for ( size_t i = 0; i < global_symbols->n_symbols; i++ )
+    {
+        symbol_t *function = global_symbols->symbols[i];
+        if ( function->type != SYMBOL_FUNCTION )
+            continue;
+
+        LABEL ( named_label ( "interpret.%s", function->name ) );
+        PUSHQ ( RBP );
+        MOVQ ( RSP, RBP );
+        stack_depth = 0;
+
+        // Parameters passed on the stack are pushed again, to end up right after the ones passed in registers
+        size_t parameter_count = FUNC_PARAM_COUNT(function);
+        grow_stack ( ALIGNMENT_PADDING(parameter_count * 8) );
+        for ( size_t j = parameter_count; j-- > NUM_REGISTER_PARAMS; )
+            push_stack ( MEM_OFFSET ( 16 + (j - NUM_REGISTER_PARAMS) * 8, RBP ) );
+        for ( size_t j = parameter_count < NUM_REGISTER_PARAMS ? parameter_count : NUM_REGISTER_PARAMS; j-- > 0; )
+            push_stack ( REGISTER(REGISTER_PARAMS[j]) );
+
+        MOVQ ( RSP, RSI );
+        MOVQ ( IMMEDIATE(function_index), RDI );
+        CALL ( interpret_function_label );
+
+        MOVQ ( RBP, RSP );
+        POPQ ( RBP );
+        RET;
+        function_index++;
+    }
 }
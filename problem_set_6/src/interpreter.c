@@ -0,0 +1,248 @@
+#include "vslc.h"
+#include "bytecode.h"
+
+#include <inttypes.h>
+
+// Register windows for all active calls are taken from one stack, sized like a typical native stack
+#define REGISTER_STACK_SIZE (1 << 22)
+#define MAX_CALL_DEPTH (1 << 19)
+
+/* What a BC_RET needs to resume the caller */
+typedef struct
+{
+    const bytecode_t *call;           // The BC_CALL instruction, which holds the result register
+    int64_t *registers;
+    const bytecode_function_t *function;
+} frame_t;
+
+/* The state of the interpreter, which is shared when native code calls back into it.
+ * A nested call continues on the register stack and call stack, above where the outer one left off. */
+static bytecode_program_t *program;
+static int64_t *memory;
+static int64_t *register_stack, *register_stack_top, *register_stack_end;
+static frame_t *frames, *frame_top, *frames_end;
+
+/* How many times each function has been called, and each backward jump taken, for tiered execution */
+static uint32_t *call_counts, *backedge_counts;
+
+/* External interface */
+
+/* Parses the arguments exactly like the generated main function does, including the error message */
+void run_bytecode ( bytecode_program_t *bytecode, int64_t *global_memory, int argc, char **argv )
+{
+    program = bytecode;
+    memory = global_memory != NULL ? global_memory : calloc ( program->memory_size, sizeof(int64_t) );
+    register_stack = register_stack_top = malloc ( REGISTER_STACK_SIZE * sizeof(int64_t) );
+    register_stack_end = register_stack + REGISTER_STACK_SIZE;
+    frames = frame_top = malloc ( MAX_CALL_DEPTH * sizeof(frame_t) );
+    frames_end = frames + MAX_CALL_DEPTH;
+    if ( native_functions != NULL )
+    {
+        call_counts = calloc ( program->n_functions, sizeof(uint32_t) );
+        backedge_counts = calloc ( program->n_code, sizeof(uint32_t) );
+    }
+
+    size_t expected_args = program->functions[0].n_parameters;
+    if ( argc - 1 != expected_args )
+    {
+        puts ( "Wrong number of arguments" );
+        exit ( EXIT_FAILURE );
+    }
+
+    int64_t *arguments = malloc ( ( expected_args + 1 ) * sizeof(int64_t) );
+    for ( size_t i = 0; i < expected_args; i++ )
+        arguments[i] = strtol ( argv[i + 1], NULL, 10 );
+
+    exit ( interpret_function ( 0, arguments ) );
+}
+
+/* Internal matters */
+
+static void stack_overflow ( void )
+{
+    fprintf ( stderr, "error: stack overflow in the interpreter\n" );
+    exit ( EXIT_FAILURE );
+}
+
+typedef int64_t (*native_function_t) ( int64_t, int64_t, int64_t, int64_t, int64_t, int64_t, int64_t, int64_t,
+                                       int64_t, int64_t, int64_t, int64_t, int64_t, int64_t, int64_t, int64_t );
+static_assert ( MAX_NATIVE_PARAMETERS == 16, "native_function_t must take MAX_NATIVE_PARAMETERS arguments" );
+
+/* Calls native code with the System V calling convention. The caller removes stack arguments after the
+ * call, so passing more arguments than the function takes is harmless, and every call can pass all 16.
+ */
+static int64_t call_native ( void *code, const int64_t *arguments, size_t n_arguments )
+{
+    int64_t a[MAX_NATIVE_PARAMETERS] = { 0 };
+    memcpy ( a, arguments, n_arguments * sizeof(int64_t) );
+    return ( (native_function_t) code ) ( a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7],
+                                          a[8], a[9], a[10], a[11], a[12], a[13], a[14], a[15] );
+}
+
+/* The dispatch loop. With GCC and Clang, every handler ends in its own indirect jump to the next
+ * handler (threaded code), which predicts much better than the single jump at the top of a switch.
+ * Other compilers get the switch.
+ */
+int64_t interpret_function ( size_t function_index, const int64_t *arguments )
+{
+    // The frame at the bottom is never used, returning from it leaves the interpreter
+    frame_t *bottom_frame = frame_top;
+    frame_t *frame = bottom_frame;
+
+    const bytecode_t *code = program->code;
+    const bytecode_function_t *function = &program->functions[function_index];
+    int64_t *registers = register_stack_top;
+    if ( registers + function->n_registers > register_stack_end )
+        stack_overflow ( );
+    memcpy ( registers, arguments, function->n_parameters * sizeof(int64_t) );
+    memset ( registers + function->n_parameters, 0, ( function->n_variables - function->n_parameters ) * sizeof(int64_t) );
+    const bytecode_t *pc = &code[function->entry];
+    int64_t result;
+
+    // Calls from the interpreter are counted by BC_CALL, this counts the ones from native code
+    if ( native_functions != NULL && ++call_counts[function_index] == HOT_CALL_COUNT )
+        function_is_hot ( function_index );
+
+#define R(index) registers[index]
+// Arithmetic wraps around, like the native instructions do
+#define WRAP(a, op, b) ( (int64_t) ( (uint64_t) (a) op (uint64_t) (b) ) )
+
+#ifdef __GNUC__
+    static const void *HANDLERS[_BC_COUNT] = {
+        [BC_MOVE] = &&BC_MOVE_HANDLER, [BC_LOADI] = &&BC_LOADI_HANDLER, [BC_LOADK] = &&BC_LOADK_HANDLER,
+        [BC_LOADG] = &&BC_LOADG_HANDLER, [BC_STOREG] = &&BC_STOREG_HANDLER,
+        [BC_LOADA] = &&BC_LOADA_HANDLER, [BC_STOREA] = &&BC_STOREA_HANDLER,
+        [BC_ADD] = &&BC_ADD_HANDLER, [BC_SUB] = &&BC_SUB_HANDLER, [BC_MUL] = &&BC_MUL_HANDLER,
+        [BC_DIV] = &&BC_DIV_HANDLER, [BC_SHL] = &&BC_SHL_HANDLER, [BC_SHR] = &&BC_SHR_HANDLER,
+        [BC_NEG] = &&BC_NEG_HANDLER, [BC_ADDI] = &&BC_ADDI_HANDLER, [BC_ADDG] = &&BC_ADDG_HANDLER,
+        [BC_JMP] = &&BC_JMP_HANDLER,
+        [BC_JEQ] = &&BC_JEQ_HANDLER, [BC_JNE] = &&BC_JNE_HANDLER, [BC_JLT] = &&BC_JLT_HANDLER,
+        [BC_JLE] = &&BC_JLE_HANDLER, [BC_JGT] = &&BC_JGT_HANDLER, [BC_JGE] = &&BC_JGE_HANDLER,
+        [BC_JEQI] = &&BC_JEQI_HANDLER, [BC_JNEI] = &&BC_JNEI_HANDLER, [BC_JLTI] = &&BC_JLTI_HANDLER,
+        [BC_JLEI] = &&BC_JLEI_HANDLER, [BC_JGTI] = &&BC_JGTI_HANDLER, [BC_JGEI] = &&BC_JGEI_HANDLER,
+        [BC_CALL] = &&BC_CALL_HANDLER, [BC_RET] = &&BC_RET_HANDLER,
+        [BC_PRINTI] = &&BC_PRINTI_HANDLER, [BC_PRINTS] = &&BC_PRINTS_HANDLER, [BC_NEWLINE] = &&BC_NEWLINE_HANDLER
+    };
+#define HANDLER(opcode) opcode##_HANDLER
+#define DISPATCH() goto *HANDLERS[pc->opcode]
+#define NEXT() do { pc++; DISPATCH(); } while ( false )
+    DISPATCH();
+#else
+#define HANDLER(opcode) case opcode
+#define DISPATCH() goto dispatch
+#define NEXT() do { pc++; DISPATCH(); } while ( false )
+dispatch:
+    switch ( pc->opcode )
+    {
+#endif
+
+    HANDLER(BC_MOVE):   R(pc->a) = R(pc->b); NEXT();
+    HANDLER(BC_LOADI):  R(pc->a) = pc->b; NEXT();
+    HANDLER(BC_LOADK):  R(pc->a) = program->constants[pc->b]; NEXT();
+    HANDLER(BC_LOADG):  R(pc->a) = memory[pc->b]; NEXT();
+    HANDLER(BC_STOREG): memory[pc->b] = R(pc->a); NEXT();
+    HANDLER(BC_LOADA):  R(pc->a) = memory[pc->b + R(pc->c)]; NEXT();
+    HANDLER(BC_STOREA): memory[pc->b + R(pc->c)] = R(pc->a); NEXT();
+
+    HANDLER(BC_ADD):    R(pc->a) = WRAP ( R(pc->b), +, R(pc->c) ); NEXT();
+    HANDLER(BC_SUB):    R(pc->a) = WRAP ( R(pc->b), -, R(pc->c) ); NEXT();
+    HANDLER(BC_MUL):    R(pc->a) = WRAP ( R(pc->b), *, R(pc->c) ); NEXT();
+    HANDLER(BC_DIV):    R(pc->a) = R(pc->b) / R(pc->c); NEXT();
+    // Shift counts are masked to 6 bits, like in the native sal and sar instructions
+    HANDLER(BC_SHL):    R(pc->a) = (int64_t) ( (uint64_t) R(pc->b) << ( R(pc->c) & 63 ) ); NEXT();
+    HANDLER(BC_SHR):    R(pc->a) = R(pc->b) >> ( R(pc->c) & 63 ); NEXT();
+    HANDLER(BC_NEG):    R(pc->a) = WRAP ( 0, -, R(pc->b) ); NEXT();
+    HANDLER(BC_ADDI):   R(pc->a) = WRAP ( R(pc->b), +, pc->c ); NEXT();
+    HANDLER(BC_ADDG):   R(pc->a) = WRAP ( R(pc->b), +, memory[pc->c] ); NEXT();
+
+    HANDLER(BC_JMP):    pc = &code[pc->c]; DISPATCH();
+
+// Backward jumps are loop iterations, which are counted for tiered execution
+#define CONDITIONAL_JUMP(condition) do {                                                        \
+        if ( condition )                                                                        \
+        {                                                                                       \
+            if ( native_functions != NULL && pc->c <= pc - code                                 \
+                 && ++backedge_counts[pc - code] == HOT_BACKEDGE_COUNT )                         \
+                function_is_hot ( function - program->functions );                              \
+            pc = &code[pc->c];                                                                  \
+        }                                                                                       \
+        else                                                                                    \
+            pc++;                                                                               \
+        DISPATCH();                                                                             \
+    } while ( false )
+
+    HANDLER(BC_JEQ):    CONDITIONAL_JUMP ( R(pc->a) == R(pc->b) );
+    HANDLER(BC_JNE):    CONDITIONAL_JUMP ( R(pc->a) != R(pc->b) );
+    HANDLER(BC_JLT):    CONDITIONAL_JUMP ( R(pc->a) < R(pc->b) );
+    HANDLER(BC_JLE):    CONDITIONAL_JUMP ( R(pc->a) <= R(pc->b) );
+    HANDLER(BC_JGT):    CONDITIONAL_JUMP ( R(pc->a) > R(pc->b) );
+    HANDLER(BC_JGE):    CONDITIONAL_JUMP ( R(pc->a) >= R(pc->b) );
+    HANDLER(BC_JEQI):   CONDITIONAL_JUMP ( R(pc->a) == pc->b );
+    HANDLER(BC_JNEI):   CONDITIONAL_JUMP ( R(pc->a) != pc->b );
+    HANDLER(BC_JLTI):   CONDITIONAL_JUMP ( R(pc->a) < pc->b );
+    HANDLER(BC_JLEI):   CONDITIONAL_JUMP ( R(pc->a) <= pc->b );
+    HANDLER(BC_JGTI):   CONDITIONAL_JUMP ( R(pc->a) > pc->b );
+    HANDLER(BC_JGEI):   CONDITIONAL_JUMP ( R(pc->a) >= pc->b );
+
+    HANDLER(BC_CALL): {
+        const bytecode_function_t *callee = &program->functions[pc->b];
+        int64_t *callee_registers = registers + function->n_registers;
+
+        if ( native_functions != NULL )
+        {
+            void *native = atomic_load_explicit ( &native_functions[pc->b], memory_order_acquire );
+            if ( native != NULL )
+            {
+                // If the native code calls back into the interpreter, it continues above this frame
+                register_stack_top = callee_registers;
+                frame_top = frame;
+                R(pc->a) = call_native ( native, &R(pc->c), callee->n_parameters );
+                NEXT();
+            }
+            if ( ++call_counts[pc->b] == HOT_CALL_COUNT )
+                function_is_hot ( pc->b );
+        }
+
+        if ( callee_registers + callee->n_registers > register_stack_end || frame + 1 == frames_end )
+            stack_overflow ( );
+
+        memcpy ( callee_registers, &R(pc->c), callee->n_parameters * sizeof(int64_t) );
+        memset ( callee_registers + callee->n_parameters, 0,
+                 ( callee->n_variables - callee->n_parameters ) * sizeof(int64_t) );
+
+        *++frame = (frame_t) { .call = pc, .registers = registers, .function = function };
+        function = callee;
+        registers = callee_registers;
+        pc = &code[callee->entry];
+        DISPATCH();
+    }
+    HANDLER(BC_RET): {
+        int64_t value = R(pc->a);
+        if ( frame == bottom_frame )
+        {
+            result = value;
+            goto done;
+        }
+        pc = frame->call;
+        registers = frame->registers;
+        function = frame->function;
+        frame--;
+        R(pc->a) = value;
+        NEXT();
+    }
+
+    HANDLER(BC_PRINTI): printf ( "%" PRId64, R(pc->a) ); NEXT();
+    HANDLER(BC_PRINTS): fputs ( program->strings[pc->b], stdout ); NEXT();
+    HANDLER(BC_NEWLINE): putchar ( '\n' ); NEXT();
+
+#ifndef __GNUC__
+        default: assert ( false && "Unknown bytecode opcode" );
+    }
+#endif
+
+done:
+    // Leave the stacks like they were for an outer interpreter, if there is one
+    register_stack_top = registers;
+    frame_top = bottom_frame;
+    return result;
+}
@@ -0,0 +1,180 @@
+// MAP_ANONYMOUS is not part of POSIX
+#define _DEFAULT_SOURCE
+#include "vslc.h"
+#include "assembler.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* The library functions generated code may call, resolved to the ones linked into vslc itself */
+static const struct
+{
+    const char *name;
+    void *address;
+} HOST_FUNCTIONS[] = {
+    { "puts", (void*) puts },
+    { "strtol", (void*) strtol },
+    { "exit", (void*) exit },
+    { "write", (void*) write },
+};
+#define N_HOST_FUNCTIONS (sizeof(HOST_FUNCTIONS) / sizeof(HOST_FUNCTIONS[0]))
+
+// Library functions can be anywhere in the address space, so calls go through a stub: jmp *0(%rip)
+// followed by the absolute address of the function
+#define STUB_SIZE 14
+
+void* find_host_function ( const char *name )
+{
+    for ( size_t i = 0; i < N_HOST_FUNCTIONS; i++ )
+        if ( strcmp ( HOST_FUNCTIONS[i].name, name ) == 0 )
+            return HOST_FUNCTIONS[i].address;
+    fprintf ( stderr, "error: the generated code calls '%s', which is not available in the JIT\n", name );
+    exit ( EXIT_FAILURE );
+}
+
+static size_t round_to_pages ( size_t size, size_t page_size )
+{
+    return ( size + page_size - 1 ) / page_size * page_size;
+}
+
+/* Lays out the loaded program as
+ *     .text and library stubs | .rodata | .bss
+ * with each part starting on a new page.
+ * Every undefined label that is called gets a stub after the code, at stub_offset[label].
+ * Returns the total size.
+ */
+static size_t compute_layout ( assembly_t *assembly, size_t *stub_offset, size_t section_offset[_SECTION_COUNT] )
+{
+    size_t page_size = sysconf ( _SC_PAGESIZE );
+    section_data_t *sections = assembly->sections;
+
+    size_t code_size = sections[SECTION_TEXT].size;
+    for ( size_t i = 0; i < assembly->n_relocations; i++ )
+    {
+        label_t label = assembly->relocations[i].label;
+        if ( !assembly->labels[label].defined && assembly->relocations[i].is_call && stub_offset[label] == 0 )
+        {
+            stub_offset[label] = code_size;
+            code_size += STUB_SIZE;
+        }
+    }
+
+    section_offset[SECTION_TEXT] = 0;
+    section_offset[SECTION_RODATA] = round_to_pages ( code_size, page_size );
+    section_offset[SECTION_BSS] = section_offset[SECTION_RODATA]
+                                + round_to_pages ( sections[SECTION_RODATA].size, page_size );
+    return section_offset[SECTION_BSS] + round_to_pages ( sections[SECTION_BSS].size, page_size );
+}
+
+size_t loaded_size ( assembly_t *assembly )
+{
+    size_t *stub_offset = calloc ( assembly->n_labels, sizeof(size_t) );
+    size_t section_offset[_SECTION_COUNT];
+    size_t size = compute_layout ( assembly, stub_offset, section_offset );
+    free ( stub_offset );
+    return size;
+}
+
+/* Copies the assembled program into memory, with the layout from compute_layout.
+ * All relocations are resolved, before the pages are made executable or read only.
+ */
+void load_assembly ( assembly_t *assembly, uint8_t *memory, label_resolver_t resolve )
+{
+    section_data_t *sections = assembly->sections;
+    size_t *stub_offset = calloc ( assembly->n_labels, sizeof(size_t) );
+    size_t section_offset[_SECTION_COUNT];
+    compute_layout ( assembly, stub_offset, section_offset );
+
+    // The memory may be reused, so .bss must be cleared explicitly
+    memset ( memory + section_offset[SECTION_BSS], 0, sections[SECTION_BSS].size );
+    memcpy ( memory, sections[SECTION_TEXT].bytes, sections[SECTION_TEXT].size );
+    if ( sections[SECTION_RODATA].size > 0 )
+        memcpy ( memory + section_offset[SECTION_RODATA], sections[SECTION_RODATA].bytes,
+                 sections[SECTION_RODATA].size );
+
+    for ( size_t label = 0; label < assembly->n_labels; label++ )
+    {
+        if ( assembly->labels[label].defined || stub_offset[label] == 0 )
+            continue;
+        uint8_t *stub = memory + stub_offset[label];
+        const uint8_t jump[] = { 0xFF, 0x25, 0x00, 0x00, 0x00, 0x00 };
+        memcpy ( stub, jump, sizeof(jump) );
+        void *address = resolve ( label_name ( label ) );
+        memcpy ( stub + sizeof(jump), &address, sizeof(address) );
+    }
+
+    for ( size_t i = 0; i < assembly->n_relocations; i++ )
+    {
+        relocation_t *relocation = &assembly->relocations[i];
+        label_definition_t *label = &assembly->labels[relocation->label];
+        uint8_t *target;
+        if ( label->defined )
+            target = memory + section_offset[label->section] + label->offset;
+        else if ( stub_offset[relocation->label] != 0 )
+            target = memory + stub_offset[relocation->label];
+        else
+            target = resolve ( label_name ( relocation->label ) );
+        uint8_t *field = memory + section_offset[relocation->section] + relocation->offset;
+
+        int64_t value = target + relocation->addend - field;
+        if ( value < INT32_MIN || value > INT32_MAX )
+        {
+            fprintf ( stderr, "error: '%s' is out of reach of the loaded code\n", label_name ( relocation->label ) );
+            exit ( EXIT_FAILURE );
+        }
+        assert ( relocation->size == 4 );
+        int32_t value32 = value;
+        memcpy ( field, &value32, sizeof(value32) );
+    }
+    free ( stub_offset );
+
+    // Never writable and executable at the same time
+    if ( mprotect ( memory, section_offset[SECTION_RODATA], PROT_READ | PROT_EXEC ) != 0
+      || mprotect ( memory + section_offset[SECTION_RODATA],
+                    section_offset[SECTION_BSS] - section_offset[SECTION_RODATA], PROT_READ ) != 0 )
+    {
+        perror ( "mprotect" );
+        exit ( EXIT_FAILURE );
+    }
+}
+
+void* loaded_label_address ( assembly_t *assembly, uint8_t *memory, const char *name )
+{
+    size_t *stub_offset = calloc ( assembly->n_labels, sizeof(size_t) );
+    size_t section_offset[_SECTION_COUNT];
+    compute_layout ( assembly, stub_offset, section_offset );
+    free ( stub_offset );
+
+    for ( size_t label = 0; label < assembly->n_labels; label++ )
+    {
+        const char *label_text = label_name ( label );
+        if ( assembly->labels[label].defined && label_text != NULL && strcmp ( label_text, name ) == 0 )
+            return memory + section_offset[assembly->labels[label].section] + assembly->labels[label].offset;
+    }
+    return NULL;
+}
+
+/* Loads the program into a new memory mapping, with library functions resolved to the ones in vslc.
+ * Returns the address of the label "main", with the signature of a C main function.
+ */
+jit_entry_t load_program ( assembly_t *assembly )
+{
+    size_t total_size = loaded_size ( assembly );
+    // Anonymous mappings are zero filled, which takes care of .bss
+    uint8_t *memory = mmap ( NULL, total_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    if ( memory == MAP_FAILED )
+    {
+        perror ( "mmap" );
+        exit ( EXIT_FAILURE );
+    }
+
+    load_assembly ( assembly, memory, find_host_function );
+
+    void *main_function = loaded_label_address ( assembly, memory, "main" );
+    if ( main_function == NULL )
+    {
+        fprintf ( stderr, "error: the generated program has no main\n" );
+        exit ( EXIT_FAILURE );
+    }
+    return (jit_entry_t) main_function;
+}
@@ -13,6 +13,28 @@ int yyerror ( const char *error )
     exit ( EXIT_FAILURE );
 }
 
+/* Every reduction computes where the text of its rule starts, the way bison does by default,
+ * and new nodes are given that location */
+#define YYLLOC_DEFAULT(Current, Rhs, N)                                     \
+    do                                                                      \
+    {                                                                       \
+        if ( N )                                                            \
+        {                                                                   \
+            (Current).first_line = YYRHSLOC ( Rhs, 1 ).first_line;          \
+            (Current).first_column = YYRHSLOC ( Rhs, 1 ).first_column;      \
+            (Current).last_line = YYRHSLOC ( Rhs, N ).last_line;            \
+            (Current).last_column = YYRHSLOC ( Rhs, N ).last_column;        \
+        }                                                                   \
+        else                                                                \
+        {                                                                   \
+            (Current).first_line = (Current).last_line = YYRHSLOC ( Rhs, 0 ).last_line;       \
+            (Current).first_column = (Current).last_column = YYRHSLOC ( Rhs, 0 ).last_column; \
+        }                                                                   \
+        node_line = (Current).first_line;                                   \
+        node_column = (Current).first_column;                               \
+    }                                                                       \
+    while ( 0 )
+
 #define N0C(type,data) \
   node_create ( (type), (data), 0 )
 #define N1C(type,data,child0) \
@@ -24,6 +46,8 @@ int yyerror ( const char *error )
 
 %}
 
+%locations
+
 %token FUNC PRINT RETURN BREAK IF THEN ELSE WHILE DO VAR
 %token OPENBLOCK CLOSEBLOCK // Correspond to "begin" and "end"
 %token NUMBER IDENTIFIER STRING
@@ -0,0 +1,246 @@
+#include "vslc.h"
+#include "emit.h"
+
+// Marks every register, as returned for instructions that must never be moved or reordered
+#define ALL_REGISTERS (~0u)
+#define REGISTER_BIT(reg) (1u << (reg))
+
+static bool optimize_pass ( size_t start );
+static unsigned registers_referenced ( instruction_t *instruction );
+static bool operands_equal ( operand_t *a, operand_t *b );
+
+/* External interface */
+
+/* Repeatedly applies the peephole rules to instructions[start..n_instructions), until nothing changes.
+ * The instruction list is compacted in place.
+ * Returns the number of instructions removed, not counting labels.
+ */
+size_t peephole_optimize ( size_t start )
+{
+    size_t instructions_before = 0;
+    for ( size_t i = start; i < n_instructions; i++ )
+        if ( instructions[i].opcode < OP_LABEL )
+            instructions_before++;
+
+    while ( optimize_pass ( start ) )
+        ;
+
+    size_t instructions_after = 0;
+    for ( size_t i = start; i < n_instructions; i++ )
+        if ( instructions[i].opcode < OP_LABEL )
+            instructions_after++;
+
+    return instructions_before - instructions_after;
+}
+
+/* Internal matters */
+
+/* Returns true if the instruction at index defines the given label */
+static bool is_label ( size_t index, label_t label )
+{
+    return instructions[index].opcode == OP_LABEL && instructions[index].operands[0].label == label;
+}
+
+/* Counts how many jumps in instructions[start..] reference each label, indexed by label id.
+ * Labels above the returned *n_counted are not referenced at all.
+ */
+static size_t* count_label_references ( size_t start, label_t *n_counted )
+{
+    *n_counted = 0;
+    for ( size_t i = start; i < n_instructions; i++ )
+        if ( instructions[i].operands[0].type == OPERAND_LABEL && instructions[i].operands[0].label >= *n_counted )
+            *n_counted = instructions[i].operands[0].label + 1;
+
+    size_t *references = calloc ( *n_counted, sizeof(size_t) );
+    for ( size_t i = start; i < n_instructions; i++ )
+        if ( instructions[i].opcode != OP_LABEL && instructions[i].operands[0].type == OPERAND_LABEL )
+            references[instructions[i].operands[0].label]++;
+    return references;
+}
+
+/* Performs a single pass over the instructions, copying kept instructions from index read to index write.
+ * The rules only look at the input, so matches created by a pass are found by the next pass.
+ * Returns true if any instructions were changed.
+ */
+static bool optimize_pass ( size_t start )
+{
+    // Anonymous labels are never referenced from outside the function they were created in
+    label_t n_counted;
+    size_t *references = count_label_references ( start, &n_counted );
+
+    bool changed = false;
+    bool unreachable = false; // Set after unconditional jumps, until the next referenced label
+    size_t write = start;
+    for ( size_t read = start; read < n_instructions; read++ )
+    {
+        instruction_t *a = &instructions[read];
+        instruction_t *b = read + 1 < n_instructions ? &instructions[read+1] : NULL;
+        instruction_t *c = read + 2 < n_instructions ? &instructions[read+2] : NULL;
+
+        if ( a->opcode == OP_LABEL )
+        {
+            label_t label = a->operands[0].label;
+            // Anonymous labels that are never jumped to are removed
+            if ( label_name ( label ) == NULL && ( label >= n_counted || references[label] == 0 ) )
+            {
+                changed = true;
+                continue;
+            }
+            unreachable = false;
+            instructions[write++] = *a;
+            continue;
+        }
+
+        // Code following an unconditional jump or return can never run.
+        // Directives still describe what follows, such as the call frame of the code after a return
+        if ( unreachable && a->opcode != OP_DIRECTIVE )
+        {
+            changed = true;
+            continue;
+        }
+        // A jump to the label immediately following the jump does nothing
+        if ( a->opcode == OP_JMP || a->opcode == OP_JCC )
+        {
+            size_t next = read + 1;
+            bool jumps_to_next = false;
+            while ( next < n_instructions
+                    && ( instructions[next].opcode == OP_LABEL || instructions[next].opcode == OP_DIRECTIVE ) )
+                if ( is_label ( next++, a->operands[0].label ) )
+                    jumps_to_next = true;
+            if ( jumps_to_next )
+            {
+                changed = true;
+                continue;
+            }
+        }
+
+        if ( a->opcode == OP_JMP || a->opcode == OP_RET )
+            unreachable = true;
+
+        // movq %rax, %rax, but not movq %rax, %xmm0
+        if ( a->opcode == OP_MOVQ && a->operands[1].type == OPERAND_REGISTER
+             && operands_equal ( &a->operands[0], &a->operands[1] ) )
+        {
+            changed = true;
+            continue;
+        }
+
+        // pushq X; popq Y => movq X, Y
+        if ( a->opcode == OP_PUSHQ && b != NULL && b->opcode == OP_POPQ && b->operands[0].type == OPERAND_REGISTER )
+        {
+            operand_t source = a->operands[0];
+            operand_t destination = b->operands[0];
+            if ( !operands_equal ( &source, &destination ) )
+                instructions[write++] = (instruction_t) {
+                    .opcode = OP_MOVQ,
+                    .operands = { source, destination },
+                    .line = a->line,
+                    .column = a->column
+                };
+            read++;
+            changed = true;
+            continue;
+        }
+
+        // pushq X; I; popq Y => movq X, Y; I
+        // when X is a register or an immediate, and I does not touch the stack or Y
+        if ( a->opcode == OP_PUSHQ && a->operands[0].type != OPERAND_MEMORY
+             && c != NULL && c->opcode == OP_POPQ && c->operands[0].type == OPERAND_REGISTER )
+        {
+            unsigned forbidden = REGISTER_BIT(REG_RSP) | REGISTER_BIT(c->operands[0].base);
+            if ( ( registers_referenced ( b ) & forbidden ) == 0 )
+            {
+                operand_t source = a->operands[0];
+                operand_t destination = c->operands[0];
+                if ( !operands_equal ( &source, &destination ) )
+                    instructions[write++] = (instruction_t) {
+                        .opcode = OP_MOVQ,
+                        .operands = { source, destination },
+                        .line = a->line,
+                        .column = a->column
+                    };
+                instructions[write++] = *b;
+                read += 2;
+                changed = true;
+                continue;
+            }
+        }
+
+        // movq R, M; movq M, R2 => movq R, M; movq R, R2
+        // The second move is dropped completely when R and R2 are the same register
+        if ( a->opcode == OP_MOVQ && b != NULL && b->opcode == OP_MOVQ
+             && a->operands[0].type == OPERAND_REGISTER && a->operands[1].type == OPERAND_MEMORY
+             && b->operands[1].type == OPERAND_REGISTER && operands_equal ( &a->operands[1], &b->operands[0] ) )
+        {
+            instructions[write++] = *a;
+            if ( !operands_equal ( &a->operands[0], &b->operands[1] ) )
+                instructions[write++] = (instruction_t) {
+                    .opcode = OP_MOVQ,
+                    .operands = { a->operands[0], b->operands[1] },
+                    .line = b->line,
+                    .column = b->column
+                };
+            read++;
+            changed = true;
+            continue;
+        }
+
+        instructions[write++] = *a;
+    }
+    n_instructions = write;
+    free ( references );
+    return changed;
+}
+
+/* Returns a bitmask of the registers the instruction reads or writes, including implicit ones.
+ * Instructions that transfer control return ALL_REGISTERS, so they are never moved.
+ */
+static unsigned registers_referenced ( instruction_t *instruction )
+{
+    unsigned mask = 0;
+    for ( int i = 0; i < 2; i++ )
+    {
+        operand_t *operand = &instruction->operands[i];
+        if ( operand->type == OPERAND_REGISTER || operand->type == OPERAND_MEMORY )
+            mask |= REGISTER_BIT(operand->base);
+        if ( operand->type == OPERAND_MEMORY && operand->scale != 0 )
+            mask |= REGISTER_BIT(operand->index);
+    }
+
+    switch ( instruction->opcode )
+    {
+        case OP_MOVQ: case OP_MOVB: case OP_MOVZBQ: case OP_LEAQ: case OP_ADDQ: case OP_SUBQ: case OP_NEGQ:
+        case OP_IMULQ: case OP_ANDQ: case OP_SALQ: case OP_SARQ: case OP_SHRQ: case OP_CMPQ: case OP_CMOVQ:
+            return mask;
+        case OP_CQO:
+        case OP_MULQ:
+        case OP_IDIVQ:
+            return mask | REGISTER_BIT(REG_RAX) | REGISTER_BIT(REG_RDX);
+        case OP_PUSHQ:
+        case OP_POPQ:
+            return mask | REGISTER_BIT(REG_RSP);
+        default:
+            return ALL_REGISTERS;
+    }
+}
+
+static bool operands_equal ( operand_t *a, operand_t *b )
+{
+    if ( a->type != b->type )
+        return false;
+    switch ( a->type )
+    {
+        case OPERAND_REGISTER:
+            return a->base == b->base && a->size == b->size;
+        case OPERAND_IMMEDIATE:
+            return a->value == b->value;
+        case OPERAND_MEMORY:
+            return a->base == b->base && a->value == b->value && a->scale == b->scale
+                && ( a->scale == 0 || a->index == b->index )
+                && ( a->base != REG_RIP || a->label == b->label );
+        case OPERAND_LABEL:
+            return a->label == b->label;
+        default:
+            return true;
+    }
+}
@@ -0,0 +1,210 @@
+#include "vslc.h"
+#include "profile.h"
+
+#include <inttypes.h>
+
+profile_t *profile;
+
+static void set_count ( uint64_t **counts, size_t *n_counts, size_t index, uint64_t count );
+static uint64_t hash_node ( uint64_t hash, node_t *node );
+static void add_profile_point ( profile_point_t **points, size_t *n_points, node_t *node );
+static void number_profile_points ( profile_points_t *points, node_t *node );
+static int compare_profile_points ( const void *a, const void *b );
+
+/* External interface */
+
+void read_profile ( const char *filename )
+{
+    FILE *input = fopen ( filename, "r" );
+    if ( input == NULL )
+    {
+        perror ( filename );
+        exit ( EXIT_FAILURE );
+    }
+
+    profile = calloc ( 1, sizeof(profile_t) );
+    profile->functions = calloc ( global_symbols->n_symbols, sizeof(function_profile_t) );
+
+    // Lines for functions the program does not have are skipped, along with their blocks and call sites
+    function_profile_t *function = NULL;
+    char line[1024], name[256];
+    uint64_t hash, count;
+    size_t index, line_number = 0;
+    while ( fgets ( line, sizeof(line), input ) != NULL )
+    {
+        line_number++;
+        if ( line[0] == '#' || line[0] == '\n' )
+            continue;
+        if ( sscanf ( line, "function %255s %" SCNu64 " %" SCNu64, name, &hash, &count ) == 3 )
+        {
+            symbol_t *symbol = symbol_hashmap_lookup ( global_symbols->hashmap, name );
+            function = NULL;
+            if ( symbol == NULL || symbol->type != SYMBOL_FUNCTION )
+                continue;
+            if ( hash != structural_hash ( symbol ) )
+            {
+                fprintf ( stderr, "warning: %s: the profile of '%s' is out of date, and is ignored\n",
+                          filename, name );
+                continue;
+            }
+            function = &profile->functions[symbol->sequence_number];
+            function->present = true;
+            function->calls = count;
+            if ( count > profile->max_calls )
+                profile->max_calls = count;
+        }
+        else if ( sscanf ( line, "block %zu %" SCNu64, &index, &count ) == 2 )
+        {
+            if ( function != NULL )
+                set_count ( &function->blocks, &function->n_blocks, index, count );
+        }
+        else if ( sscanf ( line, "call %zu %" SCNu64, &index, &count ) == 2 )
+        {
+            if ( function != NULL )
+                set_count ( &function->call_sites, &function->n_call_sites, index, count );
+        }
+        else
+        {
+            fprintf ( stderr, "error: %s:%zu: malformed profile line\n", filename, line_number );
+            exit ( EXIT_FAILURE );
+        }
+    }
+    fclose ( input );
+}
+
+void destroy_profile ( void )
+{
+    if ( profile == NULL )
+        return;
+    for ( size_t i = 0; i < global_symbols->n_symbols; i++ )
+    {
+        free ( profile->functions[i].blocks );
+        free ( profile->functions[i].call_sites );
+    }
+    free ( profile->functions );
+    free ( profile );
+    profile = NULL;
+}
+
+uint64_t call_site_count ( const function_profile_t *function, size_t site )
+{
+    return site < function->n_call_sites ? function->call_sites[site] : 0;
+}
+
+// 64-bit FNV-1a
+#define HASH_OFFSET_BASIS 0xcbf29ce484222325
+#define HASH_PRIME 0x100000001b3
+
+uint64_t structural_hash ( symbol_t *function )
+{
+    return hash_node ( HASH_OFFSET_BASIS, function->node );
+}
+
+void find_profile_points ( symbol_t *function, profile_points_t *points )
+{
+    *points = (profile_points_t) { 0 };
+    number_profile_points ( points, function->node->children[2] );
+    // A function without blocks or call sites has no array of them to sort
+    if ( points->n_blocks > 0 )
+        qsort ( points->blocks, points->n_blocks, sizeof(profile_point_t), compare_profile_points );
+    if ( points->n_call_sites > 0 )
+        qsort ( points->call_sites, points->n_call_sites, sizeof(profile_point_t), compare_profile_points );
+}
+
+void destroy_profile_points ( profile_points_t *points )
+{
+    free ( points->blocks );
+    free ( points->call_sites );
+    *points = (profile_points_t) { 0 };
+}
+
+size_t find_profile_point ( const profile_point_t *points, size_t n_points, node_t *node )
+{
+    if ( n_points == 0 )
+        return SIZE_MAX;
+    profile_point_t key = { .node = node };
+    profile_point_t *point = bsearch ( &key, points, n_points, sizeof(profile_point_t), compare_profile_points );
+    return point != NULL ? point->number : SIZE_MAX;
+}
+
+/* Internal matters */
+
+static void set_count ( uint64_t **counts, size_t *n_counts, size_t index, uint64_t count )
+{
+    if ( index >= *n_counts )
+    {
+        *counts = realloc ( *counts, ( index + 1 ) * sizeof(uint64_t) );
+        memset ( &(*counts)[*n_counts], 0, ( index + 1 - *n_counts ) * sizeof(uint64_t) );
+        *n_counts = index + 1;
+    }
+    (*counts)[index] = count;
+}
+
+static uint64_t hash_bytes ( uint64_t hash, const void *bytes, size_t length )
+{
+    for ( size_t i = 0; i < length; i++ )
+        hash = ( hash ^ ( (const uint8_t*) bytes )[i] ) * HASH_PRIME;
+    return hash;
+}
+
+/* Hashes the shape of the tree, along with its names, operators and numbers */
+static uint64_t hash_node ( uint64_t hash, node_t *node )
+{
+    hash = hash_bytes ( hash, &node->type, sizeof(node->type) );
+    hash = hash_bytes ( hash, &node->n_children, sizeof(node->n_children) );
+    switch ( node->type )
+    {
+        case IDENTIFIER_DATA:
+        case EXPRESSION:
+        case RELATION:
+            if ( node->data != NULL )
+                hash = hash_bytes ( hash, node->data, strlen ( node->data ) );
+            break;
+        case NUMBER_DATA:
+            hash = hash_bytes ( hash, node->data, sizeof(int64_t) );
+            break;
+        default:
+            break;
+    }
+    for ( size_t i = 0; i < node->n_children; i++ )
+        hash = hash_node ( hash, node->children[i] );
+    return hash;
+}
+
+static void add_profile_point ( profile_point_t **points, size_t *n_points, node_t *node )
+{
+    *points = realloc ( *points, ( *n_points + 1 ) * sizeof(profile_point_t) );
+    (*points)[*n_points] = (profile_point_t) { .node = node, .number = *n_points };
+    (*n_points)++;
+}
+
+/* Numbers the blocks and call sites below node, in the order they appear */
+static void number_profile_points ( profile_points_t *points, node_t *node )
+{
+    switch ( node->type )
+    {
+        case IF_STATEMENT:
+            add_profile_point ( &points->blocks, &points->n_blocks, node->children[1] );
+            add_profile_point ( &points->blocks, &points->n_blocks,
+                                node->n_children > 2 ? node->children[2] : node->children[0] );
+            break;
+        case WHILE_STATEMENT:
+            add_profile_point ( &points->blocks, &points->n_blocks, node->children[0] );
+            add_profile_point ( &points->blocks, &points->n_blocks, node->children[1] );
+            break;
+        case FUNCTION_CALL:
+            add_profile_point ( &points->call_sites, &points->n_call_sites, node );
+            break;
+        default:
+            break;
+    }
+    for ( size_t i = 0; i < node->n_children; i++ )
+        number_profile_points ( points, node->children[i] );
+}
+
+static int compare_profile_points ( const void *a, const void *b )
+{
+    uintptr_t x = (uintptr_t) ( (const profile_point_t*) a )->node;
+    uintptr_t y = (uintptr_t) ( (const profile_point_t*) b )->node;
+    return ( x > y ) - ( x < y );
+}
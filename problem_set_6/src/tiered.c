@@ -0,0 +1,219 @@
+// MAP_ANONYMOUS and MAP_NORESERVE are not part of POSIX
+#define _DEFAULT_SOURCE
+#include "vslc.h"
+#include "bytecode.h"
+#include "emit.h"
+#include "assembler.h"
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Native code and all the data it references are placed in one reserved region of address space,
+// so that everything is within reach of 32-bit RIP-relative addressing
+#define ARENA_SIZE ((size_t) 1 << 30)
+
+_Atomic(void*) *native_functions;
+
+static bytecode_program_t *program;
+
+static uint8_t *arena;
+static size_t arena_used, page_size;
+
+/* The data native code references, all inside the arena */
+static int64_t *memory;
+static _Atomic(void*) *dispatch_table;
+static char **strings;
+
+/* Hot functions waiting to be compiled, in the order they got hot.
+ * Every function is queued at most once, so the queue never needs more room than there are functions. */
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_not_empty = PTHREAD_COND_INITIALIZER;
+static size_t *queue;
+static size_t queue_head, queue_tail;
+
+/* Only touched by the interpreter's thread */
+static bool *queued;
+
+static void* arena_allocate ( size_t size );
+static char* arena_string ( const char *string );
+static void load_interpreter_entries ( void );
+static void* compiler_thread ( void *unused );
+
+/* External interface */
+
+void run_tiered ( bytecode_program_t *bytecode, int argc, char **argv )
+{
+    program = bytecode;
+    page_size = sysconf ( _SC_PAGESIZE );
+
+    // Pages are only made accessible as they are handed out
+    arena = mmap ( NULL, ARENA_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+    if ( arena == MAP_FAILED )
+    {
+        perror ( "mmap" );
+        exit ( EXIT_FAILURE );
+    }
+
+    // Fresh anonymous pages are zero filled, as the interpreter needs
+    memory = arena_allocate ( program->memory_size * sizeof(int64_t) );
+    dispatch_table = arena_allocate ( program->n_functions * sizeof(_Atomic(void*)) );
+    strings = malloc ( program->n_strings * sizeof(char*) );
+    for ( size_t i = 0; i < program->n_strings; i++ )
+        strings[i] = arena_string ( program->strings[i] );
+
+    load_interpreter_entries ( );
+
+    native_functions = calloc ( program->n_functions, sizeof(_Atomic(void*)) );
+    queue = malloc ( program->n_functions * sizeof(size_t) );
+    queued = calloc ( program->n_functions, sizeof(bool) );
+
+    pthread_t thread;
+    if ( pthread_create ( &thread, NULL, compiler_thread, NULL ) != 0 )
+    {
+        fprintf ( stderr, "error: could not start the compiler thread\n" );
+        exit ( EXIT_FAILURE );
+    }
+    pthread_detach ( thread );
+
+    run_bytecode ( program, memory, argc, argv );
+}
+
+void function_is_hot ( size_t function_index )
+{
+    if ( queued[function_index] || program->functions[function_index].n_parameters > MAX_NATIVE_PARAMETERS )
+        return;
+    queued[function_index] = true;
+
+    pthread_mutex_lock ( &queue_lock );
+    queue[queue_tail++] = function_index;
+    pthread_cond_signal ( &queue_not_empty );
+    pthread_mutex_unlock ( &queue_lock );
+}
+
+/* Internal matters */
+
+/* Hands out page aligned, readable and writable memory from the arena */
+static void* arena_allocate ( size_t size )
+{
+    size = ( size + page_size - 1 ) / page_size * page_size;
+    if ( size > ARENA_SIZE - arena_used )
+    {
+        fprintf ( stderr, "error: out of memory for native code\n" );
+        exit ( EXIT_FAILURE );
+    }
+    uint8_t *allocation = arena + arena_used;
+    arena_used += size;
+    if ( size > 0 && mprotect ( allocation, size, PROT_READ | PROT_WRITE ) != 0 )
+    {
+        perror ( "mprotect" );
+        exit ( EXIT_FAILURE );
+    }
+    return allocation;
+}
+
+static char* arena_string ( const char *string )
+{
+    return strcpy ( arena_allocate ( strlen ( string ) + 1 ), string );
+}
+
+/* Looks up the index of a function, or the memory of a global variable or array, by its name */
+static size_t global_position ( const char *name )
+{
+    symbol_t *symbol = symbol_hashmap_lookup ( global_symbols->hashmap, name );
+    assert ( symbol != NULL );
+    return program->global_positions[symbol->sequence_number];
+}
+
+/* Native code prints through these, so its output is ordered with the interpreter's */
+static void host_print_string ( const char *string )
+{
+    fputs ( string, stdout );
+}
+
+// The format only contains %ld and %%, and unused arguments are ignored
+static void host_print_format ( const char *format, int64_t a, int64_t b, int64_t c, int64_t d, int64_t e )
+{
+    printf ( format, a, b, c, d, e );
+}
+
+/* Resolves the labels that generate_tiered_function and generate_interpreter_entries leave undefined */
+static void* resolve_label ( const char *name )
+{
+    if ( strncmp ( name, "dispatch.", strlen ( "dispatch." ) ) == 0 )
+        return &dispatch_table[global_position ( name + strlen ( "dispatch." ) )];
+    if ( name[0] == '.' )
+        return &memory[global_position ( name + 1 )];
+    size_t string_index;
+    if ( sscanf ( name, "string%zu", &string_index ) == 1 )
+        return strings[string_index];
+    if ( strcmp ( name, "interpret_function" ) == 0 )
+        return (void*) interpret_function;
+    if ( strcmp ( name, "print_string" ) == 0 )
+        return (void*) host_print_string;
+    if ( strcmp ( name, "print_format" ) == 0 )
+        return (void*) host_print_format;
+    return find_host_function ( name );
+}
+
+/* Assembles the instruction list, loads it into the arena, and frees the instruction list.
+ * The assembly is returned for looking up labels, and must be destroyed by the caller. */
+static assembly_t* load_instructions ( uint8_t **loaded )
+{
+    assembly_t *assembly = assemble_program ( );
+    *loaded = arena_allocate ( loaded_size ( assembly ) );
+    load_assembly ( assembly, *loaded, resolve_label );
+    return assembly;
+}
+
+/* Until a function is compiled, its dispatch table entry calls back into the interpreter */
+static void load_interpreter_entries ( void )
+{
+    generate_interpreter_entries ( );
+    uint8_t *loaded;
+    assembly_t *assembly = load_instructions ( &loaded );
+    for ( size_t i = 0; i < program->n_functions; i++ )
+    {
+        char name[256];
+        snprintf ( name, sizeof(name), "interpret.%s", program->functions[i].symbol->name );
+        atomic_store_explicit ( &dispatch_table[i], loaded_label_address ( assembly, loaded, name ),
+                                memory_order_relaxed );
+    }
+    destroy_assembly ( assembly );
+    destroy_instructions ( );
+}
+
+/* Generates and loads native code for the function, then points both the dispatch table and the interpreter
+ * to it. The code is complete and executable before it is published. */
+static void compile_function ( size_t function_index )
+{
+    symbol_t *symbol = program->functions[function_index].symbol;
+    generate_tiered_function ( symbol );
+    uint8_t *loaded;
+    assembly_t *assembly = load_instructions ( &loaded );
+
+    char name[256];
+    snprintf ( name, sizeof(name), ".%s", symbol->name );
+    void *code = loaded_label_address ( assembly, loaded, name );
+    destroy_assembly ( assembly );
+    destroy_instructions ( );
+
+    atomic_store_explicit ( &dispatch_table[function_index], code, memory_order_release );
+    atomic_store_explicit ( &native_functions[function_index], code, memory_order_release );
+}
+
+/* The only thread that uses the code generator once the program runs. It lives until the program exits. */
+static void* compiler_thread ( void *unused )
+{
+    while ( true )
+    {
+        pthread_mutex_lock ( &queue_lock );
+        while ( queue_head == queue_tail )
+            pthread_cond_wait ( &queue_not_empty, &queue_lock );
+        size_t function_index = queue[queue_head++];
+        pthread_mutex_unlock ( &queue_lock );
+
+        compile_function ( function_index );
+    }
+    return NULL;
+}
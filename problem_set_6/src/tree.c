@@ -4,6 +4,9 @@
 // Global root for abstract syntax tree
 node_t *root;
 
+// Where the text of the nodes created next starts, set by the parser
+int node_line, node_column;
+
 // Declarations of internal functions, defined further down
 static void node_print ( node_t *node, int nesting );
 static void destroy_subtree ( node_t *discard );
@@ -44,6 +47,9 @@ node_t* node_create ( node_type_t type, void *data, size_t n_children, ... )
 
         .data = data,
         .symbol = NULL,
+
+        .line = node_line,
+        .column = node_column
     };
 
     // Read each child node from the va_list
@@ -201,10 +207,15 @@ static node_t* constant_fold_node ( node_t *node )
     else
         assert ( false && "Unknown expression type" );
 
+    // The number takes the place of the expression in the source
+    node_t *number = node_create ( NUMBER_DATA, result, 0);
+    number->line = node->line;
+    number->column = node->column;
+
     // Clean up the old subtree
     destroy_subtree ( node );
 
-    return node_create ( NUMBER_DATA, result, 0);
+    return number;
 }
 
 // Recursively replaces multiplication and division by powers of two, with bitshifts
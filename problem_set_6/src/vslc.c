@@ -1,14 +1,41 @@
 #include "vslc.h"
+#include "emit.h"
+#include "assembler.h"
+#include "bytecode.h"
+#include "profile.h"
 
 #include <getopt.h>
 
 /* Command line option parsing for the main function */
 static void options ( int argc, char **argv );
+static void write_object_file ( const char *filename );
+static jit_entry_t compile_to_memory ( void );
 static bool
     print_full_tree = false,
     print_tree_after_simplify = false,
     print_symbol_table_contents = false,
-    print_generated_program = false;
+    print_generated_program = false,
+    run_program = false,
+    interpret_program = false,
+    run_tiered_program = false;
+static const char *object_file_name = NULL;
+static const char *profile_file_name = NULL;
+
+// Where -fprofile-generate writes the profile, unless given a file name
+#define DEFAULT_PROFILE_NAME "vsl.profile"
+
+/* The arguments given to the program when it is run with -r, -i or -x */
+static int program_argc;
+static char **program_argv;
+
+bool print_peephole_statistics = false;
+bool freestanding = false;
+bool vectorize = true;
+bool avx2 = false;
+const char *profile_output = NULL;
+bool instrument_functions = false;
+bool debug_info = false;
+const char *source_name = "<stdin>";
 
 /* Entry point */
 int main ( int argc, char **argv )
@@ -31,16 +58,43 @@ int main ( int argc, char **argv )
     if ( print_symbol_table_contents )
         print_tables ();
 
+    // In profile.c
+    if ( profile_file_name != NULL )
+        read_profile ( profile_file_name );
+
+    // Operations in bytecode.c
+    bytecode_program_t *bytecode = interpret_program || run_tiered_program ? compile_bytecode () : NULL;
+
+    // In tiered.c. Never returns, and keeps the syntax tree and symbol tables for generating native code
+    if ( run_tiered_program )
+        run_tiered ( bytecode, program_argc, program_argv );
+
     // Operations in generator.c
-    if ( print_generated_program )
+    if ( print_generated_program || object_file_name != NULL || run_program )
         generate_program ();
 
+    // Operations in emit.c, assembler.c and jit.c
+    if ( print_generated_program )
+        write_instructions ( stdout );
+    if ( object_file_name != NULL )
+        write_object_file ( object_file_name );
+    jit_entry_t entry = run_program ? compile_to_memory () : NULL;
+    destroy_instructions ();
+
+    destroy_profile ();         // In profile.c
     destroy_tables ();          // In symbols.c
     destroy_syntax_tree ();     // In tree.c
+
+    // The generated main function never returns, it calls exit
+    if ( entry != NULL )
+        return entry ( program_argc, program_argv );
+    // In interpreter.c, also calls exit
+    if ( bytecode != NULL )
+        run_bytecode ( bytecode, NULL, program_argc, program_argv );
 }
 
 static const char *usage =
-"Usage vslc [OPTION...]\n"
+"Usage vslc [OPTION...] [-r|-i|-x [ARGUMENT...]]\n"
 "\n"
 "Input is read from stdin, output is printed to stdout.\n"
 "\n"
@@ -48,13 +102,87 @@ static const char *usage =
 "\t-t\tOutput the abstract syntax tree\n"
 "\t-T\tOutput the abstract syntax tree after simplification\n"
 "\t-s\tOutput the symbol table contents\n"
-"\t-c\tCompile and generate assembly output\n";
+"\t-c\tCompile and generate assembly output\n"
+"\t-g\tMark the source line of every statement, and the call frame of every function, in the assembly\n"
+"\t\toutput, for debuggers and profilers. The built-in assembler leaves them out\n"
+"\t-o FILE\tCompile and write an ELF object file to FILE, using the built-in assembler\n"
+"\t-r\tCompile into memory and run the program, passing it all remaining arguments. Must come last\n"
+"\t-i\tLike -r, but run the program in the bytecode interpreter\n"
+"\t-x\tLike -i, but compile hot functions to native code in the background\n"
+"\t-P\tPrint the number of instructions removed by the peephole optimizer in each function to stderr\n"
+"\t-ffreestanding\n"
+"\t\tGenerate a program that starts at _start and makes system calls itself, for linking without libc\n"
+"\t-fsource-name=FILE\n"
+"\t\tThe name of the source file read from stdin, for -g\n"
+"\t-fno-vectorize\n"
+"\t\tDo not turn simple loops over arrays into SSE2 or AVX2 code\n"
+"\t-finstrument\n"
+"\t\tMake the program count the calls and time stamp counter cycles of every function, and print\n"
+"\t\tthem to stderr when it exits, the functions that took the most cycles of their own first\n"
+"\t-fprofile-generate[=FILE]\n"
+"\t\tMake the program count how often every function, branch, loop and call runs, and write the\n"
+"\t\tcounts to FILE when it exits, " DEFAULT_PROFILE_NAME " if not given\n"
+"\t-fprofile-use=FILE\n"
+"\t\tLay out functions, branches and loops by how often they ran in the profile in FILE,\n"
+"\t\tputting the most called functions in .text.hot and the ones that never ran in .text.unlikely\n"
+"\t-mavx2\tVectorize loops with 256-bit AVX2 instructions, instead of 128-bit SSE2 instructions\n";
+
+
+/* Handles -f<feature> options */
+static void feature_option ( const char *program_name, const char *feature )
+{
+    if ( strcmp ( feature, "freestanding" ) == 0 )
+    {
+#ifdef __APPLE__
+        fprintf ( stderr, "%s: -ffreestanding is only supported on Linux\n", program_name );
+        exit ( EXIT_FAILURE );
+#endif
+        freestanding = true;
+    }
+    else if ( strcmp ( feature, "no-vectorize" ) == 0 )
+        vectorize = false;
+    else if ( strncmp ( feature, "profile-use=", strlen ( "profile-use=" ) ) == 0 )
+        profile_file_name = feature + strlen ( "profile-use=" );
+    else if ( strncmp ( feature, "source-name=", strlen ( "source-name=" ) ) == 0 )
+        source_name = feature + strlen ( "source-name=" );
+    else if ( strcmp ( feature, "instrument" ) == 0 )
+        instrument_functions = true;
+    else if ( strcmp ( feature, "profile-generate" ) == 0
+              || strncmp ( feature, "profile-generate=", strlen ( "profile-generate=" ) ) == 0 )
+    {
+#ifdef __APPLE__
+        fprintf ( stderr, "%s: -fprofile-generate is only supported on Linux\n", program_name );
+        exit ( EXIT_FAILURE );
+#endif
+        profile_output = feature[strlen ( "profile-generate" )] == '=' ?
+            feature + strlen ( "profile-generate=" ) : DEFAULT_PROFILE_NAME;
+    }
+    else
+    {
+        fprintf ( stderr, "%s: unknown option '-f%s'\n", program_name, feature );
+        exit ( EXIT_FAILURE );
+    }
+}
 
+/* Handles -m<machine> options */
+static void machine_option ( const char *program_name, const char *machine )
+{
+    if ( strcmp ( machine, "avx2" ) == 0 )
+        avx2 = true;
+    else
+    {
+        fprintf ( stderr, "%s: unknown option '-m%s'\n", program_name, machine );
+        exit ( EXIT_FAILURE );
+    }
+}
 
 static void options ( int argc, char **argv )
 {
     int o;
-    while ( (o=getopt(argc,argv,"htTsc")) != -1 )
+    // Everything after -r, -i or -x belongs to the program, even arguments that look like options, such as -5.
+    // The leading + stops getopt from reordering arguments
+    while ( !run_program && !interpret_program && !run_tiered_program
+            && (o=getopt(argc,argv,"+htTscgPo:rixf:m:")) != -1 )
     {
         switch ( o )
         {
@@ -68,12 +196,52 @@ static void options ( int argc, char **argv )
             case 'T':   print_tree_after_simplify  = true;  break;
             case 's':   print_symbol_table_contents = true; break;
             case 'c':   print_generated_program = true;     break;
+            case 'g':   debug_info = true;                  break;
+            case 'P':   print_peephole_statistics = true;   break;
+            case 'o':   object_file_name = optarg;          break;
+            case 'r':   run_program = true;                 break;
+            case 'i':   interpret_program = true;           break;
+            case 'x':   run_tiered_program = true;          break;
+            case 'f':   feature_option ( argv[0], optarg ); break;
+            case 'm':   machine_option ( argv[0], optarg ); break;
         }
     }
 
-    if ( optind != argc )
+    if ( run_program || interpret_program || run_tiered_program )
+    {
+        // The program sees its arguments starting at argv[1], like a normal main function
+        program_argc = argc - optind + 1;
+        program_argv = &argv[optind - 1];
+        program_argv[0] = argv[0];
+    }
+    else if ( optind != argc )
     {
         fprintf ( stderr, "%s: invalid positional argument '%s'\n", argv[0], argv[optind] );
         exit ( EXIT_FAILURE );
     }
 }
+
+/* Assembles the generated program, and writes it to the given file as an object file */
+static void write_object_file ( const char *filename )
+{
+    FILE *output = fopen ( filename, "wb" );
+    if ( output == NULL )
+    {
+        perror ( filename );
+        exit ( EXIT_FAILURE );
+    }
+
+    assembly_t *assembly = assemble_program ();
+    write_elf_object ( assembly, output );
+    destroy_assembly ( assembly );
+    fclose ( output );
+}
+
+/* Assembles the generated program into executable memory, and returns its main function */
+static jit_entry_t compile_to_memory ( void )
+{
+    assembly_t *assembly = assemble_program ();
+    jit_entry_t entry = load_program ( assembly );
+    destroy_assembly ( assembly );
+    return entry;
+}
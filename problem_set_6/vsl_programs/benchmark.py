@@ -0,0 +1,73 @@
+#!/usr/bin/env python3
+
+import sys
+import subprocess
+import os.path
+import tempfile
+import time
+
+name, *args = sys.argv
+
+USAGE = f"""
+Usage: {name} <vslc> <file.vsl>...
+
+Compares running each program in the bytecode interpreter (vslc -i) against
+building it natively (vslc -c, then gcc) and running the binary.
+Every //TESTCASE: <args> in a file is run, and all times are summed over the test cases.
+The outputs of the two ways of running the program must match.
+""".strip()
+
+TESTCASE_LINE = "//TESTCASE:"
+REPETITIONS = 20
+
+def error(text, message=None):
+    print(f"{name}: error: {text}")
+    if message is not None:
+        print(message)
+    sys.exit(1)
+
+if len(args) < 2:
+    error("expected vslc and at least one input .vsl file", message=USAGE)
+
+vslc, *vsl_files = args
+
+def find_testcases(vsl_file):
+    with open(vsl_file, "r", encoding="utf-8") as vsl_fd:
+        return [line[len(TESTCASE_LINE):].split() for line in vsl_fd if line.startswith(TESTCASE_LINE)]
+
+def timed_run(command, stdin=None):
+    """Runs the command REPETITIONS times, returning the output and the average time in milliseconds"""
+    start = time.perf_counter()
+    for _ in range(REPETITIONS):
+        if stdin is not None:
+            stdin.seek(0)
+        proc = subprocess.run(command, stdin=stdin, capture_output=True, check=False, timeout=5)
+    return proc.stdout, (time.perf_counter() - start) * 1000 / REPETITIONS
+
+print(f"{'program':<24} {'build':>10} {'native':>10} {'-i':>10}   (milliseconds, average of {REPETITIONS} runs)")
+
+with tempfile.TemporaryDirectory() as build_dir:
+    for vsl_file in vsl_files:
+        testcases = find_testcases(vsl_file)
+        if not testcases:
+            continue
+
+        assembly = os.path.join(build_dir, "program.S")
+        binary = os.path.join(build_dir, "program.out")
+        start = time.perf_counter()
+        with open(vsl_file, "rb") as source, open(assembly, "wb") as output:
+            subprocess.run([vslc, "-c"], stdin=source, stdout=output, check=True)
+        subprocess.run(["gcc", "-z", "noexecstack", assembly, "-o", binary], check=True)
+        build_time = (time.perf_counter() - start) * 1000
+
+        native_time = interpreter_time = 0
+        with open(vsl_file, "rb") as source:
+            for args in testcases:
+                native_output, elapsed = timed_run([binary] + args)
+                native_time += elapsed
+                interpreter_output, elapsed = timed_run([vslc, "-i"] + args, stdin=source)
+                interpreter_time += elapsed
+                if native_output != interpreter_output:
+                    error(f"{vsl_file} {' '.join(args)}: the interpreter's output differs from the native program")
+
+        print(f"{os.path.basename(vsl_file):<24} {build_time:>10.2f} {native_time:>10.2f} {interpreter_time:>10.2f}")
@@ -0,0 +1,75 @@
+#!/usr/bin/env python3
+
+import sys
+import subprocess
+import os.path
+
+name, *args = sys.argv
+
+USAGE = f"""
+Usage: {name} <vslc> <option> <file.vsl>...
+
+For each occurance of a VSL comment block starting with
+//TESTCASE: <args>
+the program is run with vslc <option> <args>, where the option is -r, -i or -x, reading the program from stdin.
+Output is compared against the rest of the comment block.
+If they are different, the difference is printed and the test fails.
+""".strip()
+
+TESTCASE_LINE = "//TESTCASE:"
+
+def error(text, message=None):
+    print(f"{name}: error: {text}")
+    if message is not None:
+        print(message)
+    sys.exit(1)
+
+if len(args) < 3:
+    error("expected vslc, an option, and at least one input .vsl file", message=USAGE)
+
+vslc, option, *vsl_files = args
+
+if option not in ("-r", "-i", "-x"):
+    error(f"expected -r, -i or -x, not {option}", message=USAGE)
+
+def find_tests(vsl_file):
+    with open(vsl_file, "r", encoding="utf-8") as vsl_fd:
+        lines = vsl_fd.read().splitlines()
+
+    tests = []
+    i = 0
+    while i < len(lines):
+        line = lines[i]
+        if line.startswith(TESTCASE_LINE):
+            args = line[len(TESTCASE_LINE):].split()
+            expected_output = []
+            i += 1
+            while i < len(lines) and lines[i].startswith("//") and not lines[i].startswith(TESTCASE_LINE):
+                expected_output.append(lines[i][2:])
+                i += 1
+            tests.append((args, expected_output))
+        else:
+            i += 1
+    return tests
+
+for vsl_file in vsl_files:
+    if not os.path.isfile(vsl_file):
+        error(f"file not found: {vsl_file}")
+
+    tests = find_tests(vsl_file)
+    print(f"Running {len(tests)} test cases for file {vsl_file} with {option}")
+
+    for args, expected_output in tests:
+        print(f"  Running {vslc} {option} {' '.join(args)} < {vsl_file}")
+        with open(vsl_file, "rb") as source:
+            proc = subprocess.run([vslc, option] + args, stdin=source, capture_output=True, text=True,
+                                  check=False, timeout=10)
+        result_lines = proc.stdout.strip().split('\n')
+
+        if len(result_lines) != len(expected_output) or any(a != b for a, b in zip(result_lines, expected_output)):
+            message = ["EXPECTED --------",
+                       "\n".join(expected_output),
+                       "ACTUAL ----------",
+                       "\n".join(result_lines),
+                       "-----------------"]
+            error(f"{vsl_file} {' '.join(args)}: actual output didn't match expected output", message="\n".join(message))
@@ -0,0 +1,130 @@
+#!/usr/bin/env python3
+
+import sys
+import subprocess
+import os.path
+import re
+import tempfile
+
+name, *args = sys.argv
+
+USAGE = f"""
+Usage: {name} <vslc> <file.vsl>...
+
+Checks that profile guided optimization does not change what a program does.
+Each program is built with -fprofile-generate, and for every //TESTCASE: <args> in the file,
+the instrumented program is run with the given <args>, and the program is rebuilt with
+-fprofile-use from the profile it wrote. The output of the instrumented and the rebuilt
+program must match the program built without a profile.
+The program is also rebuilt from a profile whose functions no longer match the program,
+which must warn that every function's profile is out of date, and change nothing.
+
+For every comment block starting with
+//PROFILE: <args>
+the instrumented program is run with the given <args>, and the profile it writes must match
+the rest of the comment block, with the hash left out of the function lines.
+""".strip()
+
+TESTCASE_LINE = "//TESTCASE:"
+PROFILE_LINE = "//PROFILE:"
+FUNCTION_LINE = re.compile(r"^function (\S+) (\d+) (\d+)$", re.MULTILINE)
+
+def error(text, message=None):
+    print(f"{name}: error: {text}")
+    if message is not None:
+        print(message)
+    sys.exit(1)
+
+if len(args) < 2:
+    error("expected vslc and at least one input .vsl file", message=USAGE)
+
+vslc, *vsl_files = args
+
+def find_testcases(vsl_file):
+    with open(vsl_file, "r", encoding="utf-8") as vsl_fd:
+        return [line[len(TESTCASE_LINE):].split() for line in vsl_fd if line.startswith(TESTCASE_LINE)]
+
+def find_profiles(vsl_file):
+    """Returns the arguments and the expected profile of every //PROFILE: block"""
+    with open(vsl_file, "r", encoding="utf-8") as vsl_fd:
+        lines = vsl_fd.read().splitlines()
+
+    profiles = []
+    i = 0
+    while i < len(lines):
+        line = lines[i]
+        i += 1
+        if line.startswith(PROFILE_LINE):
+            args = line[len(PROFILE_LINE):].split()
+            expected_profile = []
+            while i < len(lines) and lines[i].startswith("//") \
+                    and not lines[i].startswith(PROFILE_LINE) and not lines[i].startswith(TESTCASE_LINE):
+                expected_profile.append(lines[i][2:])
+                i += 1
+            profiles.append((args, expected_profile))
+    return profiles
+
+def build(vsl_file, binary, flags):
+    """Builds the program with the built-in assembler, returning what vslc printed to stderr"""
+    obj = binary[:binary.rindex(".")] + ".o"
+    with open(vsl_file, "rb") as source:
+        proc = subprocess.run([vslc] + flags + ["-o", obj], stdin=source, capture_output=True, text=True, check=False)
+    if proc.returncode != 0:
+        error(f"{vsl_file}: vslc {' '.join(flags)} failed", message=proc.stderr)
+    subprocess.run(["gcc", "-z", "noexecstack", obj, "-o", binary], check=True)
+    return proc.stderr
+
+def run(binary, args):
+    return subprocess.run([binary] + args, capture_output=True, check=False, timeout=5).stdout
+
+with tempfile.TemporaryDirectory() as build_dir:
+    plain = os.path.join(build_dir, "plain.out")
+    instrumented = os.path.join(build_dir, "instrumented.out")
+    profiled = os.path.join(build_dir, "profiled.out")
+    profile = os.path.join(build_dir, "vsl.profile")
+    stale_profile = os.path.join(build_dir, "stale.profile")
+
+    for vsl_file in vsl_files:
+        testcases = find_testcases(vsl_file)
+        if not testcases:
+            continue
+
+        print(f"Running {len(testcases)} test cases for file {vsl_file}")
+        build(vsl_file, plain, [])
+        build(vsl_file, instrumented, [f"-fprofile-generate={profile}"])
+
+        for args in testcases:
+            expected_output = run(plain, args)
+            if run(instrumented, args) != expected_output:
+                error(f"{vsl_file} {' '.join(args)}: the instrumented program's output differs")
+            build(vsl_file, profiled, [f"-fprofile-use={profile}"])
+            if run(profiled, args) != expected_output:
+                error(f"{vsl_file} {' '.join(args)}: the output differs when built with the profile")
+
+        # A function that changed since the profile was written hashes differently
+        with open(profile, "r", encoding="utf-8") as profile_fd:
+            text = profile_fd.read()
+        functions = FUNCTION_LINE.findall(text)
+        with open(stale_profile, "w", encoding="utf-8") as profile_fd:
+            profile_fd.write(FUNCTION_LINE.sub(lambda m: f"function {m[1]} {(int(m[2]) + 1) % 2**64} {m[3]}", text))
+
+        warnings = build(vsl_file, profiled, [f"-fprofile-use={stale_profile}"])
+        for function, _, _ in functions:
+            if f"the profile of '{function}' is out of date" not in warnings:
+                error(f"{vsl_file}: the stale profile of '{function}' was not ignored", message=warnings)
+        for args in testcases:
+            if run(profiled, args) != run(plain, args):
+                error(f"{vsl_file} {' '.join(args)}: the output differs when built with a stale profile")
+
+        for args, expected_profile in find_profiles(vsl_file):
+            run(instrumented, args)
+            with open(profile, "r", encoding="utf-8") as profile_fd:
+                text = FUNCTION_LINE.sub(lambda m: f"function {m[1]} {m[3]}", profile_fd.read())
+            result_lines = text.strip().split("\n")
+            if result_lines != expected_profile:
+                message = ["EXPECTED --------",
+                           "\n".join(expected_profile),
+                           "ACTUAL ----------",
+                           "\n".join(result_lines),
+                           "-----------------"]
+                error(f"{vsl_file} {' '.join(args)}: the profile differs from the expected one", message="\n".join(message))